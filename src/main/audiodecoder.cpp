@@ -1,83 +1,148 @@
 
 #include <cstring>
-#include <thread>
 #include <cassert>
 #include "audiodecoder.h"
 
-void audioCallback(void *userdata, Uint8 *stream, int len)
+AudioDecoder::AudioDecoder()
+  : m_videoState(nullptr)
+  , m_packet(nullptr)
+  , m_frame(nullptr)
+  , m_audioClock(0)
+  , m_compensating(0)
+  , m_pcm(nullptr)
+  , m_pcmSize(0)
 {
-  // retrieve the videostate
-  VideoState *videoState = (VideoState *) userdata;
+}
 
-  int len1 = -1;
-  int audio_size = -1;
+AudioDecoder::~AudioDecoder()
+{
+  this->stop();
 
-  double pts = 0;
+  // every task of the session is stopped and the audio device closed, nothing reads these anymore
+  if (m_videoState)
+  {
+    m_videoState->audioq.setConsumer(nullptr);
+    m_videoState->audio_ring.setWriter(nullptr);
+  }
 
-  while (len > 0)
+  // wipe the frame and the packet
+  av_frame_free(&m_frame);
+  av_packet_free(&m_packet);
+  m_videoState = nullptr;
+}
+
+int AudioDecoder::start(VideoState *videoState)
+{
+  m_videoState = videoState;
+  if (!m_videoState)
   {
-    // check global quit flag
-    if (videoState->quit)
-    {
-      return;
-    }
+    return -1;
+  }
 
-    if (videoState->audio_buf_index >= videoState->audio_buf_size)
-    {
-      // we have already sent all avaialble data; get more
-      audio_size = audioDecodeFrame(videoState, videoState->audio_buf, sizeof(videoState->audio_buf), &pts);
+  // allocate an AVPacket to be used to retrieve data from the audioq.
+  m_packet = av_packet_alloc();
+  if (m_packet == nullptr)
+  {
+    std::cerr << "Could not alloc packet" << std::endl;
+    return -1;
+  }
 
-      if (audio_size < 0)
-      {
-        // output silence
-        videoState->audio_buf_size = 1024;
+  // allocate a new AVFrame, used to decode audio packets
+  m_frame = av_frame_alloc();
+  if (!m_frame)
+  {
+    std::cerr << "Could not allocate AVFrame" << std::endl;
+    return -1;
+  }
 
-        // clear memory
-        std::memset(videoState->audio_buf, 0, videoState->audio_buf_size);
-      }
-      else
-      {
-        audio_size = syncAudio(videoState, (int16_t *)videoState->audio_buf, audio_size);
-        videoState->audio_buf_size = audio_size;
-      }
+  // run on the workers by the packets coming in and the room made in the pcm ring
+  m_task.start(m_videoState->executor, false, [this]()
+  {
+    this->decodeTask();
+  });
+  m_videoState->audioq.setConsumer(&m_task);
+  m_videoState->audio_ring.setWriter(&m_task);
+  m_task.notify();
 
-      videoState->audio_buf_index = 0;
-    }
+  return 0;
+}
 
-    len1 = videoState->audio_buf_size - videoState->audio_buf_index;
+void AudioDecoder::stop()
+{
+  // waits for the current run, notifying the task does nothing from now on
+  m_task.stop();
+}
 
-    if (len1 > len)
-    {
-      len1 = len;
-    }
+void AudioDecoder::stopAsync(std::function<void()> done)
+{
+  // the audio callback may still notify the task until the device is closed, it is ignored
+  m_task.stopAsync(std::move(done));
+}
 
-    // copy data from audio buffer to the SDL stream
-    std::memcpy(stream, (uint8_t *)videoState->audio_buf + videoState->audio_buf_index, len1);
+void AudioDecoder::audioCallback(void *userdata, Uint8 *stream, int len)
+{
+  // retrieve the videostate
+  VideoState *videoState = (VideoState *) userdata;
 
-    len -= len1;
-    stream += len1;
-    videoState->audio_buf_index += len1;
+  // only copy out of the pcm ring, decoding happens in the audio decoder task
+  size_t copied = videoState->audio_ring.read(stream, len);
+  if (copied < (size_t)len)
+  {
+    // the decoder fell behind (or we are quitting), output silence for the rest
+    std::memset(stream + copied, 0, len - copied);
   }
 }
 
-int audioDecodeFrame(VideoState *videoState, uint8_t *audio_buf, int buf_size, double *pts_ptr)
+void AudioDecoder::decodeTask()
 {
-  AVPacket *avPacket = av_packet_alloc();
-  static uint8_t *audio_pkt_data = nullptr;
-  static int audio_pkt_size = 0;
+  VideoState *videoState = m_videoState;
+
+  // hand the pcm over to the audio callback, the next read notifies this task while the ring is full
+  while (m_pcmSize > 0 && !videoState->quit)
+  {
+    size_t written = videoState->audio_ring.write(m_pcm, m_pcmSize);
+    m_pcm += written;
+    m_pcmSize -= written;
+    if (written > 0)
+    {
+      // the audio clock points at the end of the data queued in the ring, getAudioClock()
+      // subtracts what the ring holds; the part of the chunk not written yet is not in it
+      int bytes_per_sec = 2 * videoState->audio_ctx->ch_layout.nb_channels * videoState->audio_ctx->sample_rate;
+      videoState->audio_clock = bytes_per_sec > 0 ? m_audioClock - (double)m_pcmSize / bytes_per_sec : m_audioClock;
+    }
+    if (m_pcmSize > 0 && !videoState->audio_ring.waitForSpace(m_pcmSize))
+    {
+      return;
+    }
+  }
 
+  // decode and resample the next chunk of pcm
   double pts = 0;
-  int n = 0;
+  int audio_size = this->audioDecodeFrame(videoState, videoState->audio_buf, sizeof(videoState->audio_buf), &pts);
+  if (audio_size <= 0)
+  {
+    // quitting, or nothing queued: the reader notifies this task with the next packet
+    return;
+  }
 
-  // allocate a new frame, used to decode audio packets
-  static AVFrame *avFrame = nullptr;
-  avFrame = av_frame_alloc();
-  if (!avFrame)
+  if (videoState->headless)
   {
-    return -1;
+    // no audio device in headless mode, the pcm is dropped once decoded
+    videoState->audio_clock = m_audioClock;
+  }
+  else
+  {
+    m_pcm = videoState->audio_buf;
+    m_pcmSize = this->syncAudio(videoState, (int16_t *)videoState->audio_buf, audio_size);
   }
 
-  int len1 = 0;
+  // one frame per run, the workers go to the other sessions in between
+  m_task.notify();
+}
+
+int AudioDecoder::audioDecodeFrame(VideoState *videoState, uint8_t *audio_buf, int buf_size, double *pts_ptr)
+{
+  int n = 0;
   int data_size = 0;
 
   for (;;)
@@ -85,317 +150,207 @@ int audioDecodeFrame(VideoState *videoState, uint8_t *audio_buf, int buf_size, d
     // check global quit flag
     if (videoState->quit)
     {
-      av_frame_unref(avFrame);
-      avFrame = nullptr;
       return -1;
     }
 
-    while (audio_pkt_size > 0)
+    // get decoded output data from decoder first, one packet can hold several frames
+    int ret = avcodec_receive_frame(videoState->audio_ctx, m_frame);
+    if (ret == 0)
     {
-      int got_frame = 0;
-
-      int ret = avcodec_receive_frame(videoState->audio_ctx, avFrame);
-      if (ret == 0)
-      {
-        got_frame = 1;
-      }
-
-      if (ret == AVERROR(EAGAIN))
-      {
-        ret = 0;
-      }
-
-      if (ret == 0)
+      videoState->audio_frames_decoded.fetch_add(1, std::memory_order_relaxed);
+      if (videoState->bench_stats)
       {
-        ret = avcodec_send_packet(videoState->audio_ctx, avPacket);
+        videoState->bench_stats->addAudioFrame();
       }
 
-      if (ret == AVERROR(EAGAIN))
-      {
-        ret = 0;
-      }
-      else if (ret < 0)
-      {
-        return -1;
-      }
-      else
-      {
-        len1 = avPacket->size;
-      }
-
-      if (len1 < 0)
+      // keep audio_clock up to date
+      if (m_frame->pts != AV_NOPTS_VALUE)
       {
-        // if error, skip frame
-        audio_pkt_size = 0;
-        break;
+        m_audioClock = av_q2d(videoState->audio_ctx->pkt_timebase) * m_frame->pts;
       }
 
-      audio_pkt_data += len1;
-      audio_pkt_size -= len1;
-      data_size = 0;
-
-      if (got_frame)
-      {
-        // audio resampling
-        data_size = audioResampling(
-          videoState
-          , avFrame
-          , AV_SAMPLE_FMT_S16
-          , audio_buf);
-
-        assert(data_size <= buf_size);
-      }
+      // audio resampling
+      data_size = this->audioResampling(
+        videoState
+        , m_frame
+        , AV_SAMPLE_FMT_S16
+        , audio_buf);
+      av_frame_unref(m_frame);
 
       if (data_size <= 0)
       {
         // no data yet, get more frames
         continue;
       }
+      assert(data_size <= buf_size);
 
-      // keep audio_clock up to date
-      pts = videoState->audio_clock;
-      *pts_ptr = pts;
+      *pts_ptr = m_audioClock;
       n = 2 * videoState->audio_ctx->ch_layout.nb_channels;
-      videoState->audio_clock += (double)data_size / (double)(n * videoState->audio_ctx->sample_rate);
-
-      if (avPacket->data)
-      {
-        // wipe the packet
-        av_packet_unref(avPacket);
-      }
-      av_frame_free(&avFrame);
+      m_audioClock += (double)data_size / (double)(n * videoState->audio_ctx->sample_rate);
 
       // we have the data, return it and come back for more later
       return data_size;
     }
-
-    if (avPacket->data)
+    else if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
     {
-      av_packet_unref(avPacket);
+      videoState->audio_decode_errors++;
+      std::cerr << "Error while decoding audio" << std::endl;
     }
 
-    // get more audio AVPacket
-    int ret = videoState->audioq.get(avPacket, 1);
+    // get more audio AVPacket, without waiting for it
+    ret = videoState->audioq.get(m_packet, 0);
 
     // if packet_queue_get returns < 0, the global quit flag was set
     if (ret < 0)
     {
       return -1;
     }
+    if (ret == 0)
+    {
+      return 0;
+    }
 
-    if (avPacket->data == videoState->flush_pkt->data)
+    if (m_packet->data == videoState->flush_pkt->data)
     {
       avcodec_flush_buffers(videoState->audio_ctx);
+      videoState->audio_skip_to_flush = 0;
       continue;
     }
 
-    audio_pkt_data = avPacket->data;
-    audio_pkt_size = avPacket->size;
+    if (videoState->audio_skip_to_flush)
+    {
+      // live mode went over its latency cap, the backlog up to the flush packet is dropped
+      av_packet_unref(m_packet);
+      continue;
+    }
+
+    // give the decoder raw compressed data in an AVPacket
+    ret = avcodec_send_packet(videoState->audio_ctx, m_packet);
+
+    // wipe the packet
+    av_packet_unref(m_packet);
 
-    // keep audio_clock up to date
-    if (avPacket->pts != AV_NOPTS_VALUE)
+    if (ret < 0 && ret != AVERROR(EAGAIN))
     {
-      videoState->audio_clock = av_q2d(videoState->audio_st->time_base) * avPacket->pts;
+      // if error, skip packet
+      videoState->audio_decode_errors++;
+      std::cerr << "Error sending audio packet for decoding" << std::endl;
     }
   }
 
-  av_frame_unref(avFrame);
-  avFrame = nullptr;
   return 0;
 }
 
-int audioResampling(VideoState* videoState
-                    , AVFrame* decoded_audio_frame
-                    , enum AVSampleFormat out_sample_fmt
-                    , uint8_t* out_buf)
+int AudioDecoder::audioResampling(VideoState* videoState
+                                  , AVFrame* decoded_audio_frame
+                                  , enum AVSampleFormat out_sample_fmt
+                                  , uint8_t* out_buf)
 {
-  // get an instance of the audioresamplingstate struct
-  AudioReSamplingState arState;
-  arState.init(videoState->audio_ctx->ch_layout.nb_channels);
-  if (!arState.swr_ctx)
-  {
-    printf("swr_alloc error.\n");
-    return -1;
-  }
-
-  // get input audio channels
-  arState.in_channel_layout = videoState->audio_ctx->ch_layout.nb_channels;
-
-  // check input audio channels correctly retrieved
-  if (arState.in_channel_layout <= 0)
-  {
-    releasePointer(arState);
-    return -1;
-  }
-
-  // set output audio channels based on the input audio channels
-  if (videoState->audio_ctx->ch_layout.nb_channels == 1)
-  {
-    arState.out_channel_layout = AV_CH_LAYOUT_MONO;
-  }
-  else if (videoState->audio_ctx->ch_layout.nb_channels == 2)
-  {
-    arState.out_channel_layout = AV_CH_LAYOUT_STEREO;
-  }
-  else
-  {
-    arState.out_channel_layout = AV_CH_LAYOUT_SURROUND;
-  }
+  // the resampler lives as long as the stream
+  AudioReSamplingState& arState = videoState->audio_resampler;
 
   // retrieve number of audio samples (per channel)
   arState.in_nb_samples = decoded_audio_frame->nb_samples;
   if (arState.in_nb_samples <= 0)
   {
     printf("in_nb_samples error.\n");
-    releasePointer(arState);
     return -1;
   }
 
-  // Set SwrContext parameters for resampling
-  av_opt_set_int(arState.swr_ctx, "in_channel_layout", arState.in_channel_layout, 0);
-  av_opt_set_int(arState.swr_ctx, "in_sample_rate", videoState->audio_ctx->sample_rate, 0);
-  av_opt_set_sample_fmt(arState.swr_ctx, "in_sample_fmt", videoState->audio_ctx->sample_fmt, 0);
-  av_opt_set_int(arState.swr_ctx, "out_channel_layout", arState.out_channel_layout, 0);
-  av_opt_set_int(arState.swr_ctx, "out_sample_rate", videoState->audio_ctx->sample_rate, 0);
-  av_opt_set_sample_fmt(arState.swr_ctx, "out_sample_fmt", out_sample_fmt, 0);
-
-  // Once all values have been set for the SwrContext, it must be initialized
-  // with swr_init().
-  int ret = swr_init(arState.swr_ctx);
-  if (ret < 0)
-  {
-    printf("Failed to initialize the resampling context.\n");
-    releasePointer(arState);
-    return -1;
-  }
-
-  arState.max_out_nb_samples = arState.out_nb_samples = av_rescale_rnd(
-    arState.in_nb_samples,
-    videoState->audio_ctx->sample_rate,
-    videoState->audio_ctx->sample_rate,
-    AV_ROUND_UP
-    );
-
-  // check rescaling was successful
-  if (arState.max_out_nb_samples <= 0)
-  {
-    printf("av_rescale_rnd error.\n");
-    releasePointer(arState);
-    return -1;
-  }
-
-  // get number of output audio channels
-  arState.out_nb_channels = videoState->audio_ctx->ch_layout.nb_channels;
-
-  ret = av_samples_alloc_array_and_samples(
-    &arState.resampled_data,
-    &arState.out_linesize,
-    arState.out_nb_channels,
-    arState.out_nb_samples,
-    out_sample_fmt,
-    0
+  // some decoders leave the frame sample rate unset
+  int in_sample_rate = decoded_audio_frame->sample_rate > 0
+    ? decoded_audio_frame->sample_rate
+    : videoState->audio_ctx->sample_rate;
+
+  // rebuild the SwrContext only when the input format, sample rate or channel layout changed
+  int ret = arState.configure(
+    &decoded_audio_frame->ch_layout
+    , (enum AVSampleFormat)decoded_audio_frame->format
+    , in_sample_rate
+    , videoState->audio_ctx->ch_layout.nb_channels
+    , out_sample_fmt
+    , videoState->audio_ctx->sample_rate
     );
-
   if (ret < 0)
   {
-    printf("av_samples_alloc_array_and_samples() error: Could not allocate destination samples.\n");
-    releasePointer(arState);
+    printf("Failed to initialize the resampling context.\n");
     return -1;
   }
 
   // retrieve output samples number taking into account the progressive delay
   arState.out_nb_samples = av_rescale_rnd(
-    swr_get_delay(arState.swr_ctx, videoState->audio_ctx->sample_rate) + arState.in_nb_samples
-    , videoState->audio_ctx->sample_rate
-    , videoState->audio_ctx->sample_rate
+    swr_get_delay(arState.swr_ctx, arState.in_sample_rate) + arState.in_nb_samples
+    , arState.out_sample_rate
+    , arState.in_sample_rate
     , AV_ROUND_UP
     );
 
   // check output samples number was correctly retrieved
   if (arState.out_nb_samples <= 0)
   {
-    releasePointer(arState);
+    printf("av_rescale_rnd error.\n");
     return -1;
   }
 
-  if (arState.out_nb_samples > arState.max_out_nb_samples)
+  // grow the output buffer only when this frame does not fit into it
+  ret = arState.reserve(arState.out_nb_samples);
+  if (ret < 0)
   {
-    // free memory block and set pointer to NULL
-    av_free(arState.resampled_data[0]);
-
-    // Allocate a samples buffer for out_nb_samples samples
-    ret = av_samples_alloc(
-      arState.resampled_data
-      , &arState.out_linesize
-      , arState.out_nb_channels
-      , arState.out_nb_samples
-      , out_sample_fmt
-      , 1
-      );
-
-    // check samples buffer correctly allocated
-    if (ret < 0)
-    {
-      printf("av_samples_alloc failed.\n");
-      releasePointer(arState);
-      return -1;
-    }
-    arState.max_out_nb_samples = arState.out_nb_samples;
+    printf("av_samples_alloc failed.\n");
+    return -1;
   }
 
-  if (arState.swr_ctx)
+  // live catch-up: squeeze a few percent of the samples out, close enough to inaudible
+  int compensating = videoState->live_catchup;
+  if (compensating || m_compensating)
   {
-    // do the actual audio data resampling
-    ret = swr_convert(
-      arState.swr_ctx
-      , arState.resampled_data
-      , arState.out_nb_samples
-      , (const uint8_t **) decoded_audio_frame->data
-      , decoded_audio_frame->nb_samples);
-
-    // check audio conversion was successful
+    int distance = compensating ? (int)arState.out_nb_samples : 0;
+    ret = swr_set_compensation(arState.swr_ctx, -(distance * LIVE_CATCHUP_SPEED_PERCENT / 100), distance);
     if (ret < 0)
     {
-      printf("swr_convert_error.\n");
-      releasePointer(arState);
+      printf("swr_set_compensation error.\n");
       return -1;
     }
+    m_compensating = compensating;
+  }
 
-    // Get the required buffer size for the given audio parameters
-    arState.resampled_data_size = av_samples_get_buffer_size(
-      &arState.out_linesize
-      , arState.out_nb_channels
-      , ret
-      , out_sample_fmt
-      , 1);
+  // do the actual audio data resampling
+  ret = swr_convert(
+    arState.swr_ctx
+    , arState.resampled_data
+    , (int)arState.out_nb_samples
+    , (const uint8_t **) decoded_audio_frame->data
+    , decoded_audio_frame->nb_samples);
 
-    // check audio buffer size
-    if (arState.resampled_data_size < 0)
-    {
-      printf("av_samples_get_buffer_size error.\n");
-      releasePointer(arState);
-      return -1;
-    }
+  // check audio conversion was successful
+  if (ret < 0)
+  {
+    printf("swr_convert_error.\n");
+    return -1;
   }
-  else
+
+  // Get the required buffer size for the given audio parameters
+  arState.resampled_data_size = av_samples_get_buffer_size(
+    &arState.out_linesize
+    , arState.out_nb_channels
+    , ret
+    , out_sample_fmt
+    , 1);
+
+  // check audio buffer size
+  if (arState.resampled_data_size < 0)
   {
-    printf("swr_ctx null error.\n");
-    releasePointer(arState);
+    printf("av_samples_get_buffer_size error.\n");
     return -1;
   }
 
   // copy the resampled data to the output buffer
   std::memcpy(out_buf, arState.resampled_data[0], arState.resampled_data_size);
 
-  /*
-   * Memory Cleanup.
-   */
-  releasePointer(arState);
-
   return arState.resampled_data_size;
 }
 
-int syncAudio(VideoState *videoState, short *samples, int samples_size)
+int AudioDecoder::syncAudio(VideoState *videoState, short *samples, int samples_size)
 {
   int n = 0;
   double ref_clock = 0;
@@ -476,24 +431,3 @@ int syncAudio(VideoState *videoState, short *samples, int samples_size)
 
   return samples_size;
 }
-
-void releasePointer(AudioReSamplingState& arState)
-{
-  /*
-   * Memory Cleanup.
-   */
-  if (arState.resampled_data)
-  {
-    // free memory block and set pointer to NULL
-    av_freep(&arState.resampled_data[0]);
-  }
-
-  av_freep(&arState.resampled_data);
-
-  arState.resampled_data = NULL;
-  if (arState.swr_ctx)
-  {
-    // Free the given SwrContext and set the pointer to NULL
-    swr_free(&arState.swr_ctx);
-  }
-}
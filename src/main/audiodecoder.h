@@ -26,11 +26,35 @@ extern "C"
 #define AUDIO_DIFF_AVG_NB     20
 #define SAMPLE_CORRECTION_PERCENT_MAX 10
 
-void audioCallback(void *userdata, Uint8 *stream, int len);
-int audioDecodeFrame(VideoState *videoState, uint8_t *audio_buf, int buf_size, double *pts_ptr);
-static int audioResampling(VideoState *videoState, AVFrame *decoded_audio_frame, enum AVSampleFormat out_sample_fmt, uint8_t *out_buf);
-int syncAudio(VideoState *videoState, short *samples, int samples_size);
-
-void releasePointer(AudioReSamplingState& arState);
+// Decodes the audio packets of one session on the executor workers, one frame per run.
+// The reader notifies it with the packets, the audio callback once it made room in the pcm ring.
+class AudioDecoder
+{
+public:
+  explicit AudioDecoder();
+  ~AudioDecoder();
+
+  int start(VideoState *videoState);
+  void stop();
+  void stopAsync(std::function<void()> done);
+
+  static void audioCallback(void *userdata, Uint8 *stream, int len);
+
+private:
+  VideoState *m_videoState;
+  AVPacket *m_packet;
+  AVFrame *m_frame;
+  double m_audioClock;
+  int m_compensating;
+  SerialTask m_task;
+  // pcm of audio_buf not in the ring yet
+  const uint8_t *m_pcm;
+  size_t m_pcmSize;
+
+  void decodeTask();
+  int audioDecodeFrame(VideoState *videoState, uint8_t *audio_buf, int buf_size, double *pts_ptr);
+  int audioResampling(VideoState *videoState, AVFrame *decoded_audio_frame, enum AVSampleFormat out_sample_fmt, uint8_t *out_buf);
+  int syncAudio(VideoState *videoState, short *samples, int samples_size);
+};
 
 #endif // AUDIO_DECODER_H_
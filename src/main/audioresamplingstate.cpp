@@ -3,8 +3,12 @@
 
 AudioReSamplingState::AudioReSamplingState()
   : swr_ctx(nullptr)
-  , in_channel_layout(0)
-  , out_channel_layout(0)
+  , in_ch_layout{}
+  , in_sample_fmt(AV_SAMPLE_FMT_NONE)
+  , in_sample_rate(0)
+  , out_ch_layout{}
+  , out_sample_fmt(AV_SAMPLE_FMT_NONE)
+  , out_sample_rate(0)
   , out_nb_channels(0)
   , out_linesize(0)
   , in_nb_samples(0)
@@ -17,18 +21,150 @@ AudioReSamplingState::AudioReSamplingState()
 
 AudioReSamplingState::~AudioReSamplingState()
 {
+  this->release();
 }
 
-void AudioReSamplingState::init(uint64_t channel_layout)
+int AudioReSamplingState::configure(
+  const AVChannelLayout* in_layout
+  , enum AVSampleFormat in_fmt
+  , int in_rate
+  , int out_channels
+  , enum AVSampleFormat out_fmt
+  , int out_rate)
 {
-  swr_ctx = swr_alloc();
-  in_channel_layout = channel_layout;
-  out_channel_layout = AV_CH_LAYOUT_STEREO;
-  out_nb_channels = 0;
-  out_linesize = 0;
-  in_nb_samples = 0;
-  out_nb_samples = 0;
-  max_out_nb_samples = 0;
+  AVChannelLayout layout{};
+  if (in_layout->order == AV_CHANNEL_ORDER_UNSPEC)
+  {
+    // some decoders only report the channel count, assume the default layout
+    av_channel_layout_default(&layout, in_layout->nb_channels);
+  }
+  else if (av_channel_layout_copy(&layout, in_layout) < 0)
+  {
+    return -1;
+  }
+
+  // keep the current context if nothing has changed
+  if (swr_ctx
+      && av_channel_layout_compare(&layout, &in_ch_layout) == 0
+      && in_fmt == in_sample_fmt
+      && in_rate == in_sample_rate
+      && out_channels == out_nb_channels
+      && out_fmt == out_sample_fmt
+      && out_rate == out_sample_rate)
+  {
+    av_channel_layout_uninit(&layout);
+    return 0;
+  }
+
+  // parameters changed, drop the old context and the output buffer
+  this->release();
+
+  in_ch_layout = layout;
+  in_sample_fmt = in_fmt;
+  in_sample_rate = in_rate;
+  out_nb_channels = out_channels;
+  out_sample_fmt = out_fmt;
+  out_sample_rate = out_rate;
+  av_channel_layout_default(&out_ch_layout, out_nb_channels);
+
+  int ret = swr_alloc_set_opts2(
+    &swr_ctx
+    , &out_ch_layout
+    , out_sample_fmt
+    , out_sample_rate
+    , &in_ch_layout
+    , in_sample_fmt
+    , in_sample_rate
+    , 0
+    , nullptr);
+  if (ret < 0 || !swr_ctx)
+  {
+    this->release();
+    return -1;
+  }
+
+  // Once all values have been set for the SwrContext, it must be initialized
+  // with swr_init().
+  ret = swr_init(swr_ctx);
+  if (ret < 0)
+  {
+    this->release();
+    return -1;
+  }
+
+  return 0;
+}
+
+int AudioReSamplingState::reserve(int64_t nb_samples)
+{
+  if (resampled_data && nb_samples <= max_out_nb_samples)
+  {
+    // the current buffer is large enough
+    return 0;
+  }
+
+  int ret = -1;
+  if (!resampled_data)
+  {
+    ret = av_samples_alloc_array_and_samples(
+      &resampled_data
+      , &out_linesize
+      , out_nb_channels
+      , (int)nb_samples
+      , out_sample_fmt
+      , 0
+      );
+  }
+  else
+  {
+    // free memory block and allocate a larger one
+    av_freep(&resampled_data[0]);
+
+    ret = av_samples_alloc(
+      resampled_data
+      , &out_linesize
+      , out_nb_channels
+      , (int)nb_samples
+      , out_sample_fmt
+      , 1
+      );
+  }
+
+  if (ret < 0)
+  {
+    max_out_nb_samples = 0;
+    return -1;
+  }
+
+  max_out_nb_samples = nb_samples;
+  return 0;
+}
+
+void AudioReSamplingState::release()
+{
+  /*
+   * Memory Cleanup.
+   */
+  if (resampled_data)
+  {
+    // free memory block and set pointer to NULL
+    av_freep(&resampled_data[0]);
+  }
+  av_freep(&resampled_data);
   resampled_data = nullptr;
-  resampled_data_size = 0;
+  max_out_nb_samples = 0;
+
+  if (swr_ctx)
+  {
+    // Free the given SwrContext and set the pointer to NULL
+    swr_free(&swr_ctx);
+  }
+
+  av_channel_layout_uninit(&in_ch_layout);
+  av_channel_layout_uninit(&out_ch_layout);
+  in_sample_fmt = AV_SAMPLE_FMT_NONE;
+  in_sample_rate = 0;
+  out_sample_fmt = AV_SAMPLE_FMT_NONE;
+  out_sample_rate = 0;
+  out_nb_channels = 0;
 }
@@ -4,20 +4,37 @@
 
 extern "C"
 {
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
 #include <libswresample/swresample.h>
 }
 
+// Long-lived resampler owned by the stream.
+// The SwrContext is only rebuilt when the input or output parameters change,
+// so its internal delay/filter state is kept across frames.
 class AudioReSamplingState
 {
 public:
   explicit AudioReSamplingState();
   ~AudioReSamplingState();
 
-  void init(uint64_t channel_layout);
+  int configure(
+    const AVChannelLayout* in_layout
+    , enum AVSampleFormat in_fmt
+    , int in_rate
+    , int out_channels
+    , enum AVSampleFormat out_fmt
+    , int out_rate);
+  int reserve(int64_t nb_samples);
+  void release();
 
   SwrContext* swr_ctx;
-  int64_t in_channel_layout;
-  uint64_t out_channel_layout;
+  AVChannelLayout in_ch_layout;
+  enum AVSampleFormat in_sample_fmt;
+  int in_sample_rate;
+  AVChannelLayout out_ch_layout;
+  enum AVSampleFormat out_sample_fmt;
+  int out_sample_rate;
   int out_nb_channels;
   int out_linesize;
   int in_nb_samples;
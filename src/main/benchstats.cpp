@@ -0,0 +1,116 @@
+
+#include <algorithm>
+#include <iomanip>
+#include "benchstats.h"
+
+BenchStats::BenchStats()
+  : m_startTime(0)
+  , m_endTime(0)
+  , m_packets(0)
+  , m_videoFrames(0)
+  , m_audioFrames(0)
+  , m_passthroughFrames(0)
+  , m_maxVideoq(0)
+  , m_maxAudioq(0)
+  , m_maxPictq(0)
+{
+}
+
+BenchStats::~BenchStats()
+{
+}
+
+void BenchStats::start()
+{
+  m_startTime = av_gettime_relative();
+  m_endTime = 0;
+}
+
+void BenchStats::stop()
+{
+  int64_t expected = 0;
+  m_endTime.compare_exchange_strong(expected, av_gettime_relative());
+}
+
+void BenchStats::addPacket(int videoq_depth, int audioq_depth)
+{
+  m_packets++;
+
+  // keep the peak depth of both packet queues
+  int peak = m_maxVideoq.load(std::memory_order_relaxed);
+  while (videoq_depth > peak && !m_maxVideoq.compare_exchange_weak(peak, videoq_depth))
+  {
+  }
+  peak = m_maxAudioq.load(std::memory_order_relaxed);
+  while (audioq_depth > peak && !m_maxAudioq.compare_exchange_weak(peak, audioq_depth))
+  {
+  }
+}
+
+void BenchStats::addVideoFrame(int64_t decode_us)
+{
+  m_videoFrames++;
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_decodeTimes.push_back(decode_us);
+}
+
+void BenchStats::addAudioFrame()
+{
+  m_audioFrames++;
+}
+
+void BenchStats::addScale(int64_t scale_us)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_scaleTimes.push_back(scale_us);
+}
+
+void BenchStats::addPassthrough()
+{
+  m_passthroughFrames++;
+}
+
+double BenchStats::percentile(std::vector<int64_t> values, double p)
+{
+  if (values.empty())
+  {
+    return 0;
+  }
+  size_t index = std::min(values.size() - 1, (size_t)(p * values.size()));
+  std::nth_element(values.begin(), values.begin() + index, values.end());
+  return values[index] / 1000.0;
+}
+
+void BenchStats::report(std::wostream& os)
+{
+  this->stop();
+
+  std::vector<int64_t> decodeTimes;
+  std::vector<int64_t> scaleTimes;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    decodeTimes = m_decodeTimes;
+    scaleTimes = m_scaleTimes;
+  }
+
+  double elapsed = (m_endTime - m_startTime) / 1000000.0;
+  if (elapsed <= 0)
+  {
+    elapsed = 1e-6;
+  }
+
+  os << std::fixed << std::setprecision(2);
+  os << "----- benchmark -----" << std::endl;
+  os << "elapsed          : " << elapsed << " s" << std::endl;
+  os << "packets/s        : " << m_packets / elapsed << std::endl;
+  os << "video frames/s   : " << m_videoFrames / elapsed << std::endl;
+  os << "audio frames/s   : " << m_audioFrames / elapsed << std::endl;
+  os << "decode ms/frame  : p50 " << percentile(decodeTimes, 0.50)
+     << " / p99 " << percentile(decodeTimes, 0.99) << std::endl;
+  os << "swscale ms/frame : p50 " << percentile(scaleTimes, 0.50)
+     << " / p99 " << percentile(scaleTimes, 0.99)
+     << " (" << scaleTimes.size() << " converted, " << m_passthroughFrames << " passthrough)" << std::endl;
+  os << "peak queue depth : videoq " << m_maxVideoq
+     << ", audioq " << m_maxAudioq
+     << ", pictq " << m_maxPictq << std::endl;
+}
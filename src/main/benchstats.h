@@ -0,0 +1,54 @@
+
+#ifndef BENCH_STATS_H_
+#define BENCH_STATS_H_
+
+#include <atomic>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+extern "C"
+{
+#include <libavutil/time.h>
+}
+
+// Throughput and per-stage timings collected in headless benchmark mode.
+// Counters are atomics, the timing samples are appended under a mutex since
+// they are only recorded when benchmarking.
+class BenchStats
+{
+public:
+  explicit BenchStats();
+  ~BenchStats();
+
+  void start();
+  void stop();
+
+  void addPacket(int videoq_depth, int audioq_depth);
+  void addVideoFrame(int64_t decode_us);
+  void addAudioFrame();
+  void addScale(int64_t scale_us);
+  void addPassthrough();
+  void setPictureQueuePeak(int depth) { m_maxPictq = depth; }
+
+  void report(std::wostream& os);
+
+private:
+  std::mutex m_mutex;
+  std::vector<int64_t> m_decodeTimes;
+  std::vector<int64_t> m_scaleTimes;
+
+  std::atomic<int64_t> m_startTime;
+  std::atomic<int64_t> m_endTime;
+  std::atomic<uint64_t> m_packets;
+  std::atomic<uint64_t> m_videoFrames;
+  std::atomic<uint64_t> m_audioFrames;
+  std::atomic<uint64_t> m_passthroughFrames;
+  std::atomic<int> m_maxVideoq;
+  std::atomic<int> m_maxAudioq;
+  std::atomic<int> m_maxPictq;
+
+  static double percentile(std::vector<int64_t> values, double p);
+};
+
+#endif // BENCH_STATS_H_
@@ -0,0 +1,487 @@
+
+#include <algorithm>
+#include "executor.h"
+
+thread_local Executor::Worker *Executor::s_worker = nullptr;
+
+TaskGroup::TaskGroup()
+  : m_pending(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+}
+
+Executor::Executor()
+  : m_queued(0)
+  , m_nextVictim(0)
+  , m_quit(0)
+  , m_ioBusy(0)
+  , m_ioPeak(0)
+  , m_ioQuit(0)
+{
+}
+
+Executor::~Executor()
+{
+  this->stop();
+}
+
+int Executor::start(int workers, int blockingThreads)
+{
+  if (workers < 1 || !m_workers.empty())
+  {
+    return -1;
+  }
+  m_quit = 0;
+  m_ioQuit = 0;
+  if (blockingThreads < 1)
+  {
+    blockingThreads = workers * EXECUTOR_IO_THREADS_PER_CORE;
+  }
+
+  // every worker exists before the first one looks for a task to steal
+  for (int i = 0; i < workers; i++)
+  {
+    std::unique_ptr<Worker> worker = std::make_unique<Worker>();
+    worker->owner = this;
+    m_workers.push_back(std::move(worker));
+  }
+  for (auto& worker : m_workers)
+  {
+    worker->thread = std::thread([&](Executor *executor, Worker *worker)
+    {
+      executor->workerThread(worker);
+    }, this, worker.get());
+  }
+
+  // a hard cap: whatever blocks beyond this waits for a thread
+  for (int i = 0; i < blockingThreads; i++)
+  {
+    m_ioThreads.push_back(std::thread([&](Executor *executor)
+    {
+      executor->blockingThread();
+    }, this));
+  }
+
+  return 0;
+}
+
+void Executor::stop()
+{
+  // the workers run what is still queued, then exit
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_quit = 1;
+  }
+  m_workCond.notify_all();
+  for (auto& worker : m_workers)
+  {
+    if (worker->thread.joinable())
+    {
+      worker->thread.join();
+    }
+  }
+  m_workers.clear();
+
+  // the sessions are stopped first, a job still running is waited for
+  {
+    std::lock_guard<std::mutex> lock(m_ioMutex);
+    m_ioQuit = 1;
+  }
+  m_ioCond.notify_all();
+  for (auto& thread : m_ioThreads)
+  {
+    thread.join();
+  }
+  m_ioThreads.clear();
+  m_ioTimers.clear();
+}
+
+int Executor::blockingThreadsPeak()
+{
+  std::lock_guard<std::mutex> lock(m_ioMutex);
+  return m_ioPeak;
+}
+
+void Executor::submit(TaskGroup& group, std::function<void()> task)
+{
+  if (m_workers.empty())
+  {
+    task();
+    return;
+  }
+
+  group.m_pending++;
+  this->schedule(Task{&group, std::move(task)});
+}
+
+void Executor::post(std::function<void()> task)
+{
+  if (m_workers.empty())
+  {
+    task();
+    return;
+  }
+
+  this->schedule(Task{nullptr, std::move(task)});
+}
+
+void Executor::schedule(Task task)
+{
+  Worker *self = s_worker && s_worker->owner == this ? s_worker : nullptr;
+  if (self)
+  {
+    // a worker keeps what it submits, the others steal it when idle
+    std::lock_guard<std::mutex> lock(self->mutex);
+    self->tasks.push_back(std::move(task));
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!self)
+    {
+      m_injected.push_back(std::move(task));
+    }
+    m_queued++;
+  }
+  m_workCond.notify_one();
+}
+
+void Executor::wait(TaskGroup& group)
+{
+  Worker *self = s_worker && s_worker->owner == this ? s_worker : nullptr;
+  while (!group.done())
+  {
+    // help instead of sleeping while tasks are queued
+    Task task;
+    if (this->findTask(self, &task))
+    {
+      this->runTask(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_doneCond.wait(lock, [&group]() { return group.done(); });
+  }
+}
+
+void Executor::postBlocking(std::function<void()> job, int delay_ms)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_ioMutex);
+    if (delay_ms <= 0)
+    {
+      m_ioJobs.push_back(std::move(job));
+    }
+    else
+    {
+      auto due = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay_ms);
+      m_ioTimers.emplace(due, std::move(job));
+    }
+  }
+
+  if (delay_ms <= 0)
+  {
+    m_ioCond.notify_one();
+  }
+  else
+  {
+    // the idle threads sleep until the first timer, this one may be due sooner
+    m_ioCond.notify_all();
+  }
+}
+
+void Executor::workerThread(Worker *worker)
+{
+  s_worker = worker;
+  for (;;)
+  {
+    Task task;
+    if (this->findTask(worker, &task))
+    {
+      this->runTask(task);
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_workCond.wait(lock, [this]() { return m_quit || m_queued > 0; });
+    if (m_quit && m_queued <= 0)
+    {
+      break;
+    }
+  }
+  s_worker = nullptr;
+}
+
+bool Executor::findTask(Worker *self, Task *task)
+{
+  if (m_queued <= 0)
+  {
+    return false;
+  }
+
+  // the newest task of this worker first, its data is still in the cache
+  if (self)
+  {
+    std::lock_guard<std::mutex> lock(self->mutex);
+    if (!self->tasks.empty())
+    {
+      *task = std::move(self->tasks.back());
+      self->tasks.pop_back();
+      m_queued--;
+      return true;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_injected.empty())
+    {
+      *task = std::move(m_injected.front());
+      m_injected.pop_front();
+      m_queued--;
+      return true;
+    }
+  }
+
+  // steal the oldest task of another worker, starting with a different one each time
+  size_t count = m_workers.size();
+  size_t first = m_nextVictim++;
+  for (size_t i = 0; i < count; i++)
+  {
+    Worker *victim = m_workers[(first + i) % count].get();
+    if (victim == self)
+    {
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(victim->mutex);
+    if (!victim->tasks.empty())
+    {
+      *task = std::move(victim->tasks.front());
+      victim->tasks.pop_front();
+      m_queued--;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void Executor::runTask(Task& task)
+{
+  TaskGroup *group = task.group;
+  task.fn();
+  task.fn = nullptr;
+
+  // the group may be gone as soon as its last task is counted, posted tasks have none
+  if (group && --group->m_pending == 0)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_doneCond.notify_all();
+  }
+}
+
+void Executor::blockingThread()
+{
+  std::unique_lock<std::mutex> lock(m_ioMutex);
+  for (;;)
+  {
+    // the timers due by now join the queued jobs, stopping drops the others
+    auto now = std::chrono::steady_clock::now();
+    while (!m_ioQuit && !m_ioTimers.empty() && m_ioTimers.begin()->first <= now)
+    {
+      m_ioJobs.push_back(std::move(m_ioTimers.begin()->second));
+      m_ioTimers.erase(m_ioTimers.begin());
+    }
+
+    if (!m_ioJobs.empty())
+    {
+      std::function<void()> job = std::move(m_ioJobs.front());
+      m_ioJobs.pop_front();
+      m_ioBusy++;
+      m_ioPeak = std::max(m_ioPeak, m_ioBusy);
+      lock.unlock();
+
+      job();
+
+      // what the job captured is released outside the lock
+      job = nullptr;
+      lock.lock();
+      m_ioBusy--;
+      continue;
+    }
+
+    if (m_ioQuit)
+    {
+      break;
+    }
+    if (m_ioTimers.empty())
+    {
+      m_ioCond.wait(lock);
+    }
+    else
+    {
+      // a copy, another thread may take the timer while this one sleeps
+      auto due = m_ioTimers.begin()->first;
+      m_ioCond.wait_until(lock, due);
+    }
+  }
+}
+
+SerialTask::SerialTask()
+{
+}
+
+SerialTask::~SerialTask()
+{
+  this->stop();
+}
+
+void SerialTask::start(Executor *executor, bool blocking, std::function<void()> fn)
+{
+  // runs and timers of a previous start keep their own state
+  this->stop();
+  m_state = std::make_shared<State>();
+  m_state->executor = executor;
+  m_state->blocking = blocking;
+  m_state->fn = std::move(fn);
+  m_state->stopped = 0;
+}
+
+void SerialTask::notify()
+{
+  if (m_state)
+  {
+    SerialTask::notify(m_state);
+  }
+}
+
+void SerialTask::notifyAfter(int delay_ms)
+{
+  std::shared_ptr<State> state = m_state;
+  if (!state || !state->executor)
+  {
+    return;
+  }
+
+  // the timer holds the state, it notifies nothing once the task is stopped
+  state->executor->postBlocking([state]()
+  {
+    SerialTask::notify(state);
+  }, delay_ms);
+}
+
+void SerialTask::stop()
+{
+  std::shared_ptr<State> state = m_state;
+  if (!state)
+  {
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->stopped = 1;
+  state->cond.wait(lock, [&state]() { return state->scheduled == 0; });
+  state->fn = nullptr;
+}
+
+void SerialTask::stopAsync(std::function<void()> done)
+{
+  std::shared_ptr<State> state = m_state;
+  if (!state || !state->executor)
+  {
+    done();
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->stopped = 1;
+    state->done = std::move(done);
+    if (state->scheduled)
+    {
+      // the run queued or running calls it once over
+      return;
+    }
+    state->scheduled = 1;
+  }
+
+  // nothing to wait for, a run of its own calls it on the threads of the task
+  SerialTask::schedule(state);
+}
+
+void SerialTask::notify(const std::shared_ptr<State>& state)
+{
+  {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    if (state->stopped)
+    {
+      return;
+    }
+    if (state->scheduled)
+    {
+      // queued or running, a running one goes again once done
+      state->notified = 1;
+      return;
+    }
+    state->scheduled = 1;
+  }
+
+  SerialTask::schedule(state);
+}
+
+void SerialTask::schedule(const std::shared_ptr<State>& state)
+{
+  if (state->blocking)
+  {
+    state->executor->postBlocking([state]()
+    {
+      SerialTask::run(state);
+    });
+  }
+  else
+  {
+    state->executor->post([state]()
+    {
+      SerialTask::run(state);
+    });
+  }
+}
+
+void SerialTask::run(const std::shared_ptr<State>& state)
+{
+  std::unique_lock<std::mutex> lock(state->mutex);
+  if (!state->stopped)
+  {
+    state->notified = 0;
+    lock.unlock();
+    state->fn();
+    lock.lock();
+  }
+
+  for (;;)
+  {
+    if (state->notified && !state->stopped)
+    {
+      // notified while running, queued again behind the tasks of the other sessions
+      lock.unlock();
+      SerialTask::schedule(state);
+      return;
+    }
+    if (!state->done)
+    {
+      state->scheduled = 0;
+      state->cond.notify_all();
+      return;
+    }
+
+    // stopped by stopAsync(), stop() returns once its callback ran
+    std::function<void()> done = std::move(state->done);
+    state->done = nullptr;
+    lock.unlock();
+    done();
+    lock.lock();
+  }
+}
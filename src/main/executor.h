@@ -0,0 +1,147 @@
+
+#ifndef EXECUTOR_H_
+#define EXECUTOR_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// blocking threads per core when start() is not given their number
+#define EXECUTOR_IO_THREADS_PER_CORE 2
+
+// Tasks of one fork/join, Executor::wait() returns once they all ran.
+class TaskGroup
+{
+public:
+  explicit TaskGroup();
+  ~TaskGroup();
+
+  bool done() const { return m_pending == 0; }
+
+private:
+  friend class Executor;
+  std::atomic<int> m_pending;
+};
+
+// Threads shared by every session of the process, their number follows the cores, not the cameras.
+// CPU bound tasks (decoding, colour conversion bands) run on a fixed set of workers, one per core:
+// each worker takes the newest task of its own deque and, when it is empty, steals the oldest
+// task of the others. Tasks posted from outside the workers go through a shared queue.
+// Jobs blocking on the network or the disk (av_read_frame, file writes) run on a second fixed
+// set of threads; jobs beyond their number wait in a queue, the pool never grows.
+// stop() waits for the queued tasks and jobs, drops the timers and joins every thread.
+class Executor
+{
+public:
+  explicit Executor();
+  ~Executor();
+
+  int start(int workers, int blockingThreads = 0);
+  void stop();
+  int workers() const { return (int)m_workers.size(); }
+  int blockingThreads() const { return (int)m_ioThreads.size(); }
+  int blockingThreadsPeak();
+
+  // runs task on a worker, or right away when there is no worker
+  void submit(TaskGroup& group, std::function<void()> task);
+  // the calling thread runs queued tasks until the group is done
+  void wait(TaskGroup& group);
+  // runs task on a worker, nobody waits for it
+  void post(std::function<void()> task);
+
+  // runs job on a blocking thread, after delay_ms when given
+  void postBlocking(std::function<void()> job, int delay_ms = 0);
+
+private:
+  struct Task
+  {
+    TaskGroup *group = nullptr;
+    std::function<void()> fn;
+  };
+
+  struct Worker
+  {
+    Executor *owner = nullptr;
+    std::thread thread;
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  // workers
+  std::vector<std::unique_ptr<Worker>> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_workCond;
+  std::condition_variable m_doneCond;
+  std::deque<Task> m_injected;
+  std::atomic<int> m_queued;
+  std::atomic<unsigned int> m_nextVictim;
+  int m_quit;
+
+  // blocking threads, and the delayed jobs by due time
+  std::mutex m_ioMutex;
+  std::condition_variable m_ioCond;
+  std::deque<std::function<void()>> m_ioJobs;
+  std::multimap<std::chrono::steady_clock::time_point, std::function<void()>> m_ioTimers;
+  std::vector<std::thread> m_ioThreads;
+  int m_ioBusy;
+  int m_ioPeak;
+  int m_ioQuit;
+
+  static thread_local Worker *s_worker;
+
+  void schedule(Task task);
+  void workerThread(Worker *worker);
+  bool findTask(Worker *self, Task *task);
+  void runTask(Task& task);
+  void blockingThread();
+};
+
+// A function run each time it is notified, never twice at the same time, on the workers or on
+// the blocking threads. A notify() while it runs makes it run once more afterwards, behind the
+// tasks already queued. The function must not wait: it returns when it has nothing left to do
+// and whatever it waits for notifies it. stop() waits for the current run, notifications after
+// it are ignored; the state is shared with the queued runs and timers, which may outlive the task.
+// stopAsync() stops it the same way without waiting: done runs on the threads of the task
+// once its last run is over.
+class SerialTask
+{
+public:
+  explicit SerialTask();
+  ~SerialTask();
+
+  void start(Executor *executor, bool blocking, std::function<void()> fn);
+  void notify();
+  void notifyAfter(int delay_ms);
+  void stop();
+  void stopAsync(std::function<void()> done);
+
+private:
+  struct State
+  {
+    Executor *executor = nullptr;
+    bool blocking = false;
+    std::function<void()> fn;
+    // given to stopAsync(), called by the last run
+    std::function<void()> done;
+    std::mutex mutex;
+    std::condition_variable cond;
+    // a run is queued or running, it was notified again meanwhile, stop() was called
+    int scheduled = 0;
+    int notified = 0;
+    int stopped = 1;
+  };
+  std::shared_ptr<State> m_state;
+
+  static void notify(const std::shared_ptr<State>& state);
+  static void schedule(const std::shared_ptr<State>& state);
+  static void run(const std::shared_ptr<State>& state);
+};
+
+#endif // EXECUTOR_H_
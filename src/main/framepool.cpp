@@ -0,0 +1,126 @@
+#include <iostream>
+#include "framepool.h"
+
+// past the end of the planes, the simd code may read or write a few bytes more
+#define FRAME_POOL_PADDING 64
+
+FramePool::FramePool()
+  : m_gets(0)
+  , m_misses(0)
+  , m_residentBytes(0)
+{
+}
+
+FramePool::~FramePool()
+{
+  // the buffers still referenced are freed when they come back
+  for (Bucket *bucket : m_buckets)
+  {
+    av_buffer_pool_uninit(&bucket->pool);
+  }
+  m_buckets.clear();
+}
+
+int FramePool::getBuffer(AVFrame *frame)
+{
+  AVPixelFormat format = (AVPixelFormat)frame->format;
+  int size = av_image_get_buffer_size(format, frame->width, frame->height, FRAME_POOL_ALIGN);
+  if (size < 0)
+  {
+    return -1;
+  }
+
+  Bucket *bucket = this->bucket((size_t)size + FRAME_POOL_PADDING);
+  if (!bucket)
+  {
+    return -1;
+  }
+
+  AVBufferRef *buf = av_buffer_pool_get(bucket->pool);
+  if (!buf)
+  {
+    return -1;
+  }
+  m_gets++;
+
+  // the planes one after the other in the one buffer
+  if (av_image_fill_arrays(frame->data, frame->linesize, buf->data, format, frame->width, frame->height, FRAME_POOL_ALIGN) < 0)
+  {
+    av_buffer_unref(&buf);
+    return -1;
+  }
+  frame->buf[0] = buf;
+  frame->extended_data = frame->data;
+
+  return 0;
+}
+
+FramePool::Bucket* FramePool::bucket(size_t size)
+{
+  for (size_t i = 0; i < m_buckets.size(); i++)
+  {
+    Bucket *bucket = m_buckets[i];
+    if (bucket->size == size)
+    {
+      // keep the most recently used size first
+      m_buckets.erase(m_buckets.begin() + i);
+      m_buckets.insert(m_buckets.begin(), bucket);
+      return bucket;
+    }
+  }
+
+  Bucket *bucket = new Bucket();
+  bucket->owner = this;
+  bucket->size = size;
+  bucket->pool = av_buffer_pool_init2(size, bucket, allocBuffer, freeBucket);
+  if (!bucket->pool)
+  {
+    std::cerr << "Could not create the frame pool" << std::endl;
+    delete bucket;
+    return nullptr;
+  }
+  m_buckets.insert(m_buckets.begin(), bucket);
+
+  // a size not used lately, its memory goes back once the pictures still showing it are released
+  while (m_buckets.size() > FRAME_POOL_MAX_BUCKETS)
+  {
+    Bucket *oldest = m_buckets.back();
+    m_buckets.pop_back();
+    av_buffer_pool_uninit(&oldest->pool);
+  }
+
+  return bucket;
+}
+
+AVBufferRef* FramePool::allocBuffer(void *opaque, size_t size)
+{
+  Bucket *bucket = (Bucket *)opaque;
+  uint8_t *data = (uint8_t *)av_malloc(size);
+  if (!data)
+  {
+    return nullptr;
+  }
+  AVBufferRef *buf = av_buffer_create(data, size, freeBuffer, bucket, 0);
+  if (!buf)
+  {
+    av_free(data);
+    return nullptr;
+  }
+
+  bucket->owner->m_misses++;
+  bucket->owner->m_residentBytes += size;
+  return buf;
+}
+
+void FramePool::freeBuffer(void *opaque, uint8_t *data)
+{
+  Bucket *bucket = (Bucket *)opaque;
+  bucket->owner->m_residentBytes -= bucket->size;
+  av_free(data);
+}
+
+void FramePool::freeBucket(void *opaque)
+{
+  // called once the pool is released and every buffer came back
+  delete (Bucket *)opaque;
+}
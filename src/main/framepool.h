@@ -0,0 +1,62 @@
+
+#ifndef FRAME_POOL_H_
+#define FRAME_POOL_H_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+extern "C"
+{
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+}
+
+// line and plane alignment of the pooled pictures, enough for the simd paths of swscale
+#define FRAME_POOL_ALIGN 64
+
+// picture sizes kept at a time, the least recently used one is released beyond that
+#define FRAME_POOL_MAX_BUCKETS 2
+
+// Recycles the buffers of the converted pictures of one session.
+// Each picture size gets its own AVBufferPool, a buffer goes back to its pool when
+// the last reference of the frame is released (picture queue slot or mosaic tile).
+// The pool of a size no longer used is released once its buffers come back, so that a
+// camera changing resolution does not keep every size it ever had.
+// getBuffer() is called by the decoder task, buffers can be released from any thread.
+// Must outlive the frames it filled.
+class FramePool
+{
+public:
+  explicit FramePool();
+  ~FramePool();
+
+  int getBuffer(AVFrame *frame);
+
+  // buffers handed out from the pool, allocated because the pool was empty, and allocated memory
+  uint64_t hits() const { return m_gets - m_misses; }
+  uint64_t misses() const { return m_misses; }
+  int64_t residentBytes() const { return m_residentBytes; }
+
+private:
+  struct Bucket
+  {
+    FramePool *owner;
+    size_t size;
+    AVBufferPool *pool;
+  };
+
+  // most recently used first
+  std::vector<Bucket*> m_buckets;
+  std::atomic<uint64_t> m_gets;
+  std::atomic<uint64_t> m_misses;
+  std::atomic<int64_t> m_residentBytes;
+
+  Bucket* bucket(size_t size);
+  static AVBufferRef* allocBuffer(void *opaque, size_t size);
+  static void freeBuffer(void *opaque, uint8_t *data);
+  static void freeBucket(void *opaque);
+};
+
+#endif // FRAME_POOL_H_
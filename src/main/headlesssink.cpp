@@ -0,0 +1,78 @@
+
+#include <iostream>
+#include "headlesssink.h"
+
+HeadlessSink::HeadlessSink()
+  : m_videoState(nullptr)
+{
+}
+
+HeadlessSink::~HeadlessSink()
+{
+  this->stop();
+
+  // the decoder is stopped too, nothing reads it anymore
+  if (m_videoState)
+  {
+    m_videoState->picture_consumer = nullptr;
+  }
+  m_videoState = nullptr;
+}
+
+int HeadlessSink::start(VideoState *videoState)
+{
+  m_videoState = videoState;
+  if (!m_videoState)
+  {
+    return -1;
+  }
+
+  m_task.start(m_videoState->executor, false, [this]()
+  {
+    this->sinkTask();
+  });
+  m_videoState->picture_consumer = &m_task;
+  m_task.notify();
+
+  return 0;
+}
+
+void HeadlessSink::stop()
+{
+  // waits for the current run, queuePicture() notifies nothing from now on
+  m_task.stop();
+}
+
+void HeadlessSink::stopAsync(std::function<void()> done)
+{
+  // done is called on a worker once the sink no longer runs
+  m_task.stopAsync(std::move(done));
+}
+
+void HeadlessSink::sinkTask()
+{
+  // every picture queued so far, the decoder notifies this task with the next one
+  for (;;)
+  {
+    SDL_LockMutex(m_videoState->pictq_mutex);
+    int size = m_videoState->pictq_size;
+    SDL_UnlockMutex(m_videoState->pictq_mutex);
+
+    // Check global quit flag
+    if (size == 0 || m_videoState->quit)
+    {
+      break;
+    }
+
+    // nothing is displayed, only keep the video clock moving
+    VideoPicture *videoPicture = &m_videoState->pictq[m_videoState->pictq_rindex];
+    m_videoState->video_current_pts = videoPicture->pts;
+    m_videoState->video_current_pts_time = av_gettime();
+
+    // the picture would be on screen now, benchmarks measure the capture latency up to here
+    m_videoState->addCaptureLatency(videoPicture->capture_time);
+
+    // Release the slot and notify the decoder
+    m_videoState->popPicture();
+  }
+}
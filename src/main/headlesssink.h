@@ -0,0 +1,28 @@
+
+#ifndef HEADLESS_SINK_H_
+#define HEADLESS_SINK_H_
+
+#include "videostate.h"
+
+// Stands in for the VideoRenderer in headless mode.
+// Pictures are taken off the picture queue as soon as they are ready,
+// nothing is displayed and no window is created. Runs on the executor
+// workers each time the decoder queues a picture.
+class HeadlessSink
+{
+public:
+  explicit HeadlessSink();
+  ~HeadlessSink();
+
+  int start(VideoState *videoState);
+  void stop();
+  void stopAsync(std::function<void()> done);
+
+private:
+  VideoState* m_videoState;
+  SerialTask m_task;
+
+  void sinkTask();
+};
+
+#endif // HEADLESS_SINK_H_
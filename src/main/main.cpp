@@ -5,10 +5,12 @@
 #include <thread>
 #include <vector>
 #include <string>
+#include <stdexcept>
 #include <cstdlib>
 
 #include "videostate.h"
 #include "videoreader.h"
+#include "sessionmanager.h"
 #include "stringhelper.h"
 #include "options.h"
 #include "version.h"
@@ -48,6 +50,8 @@ static inline void usage(const std::wstring& wsProgName)
              << " <max delay>"
              << " <stimeout>"
              << " <buffer size>"
+             << " [--url=<rtsp url> ...]"
+             << " [--option=value ...]"
              << std::endl;
   std::wcout << "i.e.," << std::endl;
   std::wcout << wsProgName << " rtsp://username:password@IP_Address:554/ch1 1 0 0 0 0 0 10000" << std::endl << std::endl;
@@ -74,7 +78,42 @@ static inline void usage(const std::wstring& wsProgName)
   std::wcout << "----- buffer size -----" << std::endl;
   std::wcout << "value : Integer. i.e, 20000 etc." << std::endl << std::endl;
 
+  std::wcout << "----- options -----" << std::endl;
+  std::wcout << "--audio-buffer-ms=value : Decoded audio buffered ahead of the audio device in ms. Default 100." << std::endl;
+  std::wcout << "--picture-queue-size=value : Number of decoded pictures queued ahead of the renderer, 1 to " << VIDEO_PICTURE_QUEUE_SIZE_MAX << ". Default 1." << std::endl;
+  std::wcout << "--headless, --bench : Decode without window and audio device, print a throughput report at exit." << std::endl;
+  std::wcout << "--url=value : Additional stream, repeat for each camera. All streams run in this process." << std::endl;
+  std::wcout << "--audio-session=value : Index of the stream playing its audio, 0 is the first url, -1 for none. Default 0." << std::endl;
+  std::wcout << "--mosaic : Show every stream in a grid inside one window." << std::endl;
+  std::wcout << "--reconnect-max-ms=value : Longest delay between two reconnection attempts in ms, 0 disables reconnecting. Default 5000." << std::endl;
+  std::wcout << "--fast-start : Minimal stream probing, trust the SDP codec parameters, start on the first keyframe." << std::endl;
+  std::wcout << "--max-queue-bytes=value : Packets buffered ahead of the decoders in bytes. Default 15728640." << std::endl;
+  std::wcout << "--max-queue-seconds=value : Packets buffered ahead of the decoders in seconds of media, 0 for no limit. Default 0." << std::endl;
+  std::wcout << "--late-drop-ms=value : Drop pictures behind the master clock by more than value ms, 0 to show them all. Default 40." << std::endl;
+  std::wcout << "--record=path : Record every stream to disk without transcoding, container from the extension (.mp4, .mkv, .ts)." << std::endl;
+  std::wcout << "--record-segment-sec=value : Start a new file every value seconds, 0 for no limit. Default 0." << std::endl;
+  std::wcout << "--record-segment-mb=value : Start a new file every value MB, 0 for no limit. Default 0." << std::endl;
+  std::wcout << "--pre-event-sec=value : With --record, only record around events: value seconds before, 'r' triggers an event." << std::endl;
+  std::wcout << "--post-event-sec=value : Seconds recorded after an event. Default 10." << std::endl;
+  std::wcout << "--pre-event-max-mb=value : Memory kept for the pre-event packets of each stream in MB. Default 32." << std::endl;
+  std::wcout << "--pre-event-total-mb=value : Memory kept for the pre-event packets of every stream in MB. Default 1024." << std::endl;
+  std::wcout << "--keyframe-only : Only decode keyframes, 'k' toggles it, clicking a mosaic tile decodes it fully." << std::endl;
+  std::wcout << "--decoder-threads=value : Video decoder threads per stream, 0 for one per core. Default 0." << std::endl;
+  std::wcout << "--thread-type=value : Video decoder threading, frame, slice or auto. Default auto, slice in live mode." << std::endl;
+  std::wcout << "--thread-budget=value : Cores shared by the video decoders of the running streams, auto for all of them. Default 0, no budget." << std::endl;
+  std::wcout << "--sws-threads=value : Bands of each picture converted in parallel on the shared workers when its format must be converted. Default 1." << std::endl;
+  std::wcout << "--io-threads=value : Blocking threads on top of one per stream and one per recorded stream, for the reconnection timers. Default 1." << std::endl;
+  std::wcout << "--downscale : Decode and convert pictures at the size they are displayed, for small windows and mosaic tiles." << std::endl;
+  std::wcout << "--metrics-file=file : Write the metrics of every session in the Prometheus text format to this file." << std::endl;
+  std::wcout << "--metrics-interval=value : Seconds between two writes of the metrics file. Default 10." << std::endl;
+  std::wcout << "--latency-overlay : Show the capture to display latency in the window title, needs rtcp sender reports." << std::endl;
+  std::wcout << "--trace=file : Record the time spent in each stage from the start and write it as a Chrome trace when done, 't' toggles tracing." << std::endl;
+  std::wcout << "--live : Keep the playback latency low, catch up when media piles up." << std::endl;
+  std::wcout << "--latency-target-ms=value : Live mode, buffered latency above which playback catches up. Default 500." << std::endl;
+  std::wcout << "--latency-cap-ms=value : Live mode, buffered latency above which the backlog is dropped. Default 2000." << std::endl << std::endl;
+
   // Get audio output devices.
+  SDL_InitSubSystem(SDL_INIT_AUDIO);
   std::vector<std::wstring> vecAudioOutDevNames;
   std::wcout << "----- Audio Output Devices -----" << std::endl;
   getOutputAudioDeviceList(vecAudioOutDevNames);
@@ -89,6 +128,241 @@ static inline void usage(const std::wstring& wsProgName)
   }
 }
 
+static inline bool parseNamedValue(const std::string& name, const std::string& value, Options& opt)
+{
+  if (name == "--audio-buffer-ms")
+  {
+    opt.audioBufferMs = std::stoi(value);
+    return opt.audioBufferMs > 0;
+  }
+
+  if (name == "--picture-queue-size")
+  {
+    opt.pictureQueueSize = std::stoi(value);
+    return opt.pictureQueueSize > 0 && opt.pictureQueueSize <= VIDEO_PICTURE_QUEUE_SIZE_MAX;
+  }
+
+  if (name == "--headless" || name == "--bench")
+  {
+    opt.headless = 1;
+    return value.empty();
+  }
+
+  if (name == "--url")
+  {
+    opt.urls.push_back(value);
+    return !value.empty();
+  }
+
+  if (name == "--mosaic")
+  {
+    opt.mosaic = 1;
+    return value.empty();
+  }
+
+  if (name == "--reconnect-max-ms")
+  {
+    opt.reconnectMaxMs = std::stoi(value);
+    return opt.reconnectMaxMs >= 0;
+  }
+
+  if (name == "--fast-start")
+  {
+    opt.fastStart = 1;
+    return value.empty();
+  }
+
+  if (name == "--max-queue-bytes")
+  {
+    opt.maxQueueBytes = std::stoll(value);
+    return opt.maxQueueBytes > 0;
+  }
+
+  if (name == "--max-queue-seconds")
+  {
+    opt.maxQueueSeconds = std::stod(value);
+    return opt.maxQueueSeconds >= 0;
+  }
+
+  if (name == "--late-drop-ms")
+  {
+    opt.lateDropMs = std::stoi(value);
+    return opt.lateDropMs >= 0;
+  }
+
+  if (name == "--record")
+  {
+    opt.recordPath = value;
+    return !value.empty();
+  }
+
+  if (name == "--record-segment-sec")
+  {
+    opt.recordSegmentSec = std::stoi(value);
+    return opt.recordSegmentSec >= 0;
+  }
+
+  if (name == "--record-segment-mb")
+  {
+    opt.recordSegmentMb = std::stoi(value);
+    return opt.recordSegmentMb >= 0;
+  }
+
+  if (name == "--pre-event-sec")
+  {
+    opt.preEventSec = std::stoi(value);
+    return opt.preEventSec >= 0;
+  }
+
+  if (name == "--post-event-sec")
+  {
+    opt.postEventSec = std::stoi(value);
+    return opt.postEventSec >= 0;
+  }
+
+  if (name == "--pre-event-max-mb")
+  {
+    opt.preEventMaxMb = std::stoi(value);
+    return opt.preEventMaxMb > 0;
+  }
+
+  if (name == "--pre-event-total-mb")
+  {
+    opt.preEventTotalMb = std::stoi(value);
+    return opt.preEventTotalMb > 0;
+  }
+
+  if (name == "--keyframe-only")
+  {
+    opt.keyframeOnly = 1;
+    return value.empty();
+  }
+
+  if (name == "--decoder-threads")
+  {
+    opt.decoderThreads = std::stoi(value);
+    return opt.decoderThreads >= 0;
+  }
+
+  if (name == "--thread-type")
+  {
+    if (value == "frame")
+    {
+      opt.threadType = FF_THREAD_FRAME;
+    }
+    else if (value == "slice")
+    {
+      opt.threadType = FF_THREAD_SLICE;
+    }
+    else if (value == "auto")
+    {
+      opt.threadType = 0;
+    }
+    else
+    {
+      return false;
+    }
+    return true;
+  }
+
+  if (name == "--thread-budget")
+  {
+    opt.threadBudget = value == "auto" ? SDL_GetCPUCount() : std::stoi(value);
+    return opt.threadBudget >= 0;
+  }
+
+  if (name == "--sws-threads")
+  {
+    opt.swsThreads = std::stoi(value);
+    return opt.swsThreads >= 1 && opt.swsThreads <= 64;
+  }
+
+  if (name == "--io-threads")
+  {
+    opt.ioThreads = std::stoi(value);
+    return opt.ioThreads >= 0 && opt.ioThreads <= 1024;
+  }
+
+  if (name == "--downscale")
+  {
+    opt.downscale = 1;
+    return value.empty();
+  }
+
+  if (name == "--metrics-file")
+  {
+    opt.metricsFile = value;
+    return !value.empty();
+  }
+
+  if (name == "--metrics-interval")
+  {
+    opt.metricsIntervalSec = std::stoi(value);
+    return opt.metricsIntervalSec > 0;
+  }
+
+  if (name == "--latency-overlay")
+  {
+    opt.latencyOverlay = 1;
+    return value.empty();
+  }
+
+  if (name == "--trace")
+  {
+    opt.tracePath = value;
+    return !value.empty();
+  }
+
+  if (name == "--live")
+  {
+    opt.live = 1;
+    return value.empty();
+  }
+
+  if (name == "--latency-target-ms")
+  {
+    opt.latencyTargetMs = std::stoi(value);
+    return opt.latencyTargetMs > 0;
+  }
+
+  if (name == "--latency-cap-ms")
+  {
+    opt.latencyCapMs = std::stoi(value);
+    return opt.latencyCapMs > 0;
+  }
+
+  if (name == "--audio-session")
+  {
+    opt.audioSession = std::stoi(value);
+    return opt.audioSession >= -1;
+  }
+
+  return false;
+}
+
+static inline bool parseNamedOption(const std::string& arg, Options& opt)
+{
+  // Options are given as "--name=value"
+  std::string name = arg;
+  std::string value;
+  size_t pos = arg.find('=');
+  if (pos != std::string::npos)
+  {
+    name = arg.substr(0, pos);
+    value = arg.substr(pos + 1);
+  }
+
+  // std::stoi and the like throw on an empty or non numeric value, and on one out of range
+  try
+  {
+    return parseNamedValue(name, value, opt);
+  }
+  catch (const std::logic_error&)
+  {
+    return false;
+  }
+}
+
 void myLogCallback(void* ptr, int level, const char* fmt, va_list vargs)
 {
   vprintf(fmt, vargs);
@@ -99,19 +373,50 @@ int main(int argc, char *argv[])
   // Set locale(use to the system default locale)
   std::wcout.imbue(std::locale(""));
 
-  // init SDL
-  int ret = -1;
-  ret = SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER);
-  if (ret != 0)
+  std::string progName = std::string(argv[0]);
+  std::wstring wsProgName = UTF8ToUnicode(progName);
+
+  Options opt;
+
+  // Split "--name=value" options from the positional arguments
+  std::vector<char*> positionalArgs;
+  for (int i = 0; i < argc; i++)
   {
-    std::cerr << "Could not initialize SDL" << SDL_GetError() << std::endl;
+    std::string arg = std::string(argv[i]);
+    if (i > 0 && arg.rfind("--", 0) == 0)
+    {
+      if (!parseNamedOption(arg, opt))
+      {
+        std::cerr << "Failed to set option " << arg << std::endl;
+        usage(wsProgName);
+        return -1;
+      }
+      continue;
+    }
+    positionalArgs.push_back(argv[i]);
+  }
+  argc = (int)positionalArgs.size();
+  argv = positionalArgs.data();
+
+  // the audio device index is not needed in headless mode
+  if (argc < (opt.headless ? 2 : 3))
+  {
+    usage(wsProgName);
     return -1;
   }
 
-  std::string progName = std::string(argv[0]);
-  std::wstring wsProgName = UTF8ToUnicode(progName);
-  if (argc < 3)
+  // the pre-event packets are written by the recorder
+  if (opt.preEventSec > 0 && opt.recordPath.empty())
   {
+    std::cerr << "--pre-event-sec needs --record." << std::endl;
+    usage(wsProgName);
+    return -1;
+  }
+
+  // playback catches up between the target and the cap, below it every check would drop the backlog
+  if (opt.latencyCapMs < opt.latencyTargetMs)
+  {
+    std::cerr << "--latency-cap-ms must not be below --latency-target-ms." << std::endl;
     usage(wsProgName);
     return -1;
   }
@@ -122,17 +427,10 @@ int main(int argc, char *argv[])
   av_log_set_callback(myLogCallback);
 #endif
 
-  Options opt;
-
   // Output audio device.
-  std::vector<std::wstring> vecAudioOutDevNames;
-  int deviceNum = getOutputAudioDeviceList(vecAudioOutDevNames);
-  opt.audioIndex = std::stoi(argv[2]);
-  if (deviceNum < opt.audioIndex)
+  if (!opt.headless)
   {
-    std::cerr << "Failed to input audio output device number." << std::endl;
-    usage(wsProgName);
-    return -1;
+    opt.audioIndex = std::stoi(argv[2]);
   }
 
   // Sync type
@@ -207,27 +505,37 @@ int main(int argc, char *argv[])
     }
   }
 
-  // Create filename
-  std::string filename = std::string(argv[1]);
+  // The positional url is the first session, --url adds the others
+  opt.urls.insert(opt.urls.begin(), std::string(argv[1]));
 
-  // Create VideoState
-  std::shared_ptr<VideoState> videoState = std::make_shared<VideoState>();
-  videoState->filename = filename;
-  videoState->av_sync_type = (SYNC_TYPE)opt.syncType;
+  // SDL is initialised once for every session
+  SessionManager sessionManager;
+  if (sessionManager.init(opt) < 0)
+  {
+    return -1;
+  }
 
-  // Create VideoReader
-  std::unique_ptr<VideoReader> videoReader = std::make_unique<VideoReader>();
-  videoReader->start(videoState.get(), opt);
-  while(1)
+  if (!opt.headless)
   {
-    std::chrono::milliseconds duration(1000);
-    std::this_thread::sleep_for(duration);
-    if (videoReader->quitStatus())
+    std::vector<std::wstring> vecAudioOutDevNames;
+    int deviceNum = getOutputAudioDeviceList(vecAudioOutDevNames);
+    if (deviceNum < opt.audioIndex)
     {
-      break;
+      std::cerr << "Failed to input audio output device number." << std::endl;
+      usage(wsProgName);
+      return -1;
     }
   }
 
+  // Start every session, a failing url does not prevent the others from running
+  for (const std::string& url : opt.urls)
+  {
+    sessionManager.addSession(url);
+  }
+
+  // Runs the event loop until the last session ends
+  sessionManager.run();
+
   std::wcout << "finished." << std::endl;
   return 0;
 }
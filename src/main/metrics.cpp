@@ -0,0 +1,162 @@
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "metrics.h"
+
+const int64_t MetricHistogram::s_bounds[METRIC_HISTOGRAM_BUCKETS] =
+{
+  1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 2000000, 5000000
+};
+
+MetricHistogram::MetricHistogram()
+  : sum(0)
+  , count(0)
+{
+  for (auto& bucket : counts)
+  {
+    bucket = 0;
+  }
+}
+
+MetricHistogram::~MetricHistogram()
+{
+}
+
+void MetricHistogram::observe(int64_t value)
+{
+  int i = 0;
+  while (i < METRIC_HISTOGRAM_BUCKETS && value > s_bounds[i])
+  {
+    i++;
+  }
+  counts[i].fetch_add(1, std::memory_order_relaxed);
+  sum.fetch_add(value, std::memory_order_relaxed);
+  count.fetch_add(1, std::memory_order_relaxed);
+}
+
+MetricsRegistry::MetricsRegistry()
+{
+}
+
+MetricsRegistry::~MetricsRegistry()
+{
+}
+
+void MetricsRegistry::addCounter(const std::string& name, const std::string& help, const std::string& labels, std::function<double()> value)
+{
+  this->add(name, help, "counter", Series{labels, std::move(value), nullptr});
+}
+
+void MetricsRegistry::addGauge(const std::string& name, const std::string& help, const std::string& labels, std::function<double()> value)
+{
+  this->add(name, help, "gauge", Series{labels, std::move(value), nullptr});
+}
+
+void MetricsRegistry::addHistogram(const std::string& name, const std::string& help, const std::string& labels, const MetricHistogram *histogram)
+{
+  this->add(name, help, "histogram", Series{labels, nullptr, histogram});
+}
+
+void MetricsRegistry::add(const std::string& name, const std::string& help, const std::string& type, Series series)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (auto& family : m_families)
+  {
+    if (family.name == name)
+    {
+      family.series.push_back(std::move(series));
+      return;
+    }
+  }
+  m_families.push_back(Family{name, help, type, {}});
+  m_families.back().series.push_back(std::move(series));
+}
+
+void MetricsRegistry::remove(const std::string& labels)
+{
+  // the series with these labels, and those with more labels after them
+  std::string prefix = labels + ",";
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for (auto& family : m_families)
+  {
+    for (auto it = family.series.begin(); it != family.series.end();)
+    {
+      bool match = it->labels == labels || it->labels.compare(0, prefix.size(), prefix) == 0;
+      it = match ? family.series.erase(it) : it + 1;
+    }
+  }
+}
+
+std::string MetricsRegistry::text()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  std::ostringstream out;
+  for (const auto& family : m_families)
+  {
+    if (family.series.empty())
+    {
+      continue;
+    }
+    out << "# HELP " << family.name << " " << family.help << "\n";
+    out << "# TYPE " << family.name << " " << family.type << "\n";
+    for (const auto& series : family.series)
+    {
+      if (!series.histogram)
+      {
+        out << family.name << "{" << series.labels << "} " << series.value() << "\n";
+        continue;
+      }
+
+      // durations are exported in seconds, buckets are cumulative
+      const MetricHistogram *histogram = series.histogram;
+      uint64_t cumulative = 0;
+      for (int i = 0; i <= METRIC_HISTOGRAM_BUCKETS; i++)
+      {
+        cumulative += histogram->counts[i].load(std::memory_order_relaxed);
+        out << family.name << "_bucket{" << series.labels << ",le=\"";
+        if (i < METRIC_HISTOGRAM_BUCKETS)
+        {
+          out << MetricHistogram::s_bounds[i] / 1000000.0;
+        }
+        else
+        {
+          out << "+Inf";
+        }
+        out << "\"} " << cumulative << "\n";
+      }
+      out << family.name << "_sum{" << series.labels << "} " << histogram->sum / 1000000.0 << "\n";
+      out << family.name << "_count{" << series.labels << "} " << cumulative << "\n";
+    }
+  }
+  return out.str();
+}
+
+int MetricsRegistry::writeFile(const std::string& path)
+{
+  // written aside and renamed, a scraper never reads half a file
+  std::string tmpPath = path + ".tmp";
+  {
+    std::ofstream out(tmpPath, std::ios::out | std::ios::trunc);
+    if (!out)
+    {
+      std::cerr << "Could not open the metrics file " << tmpPath << std::endl;
+      return -1;
+    }
+    out << this->text();
+    if (!out.good())
+    {
+      return -1;
+    }
+  }
+#ifdef _WIN32
+  // rename does not replace an existing file there
+  std::remove(path.c_str());
+#endif
+  if (std::rename(tmpPath.c_str(), path.c_str()) != 0)
+  {
+    std::cerr << "Could not write the metrics file " << path << std::endl;
+    return -1;
+  }
+  return 0;
+}
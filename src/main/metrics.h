@@ -0,0 +1,73 @@
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// upper bounds of the histogram buckets, in us (1 ms to 2 s), +Inf is implied
+#define METRIC_HISTOGRAM_BUCKETS 12
+
+// Distribution of a duration. observe() is wait-free: a few relaxed atomic adds,
+// the one writer thread of a session never contends with the other sessions.
+class MetricHistogram
+{
+public:
+  explicit MetricHistogram();
+  ~MetricHistogram();
+
+  void observe(int64_t value);
+
+  static const int64_t s_bounds[METRIC_HISTOGRAM_BUCKETS];
+
+  // one more for +Inf, counts are not cumulative here
+  std::atomic<uint64_t> counts[METRIC_HISTOGRAM_BUCKETS + 1];
+  std::atomic<int64_t> sum;
+  std::atomic<uint64_t> count;
+};
+
+// Every metric of every session, exported in the Prometheus text exposition format.
+// The registry does not own the values: counters and gauges are read through a function,
+// histograms through a pointer, when the text is built. The hot paths only touch their
+// own atomics, the registry lock is taken to add or remove a session and to export.
+// A session removes its series (by their leading labels) before its values are destroyed.
+class MetricsRegistry
+{
+public:
+  explicit MetricsRegistry();
+  ~MetricsRegistry();
+
+  void addCounter(const std::string& name, const std::string& help, const std::string& labels, std::function<double()> value);
+  void addGauge(const std::string& name, const std::string& help, const std::string& labels, std::function<double()> value);
+  void addHistogram(const std::string& name, const std::string& help, const std::string& labels, const MetricHistogram *histogram);
+  void remove(const std::string& labels);
+  std::string text();
+  int writeFile(const std::string& path);
+
+private:
+  struct Series
+  {
+    std::string labels;
+    std::function<double()> value;
+    const MetricHistogram *histogram;
+  };
+
+  struct Family
+  {
+    std::string name;
+    std::string help;
+    std::string type;
+    std::vector<Series> series;
+  };
+
+  std::mutex m_mutex;
+  std::vector<Family> m_families;
+
+  void add(const std::string& name, const std::string& help, const std::string& type, Series series);
+};
+
+#endif // METRICS_H_
@@ -0,0 +1,434 @@
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include "mosaicrenderer.h"
+#include "tracer.h"
+
+MosaicRenderer::MosaicRenderer()
+  : m_screen(nullptr)
+  , m_renderer(nullptr)
+  , m_timer(0)
+  , m_refreshPending(0)
+  , m_redraw(1)
+  , m_focus(nullptr)
+  , m_titleTime(0)
+{
+}
+
+MosaicRenderer::~MosaicRenderer()
+{
+  this->stop();
+}
+
+int MosaicRenderer::start(int width, int height)
+{
+  int flags = SDL_WINDOW_OPENGL | SDL_WINDOW_ALLOW_HIGHDPI | SDL_WINDOW_RESIZABLE;
+  m_screen = SDL_CreateWindow(
+    "RTSP Client"
+    , SDL_WINDOWPOS_UNDEFINED
+    , SDL_WINDOWPOS_UNDEFINED
+    , width
+    , height
+    , flags
+    );
+  if (!m_screen)
+  {
+    std::cerr << "SDL : could not create window - exiting" << std::endl;
+    return -1;
+  }
+
+  // the one present per refresh waits for vsync
+  m_renderer = SDL_CreateRenderer(
+    m_screen
+    , -1
+    , SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC | SDL_RENDERER_TARGETTEXTURE
+    );
+  if (!m_renderer)
+  {
+    std::cerr << "SDL : could not create renderer : " << SDL_GetError() << std::endl;
+    return -1;
+  }
+
+  // refresh at the display rate
+  int interval = 16;
+  SDL_DisplayMode mode;
+  if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(m_screen), &mode) == 0 && mode.refresh_rate > 0)
+  {
+    interval = 1000 / mode.refresh_rate;
+  }
+  m_timer = SDL_AddTimer(interval, this->sdlRefreshTimerCB, this);
+  if (m_timer == 0)
+  {
+    std::cerr << "could not schedule refresh callback : " << SDL_GetError() << std::endl;
+    return -1;
+  }
+
+  return 0;
+}
+
+void MosaicRenderer::stop()
+{
+  if (m_timer)
+  {
+    SDL_RemoveTimer(m_timer);
+    m_timer = 0;
+  }
+
+  while (!m_tiles.empty())
+  {
+    this->removeSession(m_tiles.back()->videoState);
+  }
+
+  if (m_renderer)
+  {
+    SDL_DestroyRenderer(m_renderer);
+    m_renderer = nullptr;
+  }
+  if (m_screen)
+  {
+    SDL_DestroyWindow(m_screen);
+    m_screen = nullptr;
+  }
+}
+
+int MosaicRenderer::addSession(VideoState *videoState)
+{
+  std::unique_ptr<MosaicTile> tile = std::make_unique<MosaicTile>();
+  tile->videoState = videoState;
+  tile->frame = av_frame_alloc();
+  if (!tile->frame)
+  {
+    return -1;
+  }
+  m_tiles.push_back(std::move(tile));
+
+  // the grid layout changed
+  m_redraw = 1;
+  return 0;
+}
+
+void MosaicRenderer::removeSession(VideoState *videoState)
+{
+  for (auto it = m_tiles.begin(); it != m_tiles.end(); ++it)
+  {
+    MosaicTile *tile = it->get();
+    if (tile->videoState == videoState)
+    {
+      if (m_focus == videoState)
+      {
+        m_focus = nullptr;
+      }
+      av_frame_free(&tile->frame);
+      if (tile->texture)
+      {
+        SDL_DestroyTexture(tile->texture);
+        tile->texture = nullptr;
+      }
+      m_tiles.erase(it);
+      m_redraw = 1;
+      return;
+    }
+  }
+}
+
+VideoState* MosaicRenderer::toggleFocus(int x, int y)
+{
+  m_redraw = 1;
+  if (m_focus || m_tiles.empty())
+  {
+    m_focus = nullptr;
+    return nullptr;
+  }
+
+  // mouse positions are in window coordinates, the grid in renderer pixels (high dpi)
+  int screen_width = -1;
+  int screen_height = -1;
+  int window_width = 0;
+  int window_height = 0;
+  SDL_GetRendererOutputSize(m_renderer, &screen_width, &screen_height);
+  SDL_GetWindowSize(m_screen, &window_width, &window_height);
+  if (window_width > 0 && window_height > 0)
+  {
+    x = x * screen_width / window_width;
+    y = y * screen_height / window_height;
+  }
+
+  int cols = 1;
+  int rows = 1;
+  this->gridSize((int)m_tiles.size(), &cols, &rows);
+  int col = std::min(x / std::max(1, screen_width / cols), cols - 1);
+  int row = std::min(y / std::max(1, screen_height / rows), rows - 1);
+  int index = row * cols + col;
+  if (index >= 0 && index < (int)m_tiles.size())
+  {
+    m_focus = m_tiles[index]->videoState;
+  }
+
+  return m_focus;
+}
+
+void MosaicRenderer::cellSize(int count, int *width, int *height)
+{
+  // the size of one cell in renderer pixels once count sessions are shown
+  int cols = 1;
+  int rows = 1;
+  int screen_width = 0;
+  int screen_height = 0;
+  this->gridSize(count, &cols, &rows);
+  if (m_renderer)
+  {
+    SDL_GetRendererOutputSize(m_renderer, &screen_width, &screen_height);
+  }
+  *width = screen_width / cols;
+  *height = screen_height / rows;
+}
+
+Uint32 MosaicRenderer::windowID() const
+{
+  return m_screen ? SDL_GetWindowID(m_screen) : 0;
+}
+
+Uint32 MosaicRenderer::sdlRefreshTimerCB(Uint32 interval, void *param)
+{
+  MosaicRenderer *mosaic = (MosaicRenderer *)param;
+
+  // do not pile up refresh events while a present is waiting for vsync
+  if (!mosaic->m_refreshPending.exchange(1))
+  {
+    SDL_Event event;
+    event.type = FF_MOSAIC_REFRESH_EVENT;
+    event.user.data1 = param;
+    SDL_PushEvent(&event);
+  }
+
+  // keep the timer running
+  return interval;
+}
+
+void MosaicRenderer::refresh()
+{
+  m_refreshPending = 0;
+  if (!m_renderer)
+  {
+    return;
+  }
+
+  double now = av_gettime() / 1000000.0;
+
+  // pace every session on its own clock, upload only the tiles that changed
+  int changed = 0;
+  for (auto& tile : m_tiles)
+  {
+    if (this->pullPicture(tile.get(), now) && this->uploadTile(tile.get()) == 0)
+    {
+      changed++;
+    }
+  }
+
+  if (!changed && !m_redraw)
+  {
+    return;
+  }
+  m_redraw = 0;
+
+  int screen_width = -1;
+  int screen_height = -1;
+  SDL_GetRendererOutputSize(m_renderer, &screen_width, &screen_height);
+
+  // compose the whole grid, textures of unchanged tiles are simply drawn again
+  SDL_SetRenderDrawColor(m_renderer, 0, 0, 0, 255);
+  SDL_RenderClear(m_renderer);
+  for (int i = 0; i < (int)m_tiles.size(); i++)
+  {
+    MosaicTile *tile = m_tiles[i].get();
+    if (tile->texture && (!m_focus || tile->videoState == m_focus))
+    {
+      SDL_Rect rect{};
+      this->tileRect(i, screen_width, screen_height, tile, &rect);
+      SDL_RenderCopy(m_renderer, tile->texture, nullptr, &rect);
+
+      // the decoder side converts the next pictures of this session to the tile size
+      tile->videoState->target_width = rect.w;
+      tile->videoState->target_height = rect.h;
+    }
+  }
+
+  // one present for all the sessions
+  {
+    TRACE_SCOPE("SDL_RenderPresent");
+    SDL_RenderPresent(m_renderer);
+  }
+
+  // how old the pictures are now that they are on screen
+  int64_t latency_max = -1;
+  for (auto& tile : m_tiles)
+  {
+    if (tile->captureTime > 0)
+    {
+      tile->videoState->addCaptureLatency(tile->captureTime);
+      tile->captureTime = 0;
+    }
+    if (tile->videoState->latency_overlay && tile->videoState->capture_latency_hist.count > 0)
+    {
+      latency_max = std::max<int64_t>(latency_max, tile->videoState->capture_latency_last);
+    }
+  }
+  int64_t title_time = av_gettime_relative();
+  if (latency_max >= 0 && title_time - m_titleTime >= 1000000)
+  {
+    // once a second, the oldest picture of the grid
+    m_titleTime = title_time;
+    std::string title = "RTSP Client - capture to display up to " + std::to_string(latency_max / 1000) + " ms";
+    SDL_SetWindowTitle(m_screen, title.c_str());
+  }
+}
+
+int MosaicRenderer::pullPicture(MosaicTile *tile, double now)
+{
+  VideoState *videoState = tile->videoState;
+
+  // Check the video stream was correctly opened and the picture is due
+  if (videoState->video_width <= 0 || videoState->quit || now < tile->nextRefresh)
+  {
+    return 0;
+  }
+
+  // Check the videopicture queue contains decoded frames
+  if (videoState->pictq_size == 0)
+  {
+    // the decoder is behind, count each time the queue runs dry
+    if (!tile->starved)
+    {
+      videoState->pictq_empty_count++;
+      tile->starved = 1;
+    }
+    return 0;
+  }
+  tile->starved = 0;
+
+  // skip what is already late when a newer picture is waiting
+  videoState->dropLatePictures();
+
+  // Compute when the next picture of this session is due, synced to its master clock
+  VideoPicture *videoPicture = &videoState->pictq[videoState->pictq_rindex];
+  tile->nextRefresh = now + videoState->computeRefreshDelay(videoPicture);
+
+  // keep a reference so that the slot goes back to the decoder right away
+  av_frame_unref(tile->frame);
+  int ret = -1;
+  if (videoPicture->frame)
+  {
+    ret = av_frame_ref(tile->frame, videoPicture->frame);
+  }
+  if (ret >= 0)
+  {
+    // the rendered frame rate and its jitter
+    int64_t display_time = av_gettime_relative();
+    if (tile->lastDisplay)
+    {
+      videoState->frame_interval_hist.observe(display_time - tile->lastDisplay);
+    }
+    tile->lastDisplay = display_time;
+    videoState->frames_rendered.fetch_add(1, std::memory_order_relaxed);
+    tile->captureTime = videoPicture->capture_time;
+
+    AVRational sar = tile->frame->sample_aspect_ratio;
+    tile->aspectRatio = (double)tile->frame->width / (double)tile->frame->height;
+    if (sar.num > 0 && sar.den > 0)
+    {
+      tile->aspectRatio *= av_q2d(sar);
+    }
+  }
+
+  // Release the slot for the decoder
+  videoState->popPicture();
+
+  return ret >= 0;
+}
+
+int MosaicRenderer::uploadTile(MosaicTile *tile)
+{
+  AVFrame *frame = tile->frame;
+
+  // (re)create the tile texture when the picture size changes
+  if (!tile->texture || tile->textureWidth != frame->width || tile->textureHeight != frame->height)
+  {
+    if (tile->texture)
+    {
+      SDL_DestroyTexture(tile->texture);
+    }
+    tile->texture = SDL_CreateTexture(
+      m_renderer
+      , SDL_PIXELFORMAT_YV12
+      , SDL_TEXTUREACCESS_STREAMING
+      , frame->width
+      , frame->height
+      );
+    if (!tile->texture)
+    {
+      std::cerr << "SDL : could not create texture : " << SDL_GetError() << std::endl;
+      av_frame_unref(frame);
+      return -1;
+    }
+    tile->textureWidth = frame->width;
+    tile->textureHeight = frame->height;
+  }
+
+  TRACE_SCOPE("SDL_UpdateYUVTexture");
+  SDL_UpdateYUVTexture(
+    tile->texture
+    , nullptr
+    , frame->data[0]
+    , frame->linesize[0]
+    , frame->data[1]
+    , frame->linesize[1]
+    , frame->data[2]
+    , frame->linesize[2]
+    );
+
+  // the texture holds the pixels now, give the buffer back to the decoder
+  av_frame_unref(frame);
+
+  return 0;
+}
+
+void MosaicRenderer::gridSize(int count, int *cols, int *rows)
+{
+  // smallest square-ish grid holding every session
+  count = std::max(1, count);
+  *cols = (int)std::ceil(std::sqrt((double)count));
+  *rows = (count + *cols - 1) / *cols;
+}
+
+void MosaicRenderer::tileRect(int index, int screen_width, int screen_height, const MosaicTile *tile, SDL_Rect *rect)
+{
+  // the enlarged tile takes the whole window
+  int cols = 1;
+  int rows = 1;
+  int col = 0;
+  int row = 0;
+  if (!m_focus)
+  {
+    this->gridSize((int)m_tiles.size(), &cols, &rows);
+    col = index % cols;
+    row = index / cols;
+  }
+  int cell_width = screen_width / cols;
+  int cell_height = screen_height / rows;
+
+  // fit the picture into its cell keeping the aspect ratio
+  double aspect_ratio = tile->aspectRatio > 0 ? tile->aspectRatio : (double)cell_width / cell_height;
+  int w = cell_width;
+  int h = (int)std::lrint(w / aspect_ratio);
+  if (h > cell_height)
+  {
+    h = cell_height;
+    w = (int)std::lrint(h * aspect_ratio);
+  }
+
+  rect->x = col * cell_width + (cell_width - w) / 2;
+  rect->y = row * cell_height + (cell_height - h) / 2;
+  rect->w = w;
+  rect->h = h;
+}
@@ -0,0 +1,70 @@
+
+#ifndef MOSAIC_RENDERER_H_
+#define MOSAIC_RENDERER_H_
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "videostate.h"
+
+#define FF_MOSAIC_REFRESH_EVENT (SDL_USEREVENT + 2)
+
+// default size of the mosaic window
+#define MOSAIC_DEFAULT_WIDTH  1280
+#define MOSAIC_DEFAULT_HEIGHT 720
+
+// One cell of the mosaic, showing the latest picture of one session.
+struct MosaicTile
+{
+  VideoState* videoState = nullptr;
+  AVFrame* frame = nullptr;
+  SDL_Texture* texture = nullptr;
+  int textureWidth = 0;
+  int textureHeight = 0;
+  double aspectRatio = 0;
+  double nextRefresh = 0;
+  int64_t lastDisplay = 0;
+  int64_t captureTime = 0;
+  int starved = 0;
+};
+
+// Composites many sessions into a grid inside one window.
+// A single periodic refresh, at the display rate, paces every session through its
+// own next refresh time, uploads only the tiles that got a new picture and
+// presents once. Everything runs on the event loop thread of the SessionManager.
+// Clicking a tile enlarges it to the whole window, clicking again goes back to the grid.
+class MosaicRenderer
+{
+public:
+  explicit MosaicRenderer();
+  ~MosaicRenderer();
+
+  int start(int width, int height);
+  void stop();
+  int addSession(VideoState *videoState);
+  void removeSession(VideoState *videoState);
+  void refresh();
+  void invalidate() { m_redraw = 1; }
+  VideoState* toggleFocus(int x, int y);
+  void cellSize(int count, int *width, int *height);
+  Uint32 windowID() const;
+
+private:
+  SDL_Window* m_screen;
+  SDL_Renderer* m_renderer;
+  SDL_TimerID m_timer;
+  std::atomic<int> m_refreshPending;
+  int m_redraw;
+  // the enlarged session, nullptr for the grid
+  VideoState* m_focus;
+  int64_t m_titleTime;
+  std::vector<std::unique_ptr<MosaicTile>> m_tiles;
+
+  int pullPicture(MosaicTile *tile, double now);
+  int uploadTile(MosaicTile *tile);
+  void gridSize(int count, int *cols, int *rows);
+  void tileRect(int index, int screen_width, int screen_height, const MosaicTile *tile, SDL_Rect *rect);
+  static Uint32 sdlRefreshTimerCB(Uint32 interval, void *param);
+};
+
+#endif // MOSAIC_RENDERER_H_
@@ -2,6 +2,9 @@
 #ifndef OPTIONS_H_
 #define OPTIONS_H_
 
+#include <string>
+#include <vector>
+
 struct Options
 {
   int audioIndex = 0;
@@ -11,6 +14,38 @@ struct Options
   int maxDelay = 0;
   int stimeout = 0;
   int bufferSize = 0;
+  int audioBufferMs = 100;
+  int pictureQueueSize = 1;
+  int headless = 0;
+  int audioSession = 0;
+  int mosaic = 0;
+  int reconnectMaxMs = 5000;
+  int fastStart = 0;
+  int64_t maxQueueBytes = 15 * 1024 * 1024;
+  double maxQueueSeconds = 0;
+  int live = 0;
+  int latencyTargetMs = 500;
+  int latencyCapMs = 2000;
+  int lateDropMs = 40;
+  std::string recordPath;
+  int recordSegmentSec = 0;
+  int recordSegmentMb = 0;
+  int preEventSec = 0;
+  int postEventSec = 10;
+  int preEventMaxMb = 32;
+  int preEventTotalMb = 1024;
+  int keyframeOnly = 0;
+  int decoderThreads = 0;
+  int threadType = 0;
+  int threadBudget = 0;
+  int swsThreads = 1;
+  int ioThreads = 1;
+  int downscale = 0;
+  std::string tracePath;
+  std::string metricsFile;
+  int metricsIntervalSec = 10;
+  int latencyOverlay = 0;
+  std::vector<std::string> urls;
 };
 
 #endif // OPTIONS_H_
@@ -2,23 +2,77 @@
 #include <iostream>
 #include "packetqueue.h"
 
+// number of polls before a consumer/producer falls back to sleeping on the cond
+#define PACKET_QUEUE_SPIN_COUNT 100
+
 PacketQueue::PacketQueue()
-  : quit(0)
-  , first_pkt(nullptr)
-  , last_pkt(nullptr)
+  : size(0)
   , nb_packets(0)
-  , size(0)
+  , duration(0)
+  , quit(0)
+  , cond(nullptr)
+  , put_count(0)
+  , drop_count(0)
+  , full_count(0)
+  , m_slots(nullptr)
+  , m_durations(nullptr)
+  , m_capacity(0)
+  , m_mask(0)
+  , mutex(nullptr)
+  , m_notFullCond(nullptr)
+  , m_consumerWaiting(0)
+  , m_producerWaiting(0)
+  , m_timeBase(AVRational{1, AV_TIME_BASE})
+  , m_budget(nullptr)
+  , m_consumer(nullptr)
+  , m_lastDts(AV_NOPTS_VALUE)
+  , m_head(0)
+  , m_tail(0)
 {
 }
 
 PacketQueue::~PacketQueue()
 {
+  this->release();
 }
 
-void PacketQueue::init()
+void PacketQueue::init(int capacity)
 {
   quit = 0;
-  this->clear();
+  this->release();
+
+  // round up to a power of two so indexes can be masked
+  unsigned int slots = 1;
+  while (slots < (unsigned int)capacity)
+  {
+    slots <<= 1;
+  }
+
+  // pre-allocate every slot, put/get only move references in and out
+  m_slots = (AVPacket**)av_mallocz(slots * sizeof(AVPacket*));
+  m_durations = (int64_t*)av_mallocz(slots * sizeof(int64_t));
+  if (!m_slots || !m_durations)
+  {
+    this->release();
+    return;
+  }
+  m_capacity = slots;
+  m_mask = slots - 1;
+  for (unsigned int i = 0; i < slots; i++)
+  {
+    m_slots[i] = av_packet_alloc();
+    if (!m_slots[i])
+    {
+      this->release();
+      return;
+    }
+  }
+  m_head = 0;
+  m_tail = 0;
+  nb_packets = 0;
+  size = 0;
+  duration = 0;
+  m_lastDts = AV_NOPTS_VALUE;
 
   mutex = SDL_CreateMutex();
   if (!mutex)
@@ -30,176 +84,301 @@ void PacketQueue::init()
   {
     return;
   }
+  m_notFullCond = SDL_CreateCond();
+  if (!m_notFullCond)
+  {
+    return;
+  }
 }
 
 int PacketQueue::put(AVPacket *packet)
 {
-  MyAVPacketList* avPacketList;
-  avPacketList = (MyAVPacketList*)av_malloc(sizeof(MyAVPacketList));
+  if (!m_slots)
+  {
+    return -1;
+  }
 
-  // check the AVPacketList was allocated
-  if (!avPacketList)
+  unsigned int tail = m_tail.load(std::memory_order_relaxed);
+
+  // wait for a free slot, spinning a little before sleeping
+  for (int spin = 0; tail - m_head.load(std::memory_order_acquire) >= m_capacity; spin++)
+  {
+    if (quit)
+    {
+      return -1;
+    }
+    if (spin < PACKET_QUEUE_SPIN_COUNT)
+    {
+      continue;
+    }
+
+    full_count.fetch_add(1, std::memory_order_relaxed);
+    SDL_LockMutex(mutex);
+    m_producerWaiting.store(1, std::memory_order_seq_cst);
+    while (tail - m_head.load(std::memory_order_seq_cst) >= m_capacity && !quit)
+    {
+      SDL_CondWait(m_notFullCond, mutex);
+    }
+    m_producerWaiting.store(0, std::memory_order_relaxed);
+    SDL_UnlockMutex(mutex);
+  }
+
+  this->push(tail, packet);
+
+  return 0;
+}
+
+int PacketQueue::tryPut(AVPacket *packet)
+{
+  if (!m_slots || quit)
   {
     return -1;
   }
 
-  // add reference to the given AVPacket
-  avPacketList->pkt = *packet;
+  // never wait, a full ring is left to the caller
+  unsigned int tail = m_tail.load(std::memory_order_relaxed);
+  if (tail - m_head.load(std::memory_order_acquire) >= m_capacity)
+  {
+    drop_count.fetch_add(1, std::memory_order_relaxed);
+    return AVERROR(EAGAIN);
+  }
 
-  // the new AVPacketList will be inserted at the end of the queue
-  avPacketList->next = NULL;
+  this->push(tail, packet);
 
-  // lock mutex
-  SDL_LockMutex(mutex);
+  return 0;
+}
 
-  // check the queue is empty
-  if (!last_pkt)
+bool PacketQueue::full(unsigned int slots) const
+{
+  if (!m_slots)
   {
-    // if it is, insert as first
-    first_pkt = avPacketList;
+    return false;
+  }
+
+  // producer side, the consumer can only free slots meanwhile
+  unsigned int tail = m_tail.load(std::memory_order_relaxed);
+  return tail - m_head.load(std::memory_order_acquire) + slots > m_capacity;
+}
+
+void PacketQueue::push(unsigned int tail, AVPacket *packet)
+{
+  AVPacket *slot = m_slots[tail & m_mask];
+  int packetSize = packet->size;
+  int64_t packetDuration = this->packetDuration(packet);
+  m_durations[tail & m_mask] = packetDuration;
+  if (packet->buf)
+  {
+    // take over the reference of the given AVPacket
+    av_packet_move_ref(slot, packet);
   }
   else
   {
-    // if not, insert as last
-    last_pkt->next = avPacketList;
+    // not reference counted (i.e. the flush packet), only copy the fields
+    *slot = *packet;
   }
 
-  // point the last AVPacketList in the queue to the newly created AVPacketList
-  last_pkt = avPacketList;
-
-  // increase by 1 the number of AVPackets in the queue
+  // increase the number of AVPackets and the size of the queue
+  put_count.fetch_add(1, std::memory_order_relaxed);
   nb_packets++;
+  size += packetSize;
+  duration += packetDuration;
 
-  // increase queue size by adding the size of the newly inserted AVPacket
-  size += avPacketList->pkt.size;
-
-  // notify packet_queue_get which is waiting that a new packet is available
-  SDL_CondSignal(cond);
+  // publish the slot; seq_cst pairs with the consumer's waiting flag
+  m_tail.store(tail + 1, std::memory_order_seq_cst);
 
-  // unlock mutex
-  SDL_UnlockMutex(mutex);
+  // notify get() only when the consumer is actually sleeping
+  if (m_consumerWaiting.load(std::memory_order_seq_cst))
+  {
+    SDL_LockMutex(mutex);
+    SDL_CondSignal(cond);
+    SDL_UnlockMutex(mutex);
+  }
 
-  return 0;
+  // or run the consumer task, it returned when the ring was empty
+  if (m_consumer)
+  {
+    m_consumer->notify();
+  }
 }
 
 int PacketQueue::get(AVPacket *pkt, int block)
 {
-  int ret = 0;
-  MyAVPacketList *avPacketList = nullptr;
+  if (!m_slots)
+  {
+    return -1;
+  }
 
-  // lock mutex
-  SDL_LockMutex(mutex);
+  unsigned int head = m_head.load(std::memory_order_relaxed);
 
-  for (;;)
+  // wait for a packet, spinning a little before sleeping
+  for (int spin = 0; m_tail.load(std::memory_order_acquire) == head; spin++)
   {
     // check quit flag
     if (quit)
     {
-      ret = -1;
-      break;
+      return -1;
     }
-
-    // point to the first AVPacketList in the queue
-    avPacketList = first_pkt;
-
-    // if the first packet is not NULL, the queue is not empty
-    if (avPacketList)
+    if (!block)
     {
-      // place the second packet in the queue at first position
-      first_pkt = avPacketList->next;
-
-      // check if queue is empty after removal
-      if (!first_pkt)
-      {
-        // first_pkt = last_pkt = NULL = empty queue
-        last_pkt = NULL;
-      }
-
-      // decrease the number of packets in the queue
-      nb_packets--;
-
-      // decrease the size of the packets in the queue
-      size -= avPacketList->pkt.size;
-
-      // point pkt to the extracted packet, this will return to the calling function
-      *pkt = avPacketList->pkt;
-
-      // free memory
-      av_free(avPacketList);
-
-      ret = 1;
-      break;
+      return 0;
     }
-    else if (!block)
+    if (spin < PACKET_QUEUE_SPIN_COUNT)
     {
-      ret = 0;
-      break;
+      continue;
     }
-    else
+
+    // unlock mutex and wait for cond signal, then lock mutex again
+    SDL_LockMutex(mutex);
+    m_consumerWaiting.store(1, std::memory_order_seq_cst);
+    while (m_tail.load(std::memory_order_seq_cst) == head && !quit)
     {
-      // unlock mutex and wait for cond signal, then lock mutex again
       SDL_CondWait(cond, mutex);
     }
+    m_consumerWaiting.store(0, std::memory_order_relaxed);
+    SDL_UnlockMutex(mutex);
+  }
+
+  if (quit)
+  {
+    return -1;
+  }
+
+  // point pkt to the extracted packet, this will return to the calling function
+  AVPacket *slot = m_slots[head & m_mask];
+  int packetSize = slot->size;
+  av_packet_move_ref(pkt, slot);
+
+  // decrease the number of packets and the size of the queue
+  nb_packets--;
+  size -= packetSize;
+  duration -= m_durations[head & m_mask];
+
+  // release the slot; seq_cst pairs with the producer's waiting flag
+  m_head.store(head + 1, std::memory_order_seq_cst);
+
+  if (m_producerWaiting.load(std::memory_order_seq_cst))
+  {
+    SDL_LockMutex(mutex);
+    SDL_CondSignal(m_notFullCond);
+    SDL_UnlockMutex(mutex);
   }
 
-  // unlock mutex
-  SDL_UnlockMutex(mutex);
+  // the reader may be waiting for the session to get back under budget
+  if (m_budget)
+  {
+    m_budget->notify();
+  }
 
-  return ret;
+  return 1;
 }
 
 void PacketQueue::clear()
 {
-  while (nb_packets > 0)
+  if (!m_slots)
   {
-    MyAVPacketList *avPacketList;
-    // point to the first AVPacketList in the queue
-    avPacketList = first_pkt;
+    return;
+  }
 
-    // if the first packet is not NULL, the queue is not empty
-    if (avPacketList)
-    {
-      // place the second packet in the queue at first position
-      first_pkt = avPacketList->next;
+  unsigned int head = m_head.load(std::memory_order_relaxed);
+  unsigned int tail = m_tail.load(std::memory_order_acquire);
+  while (head != tail)
+  {
+    AVPacket *slot = m_slots[head & m_mask];
 
-      // check if queue is empty after removal
-      if (!first_pkt)
-      {
-        // first_pkt = last_pkt = NULL = empty queue
-        last_pkt = NULL;
-      }
+    // decrease the number of packets and the size of the queue
+    nb_packets--;
+    size -= slot->size;
+    duration -= m_durations[head & m_mask];
 
-      // decrease the number of packets in the queue
-      nb_packets--;
+    // free packet memory
+    av_packet_unref(slot);
+    head++;
+  }
+  m_head.store(head, std::memory_order_seq_cst);
 
-      // decrease the size of the packets in the queue
-      size -= avPacketList->pkt.size;
+  if (m_budget)
+  {
+    m_budget->notify();
+  }
+}
 
-      // free packet memory
-      av_packet_unref(&avPacketList->pkt);
+void PacketQueue::flush()
+{
+  // drops everything queued so far; must be called from the consumer side
+  this->clear();
 
-      // free memory
-      av_free(avPacketList);
-    }
+  if (m_producerWaiting.load(std::memory_order_seq_cst))
+  {
+    SDL_LockMutex(mutex);
+    SDL_CondSignal(m_notFullCond);
+    SDL_UnlockMutex(mutex);
   }
 }
 
-void PacketQueue::flush()
+void PacketQueue::abort()
 {
-  MyAVPacketList *pkt = nullptr, *pkt1 = nullptr;
-  SDL_LockMutex(mutex);
+  // wake up both sides, put() and get() return -1 from now on
+  quit = 1;
+  if (mutex)
+  {
+    SDL_LockMutex(mutex);
+    SDL_CondBroadcast(cond);
+    SDL_CondBroadcast(m_notFullCond);
+    SDL_UnlockMutex(mutex);
+  }
+}
 
-  for (pkt = first_pkt; pkt != nullptr; pkt = pkt1)
+int64_t PacketQueue::packetDuration(const AVPacket *packet)
+{
+  // called by the producer only; live streams often leave the duration unset,
+  // fall back to the distance to the previous packet
+  int64_t packetDuration = packet->duration;
+  if (packetDuration <= 0 && packet->dts != AV_NOPTS_VALUE && m_lastDts != AV_NOPTS_VALUE && packet->dts > m_lastDts)
+  {
+    packetDuration = packet->dts - m_lastDts;
+  }
+  if (packet->dts != AV_NOPTS_VALUE)
   {
-    pkt1 = pkt->next;
-    av_packet_unref(&pkt->pkt);
-    av_freep(&pkt);
+    m_lastDts = packet->dts;
   }
+  if (packetDuration <= 0)
+  {
+    return 0;
+  }
+  return av_rescale_q(packetDuration, m_timeBase, AVRational{1, AV_TIME_BASE});
+}
 
-  last_pkt = nullptr;
-  first_pkt = nullptr;
-  nb_packets = 0;
-  size = 0;
+void PacketQueue::release()
+{
+  this->clear();
+
+  if (m_slots)
+  {
+    for (unsigned int i = 0; i < m_capacity; i++)
+    {
+      av_packet_free(&m_slots[i]);
+    }
+    av_freep(&m_slots);
+  }
+  av_freep(&m_durations);
+  m_capacity = 0;
+  m_mask = 0;
+  m_head = 0;
+  m_tail = 0;
 
-  SDL_UnlockMutex(mutex);
+  if (m_notFullCond)
+  {
+    SDL_DestroyCond(m_notFullCond);
+    m_notFullCond = nullptr;
+  }
+  if (cond)
+  {
+    SDL_DestroyCond(cond);
+    cond = nullptr;
+  }
+  if (mutex)
+  {
+    SDL_DestroyMutex(mutex);
+    mutex = nullptr;
+  }
 }
@@ -9,29 +9,71 @@ extern "C"
 #include <libavformat/avformat.h>
 }
 
-#include "myavpacketlist.h"
+#include <atomic>
+#include "queuebudget.h"
+#include "executor.h"
 
+#define PACKET_QUEUE_CAPACITY 1024
+
+// Bounded single-producer/single-consumer ring of AVPacket*.
+// put() is only called by the reader and get() only by one decoder.
+// Both sides are lock-free while the ring is neither empty nor full,
+// the mutex/cond pair is only used to sleep on those two edges.
+// A consumer running as a task gets its packets with get(pkt, 0) and is notified by put(),
+// a producer running as a task checks full() and uses tryPut() so that it never waits.
 class PacketQueue
 {
 public:
   explicit PacketQueue();
   ~PacketQueue();
 
-  void init();
+  void init(int capacity = PACKET_QUEUE_CAPACITY);
   int put(AVPacket *packet);
+  int tryPut(AVPacket *packet);
+  bool full(unsigned int slots) const;
   int get(AVPacket *pkt, int block);
   void clear();
   void flush();
+  void abort();
+  void setTimeBase(AVRational time_base) { m_timeBase = time_base; }
+  void setBudget(QueueBudget *budget) { m_budget = budget; }
+  void setConsumer(SerialTask *task) { m_consumer = task; }
 
-  int size;
-  int nb_packets;
-  int quit;
+  // shared counters, kept off the producer/consumer cache lines
+  alignas(64) std::atomic<int> size;
+  std::atomic<int> nb_packets;
+  // media duration queued, AV_TIME_BASE units
+  std::atomic<int64_t> duration;
+  std::atomic<int> quit;
   SDL_cond *cond;
 
+  // packets queued, refused by tryPut() on a full ring, and times the producer waited for a slot
+  std::atomic<uint64_t> put_count;
+  std::atomic<uint64_t> drop_count;
+  std::atomic<uint64_t> full_count;
+
 private:
-  MyAVPacketList* first_pkt;
-  MyAVPacketList* last_pkt;
+  AVPacket** m_slots;
+  int64_t* m_durations;
+  unsigned int m_capacity;
+  unsigned int m_mask;
   SDL_mutex *mutex;
+  SDL_cond *m_notFullCond;
+  std::atomic<int> m_consumerWaiting;
+  std::atomic<int> m_producerWaiting;
+  AVRational m_timeBase;
+  QueueBudget *m_budget;
+  SerialTask *m_consumer;
+  int64_t m_lastDts;
+
+  // read index, written by the consumer only
+  alignas(64) std::atomic<unsigned int> m_head;
+  // write index, written by the producer only
+  alignas(64) std::atomic<unsigned int> m_tail;
+
+  void release();
+  void push(unsigned int tail, AVPacket *packet);
+  int64_t packetDuration(const AVPacket *packet);
 };
 
 #endif // PACKET_QUEUE_H_
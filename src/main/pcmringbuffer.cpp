@@ -0,0 +1,132 @@
+
+#include <algorithm>
+#include <cstring>
+#include "pcmringbuffer.h"
+
+PcmRingBuffer::PcmRingBuffer()
+  : m_buffer(nullptr)
+  , m_capacity(0)
+  , m_mask(0)
+  , m_writer(nullptr)
+  , m_writerWaiting(0)
+  , m_writePos(0)
+  , m_readPos(0)
+{
+}
+
+PcmRingBuffer::~PcmRingBuffer()
+{
+  if (m_buffer)
+  {
+    delete[] m_buffer;
+    m_buffer = nullptr;
+  }
+}
+
+int PcmRingBuffer::init(size_t capacity)
+{
+  // round up to a power of two so positions can be masked instead of divided
+  size_t size = 1;
+  while (size < capacity)
+  {
+    size <<= 1;
+  }
+
+  if (m_buffer)
+  {
+    delete[] m_buffer;
+  }
+  m_buffer = new uint8_t[size];
+  m_capacity = size;
+  m_mask = size - 1;
+  m_writePos.store(0);
+  m_readPos.store(0);
+  m_writerWaiting.store(0);
+  return 0;
+}
+
+size_t PcmRingBuffer::write(const uint8_t* data, size_t len)
+{
+  size_t writePos = m_writePos.load(std::memory_order_relaxed);
+  size_t readPos = m_readPos.load(std::memory_order_acquire);
+
+  // clamp to the free space
+  len = std::min(len, m_capacity - (writePos - readPos));
+  if (len == 0)
+  {
+    return 0;
+  }
+
+  // copy in at most two chunks, the second one after wrapping around
+  size_t offset = writePos & m_mask;
+  size_t first = std::min(len, m_capacity - offset);
+  std::memcpy(m_buffer + offset, data, first);
+  std::memcpy(m_buffer, data + first, len - first);
+
+  // publish the new data to the reader
+  m_writePos.store(writePos + len, std::memory_order_release);
+  return len;
+}
+
+size_t PcmRingBuffer::read(uint8_t* data, size_t len)
+{
+  size_t readPos = m_readPos.load(std::memory_order_relaxed);
+  size_t writePos = m_writePos.load(std::memory_order_acquire);
+
+  // clamp to the available data
+  len = std::min(len, writePos - readPos);
+  if (len == 0)
+  {
+    return 0;
+  }
+
+  size_t offset = readPos & m_mask;
+  size_t first = std::min(len, m_capacity - offset);
+  std::memcpy(data, m_buffer + offset, first);
+  std::memcpy(data + first, m_buffer, len - first);
+
+  // release the space; seq_cst pairs with the writer's waiting flag
+  m_readPos.store(readPos + len, std::memory_order_seq_cst);
+
+  // only notify the writer when it is actually waiting for room
+  if (m_writerWaiting.load(std::memory_order_seq_cst))
+  {
+    this->wakeUp();
+  }
+  return len;
+}
+
+bool PcmRingBuffer::waitForSpace(size_t len)
+{
+  len = std::min(len, m_capacity);
+
+  // announce the writer, then check again so a read in between is not missed
+  m_writerWaiting.store(1, std::memory_order_seq_cst);
+  size_t used = m_writePos.load(std::memory_order_relaxed) - m_readPos.load(std::memory_order_seq_cst);
+  if (m_capacity - used >= len)
+  {
+    m_writerWaiting.store(0, std::memory_order_relaxed);
+    return true;
+  }
+
+  // the writer returns, the next read notifies it
+  return false;
+}
+
+void PcmRingBuffer::wakeUp()
+{
+  if (m_writerWaiting.exchange(0) && m_writer)
+  {
+    m_writer->notify();
+  }
+}
+
+size_t PcmRingBuffer::size() const
+{
+  return m_writePos.load(std::memory_order_acquire) - m_readPos.load(std::memory_order_acquire);
+}
+
+size_t PcmRingBuffer::space() const
+{
+  return m_capacity - this->size();
+}
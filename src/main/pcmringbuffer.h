@@ -0,0 +1,42 @@
+
+#ifndef PCM_RING_BUFFER_H_
+#define PCM_RING_BUFFER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "executor.h"
+
+// Single-producer/single-consumer lock-free byte ring for decoded PCM.
+// The audio decoder task writes, the SDL audio callback reads.
+// Neither side blocks: a writer finding the ring full returns and the next read notifies it.
+class PcmRingBuffer
+{
+public:
+  explicit PcmRingBuffer();
+  ~PcmRingBuffer();
+
+  int init(size_t capacity);
+  size_t write(const uint8_t* data, size_t len);
+  size_t read(uint8_t* data, size_t len);
+  void setWriter(SerialTask *task) { m_writer = task; }
+  bool waitForSpace(size_t len);
+  void wakeUp();
+
+  size_t size() const;
+  size_t space() const;
+  size_t capacity() const { return m_capacity; }
+
+private:
+  uint8_t* m_buffer;
+  size_t m_capacity;
+  size_t m_mask;
+  SerialTask* m_writer;
+  std::atomic<int> m_writerWaiting;
+
+  // keep the producer and consumer positions on separate cache lines
+  alignas(64) std::atomic<size_t> m_writePos;
+  alignas(64) std::atomic<size_t> m_readPos;
+};
+
+#endif // PCM_RING_BUFFER_H_
@@ -0,0 +1,136 @@
+
+#include <algorithm>
+#include "preeventbuffer.h"
+
+std::atomic<int64_t> PreEventBuffer::s_totalBytes(0);
+std::atomic<int> PreEventBuffer::s_buffers(0);
+
+PreEventBuffer::PreEventBuffer()
+  : m_lastTime(0)
+  , m_bytes(0)
+  , m_maxDuration(0)
+  , m_maxBytes(0)
+  , m_maxTotalBytes(0)
+  , m_hasVideo(0)
+  , m_registered(0)
+{
+}
+
+PreEventBuffer::~PreEventBuffer()
+{
+  this->clear();
+  if (m_registered)
+  {
+    s_buffers--;
+    m_registered = 0;
+  }
+}
+
+void PreEventBuffer::init(int64_t duration, int64_t max_bytes, int64_t max_total_bytes, int has_video)
+{
+  m_maxDuration = duration;
+  m_maxBytes = max_bytes;
+  m_maxTotalBytes = max_total_bytes;
+  m_hasVideo = has_video;
+  if (!m_registered)
+  {
+    s_buffers++;
+    m_registered = 1;
+  }
+}
+
+void PreEventBuffer::add(const AVPacket *packet, AVRational time_base, int video)
+{
+  // a GOP starts at each video keyframe, at any packet without video
+  int gopStart = !m_hasVideo || (video && (packet->flags & AV_PKT_FLAG_KEY));
+  if (m_packets.empty() && !gopStart)
+  {
+    // the history must be decodable from its first packet
+    return;
+  }
+
+  AVPacket *ref = av_packet_clone(packet);
+  if (!ref)
+  {
+    return;
+  }
+
+  int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+  int64_t time = ts != AV_NOPTS_VALUE ? av_rescale_q(ts, time_base, AVRational{1, AV_TIME_BASE}) : m_lastTime;
+  if (gopStart)
+  {
+    m_gopTimes.push_back(time);
+  }
+  if (time > m_lastTime || m_packets.empty())
+  {
+    m_lastTime = time;
+  }
+  m_packets.push_back(Entry{ref, gopStart});
+  m_bytes += ref->size;
+  s_totalBytes += ref->size;
+
+  // keep the last seconds: the first GOP goes as soon as the next ones cover them
+  while (m_gopTimes.size() > 1 && m_lastTime - m_gopTimes[1] >= m_maxDuration)
+  {
+    this->evictGop();
+  }
+
+  // over its own budget, or above its share while every buffer together is over budget
+  while (!m_packets.empty() &&
+         (m_bytes > m_maxBytes ||
+          (s_totalBytes > m_maxTotalBytes && m_bytes > m_maxTotalBytes / std::max(1, s_buffers.load()))))
+  {
+    this->evictGop();
+  }
+}
+
+std::deque<AVPacket*> PreEventBuffer::take()
+{
+  // the caller owns the packets from now on
+  std::deque<AVPacket*> packets;
+  for (Entry& entry : m_packets)
+  {
+    packets.push_back(entry.packet);
+  }
+  m_packets.clear();
+  m_gopTimes.clear();
+  s_totalBytes -= m_bytes;
+  m_bytes = 0;
+
+  return packets;
+}
+
+void PreEventBuffer::clear()
+{
+  for (Entry& entry : m_packets)
+  {
+    av_packet_free(&entry.packet);
+  }
+  m_packets.clear();
+  m_gopTimes.clear();
+  s_totalBytes -= m_bytes;
+  m_bytes = 0;
+}
+
+int64_t PreEventBuffer::duration() const
+{
+  return m_gopTimes.empty() ? 0 : m_lastTime - m_gopTimes.front();
+}
+
+void PreEventBuffer::evictGop()
+{
+  // drop the first GOP, up to the next keyframe
+  if (!m_gopTimes.empty())
+  {
+    m_gopTimes.pop_front();
+  }
+  do
+  {
+    Entry entry = m_packets.front();
+    m_packets.pop_front();
+    m_bytes -= entry.packet->size;
+    s_totalBytes -= entry.packet->size;
+    av_packet_free(&entry.packet);
+  }
+  while (!m_packets.empty() && !m_packets.front().gopStart);
+}
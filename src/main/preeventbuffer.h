@@ -0,0 +1,56 @@
+
+#ifndef PRE_EVENT_BUFFER_H_
+#define PRE_EVENT_BUFFER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+// The last seconds of compressed packets of one session, kept for event recording.
+// Packets are held by reference, the buffer always starts at a video keyframe and
+// whole GOPs are evicted from the front when it gets too long, too big, or when
+// the buffers of every session together go over the global budget.
+// Only the read task touches a buffer; the global byte count is shared.
+class PreEventBuffer
+{
+public:
+  explicit PreEventBuffer();
+  ~PreEventBuffer();
+
+  void init(int64_t duration, int64_t max_bytes, int64_t max_total_bytes, int has_video);
+  void add(const AVPacket *packet, AVRational time_base, int video);
+  std::deque<AVPacket*> take();
+  void clear();
+  int64_t duration() const;
+
+private:
+  struct Entry
+  {
+    AVPacket *packet;
+    int gopStart;
+  };
+
+  std::deque<Entry> m_packets;
+  // start time of every GOP in the buffer, AV_TIME_BASE units
+  std::deque<int64_t> m_gopTimes;
+  int64_t m_lastTime;
+  int64_t m_bytes;
+  int64_t m_maxDuration;
+  int64_t m_maxBytes;
+  int64_t m_maxTotalBytes;
+  int m_hasVideo;
+  int m_registered;
+
+  // every session together
+  static std::atomic<int64_t> s_totalBytes;
+  static std::atomic<int> s_buffers;
+
+  void evictGop();
+};
+
+#endif // PRE_EVENT_BUFFER_H_
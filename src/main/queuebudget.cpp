@@ -0,0 +1,65 @@
+
+#include "queuebudget.h"
+
+QueueBudget::QueueBudget()
+  : m_maxBytes(QUEUE_BUDGET_MAX_BYTES)
+  , m_maxDuration(0)
+  , m_waiter(nullptr)
+  , m_waiting(0)
+{
+}
+
+QueueBudget::~QueueBudget()
+{
+}
+
+void QueueBudget::init(int64_t max_bytes, int64_t max_duration)
+{
+  m_maxBytes = max_bytes;
+  m_maxDuration = max_duration;
+}
+
+bool QueueBudget::exceeded(int64_t bytes, int64_t duration) const
+{
+  if (bytes > m_maxBytes)
+  {
+    return true;
+  }
+  return m_maxDuration > 0 && duration > m_maxDuration;
+}
+
+bool QueueBudget::wait(const std::function<bool()>& ready)
+{
+  if (ready())
+  {
+    return true;
+  }
+
+  // announce the waiter before checking again; seq_cst pairs with notify()
+  m_waiting.store(1, std::memory_order_seq_cst);
+  if (ready())
+  {
+    m_waiting.store(0, std::memory_order_relaxed);
+    return true;
+  }
+
+  // the waiter returns, notify() runs it again with the next change
+  return false;
+}
+
+void QueueBudget::notify()
+{
+  // the queue counters were updated before this, nothing to do if nobody is parked
+  if (m_waiting.load(std::memory_order_seq_cst))
+  {
+    this->wakeUp();
+  }
+}
+
+void QueueBudget::wakeUp()
+{
+  if (m_waiting.exchange(0) && m_waiter)
+  {
+    m_waiter->notify();
+  }
+}
@@ -0,0 +1,38 @@
+
+#ifndef QUEUE_BUDGET_H_
+#define QUEUE_BUDGET_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include "executor.h"
+
+// default limit of the packets buffered between the reader and the decoders
+#define QUEUE_BUDGET_MAX_BYTES (15 * 1024 * 1024)
+
+// Byte and duration budget of the packet queues of one session.
+// The reader task parks in wait() until the decoders free enough room, the decoders
+// call notify() after every get, which costs one atomic load unless the reader
+// is actually parked; it is then notified to run again.
+class QueueBudget
+{
+public:
+  explicit QueueBudget();
+  ~QueueBudget();
+
+  void init(int64_t max_bytes, int64_t max_duration);
+  bool exceeded(int64_t bytes, int64_t duration) const;
+  void setWaiter(SerialTask *task) { m_waiter = task; }
+  bool wait(const std::function<bool()>& ready);
+  void notify();
+  void wakeUp();
+
+private:
+  int64_t m_maxBytes;
+  // AV_TIME_BASE units, 0 for no limit
+  int64_t m_maxDuration;
+  SerialTask* m_waiter;
+  std::atomic<int> m_waiting;
+};
+
+#endif // QUEUE_BUDGET_H_
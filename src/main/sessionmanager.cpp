@@ -0,0 +1,577 @@
+
+#include <iostream>
+#include "sessionmanager.h"
+#include "tracer.h"
+
+SessionManager::SessionManager()
+  : m_activeSessions(0)
+  , m_nextId(0)
+  , m_initialized(0)
+  , m_metricsTime(0)
+{
+}
+
+SessionManager::~SessionManager()
+{
+  this->stopAll();
+  m_mosaic.reset();
+
+  // every session is stopped, this only joins idle threads
+  if (m_executor.workers() > 0)
+  {
+    std::wcout << "executor : " << m_executor.workers() << " workers"
+               << ", " << m_executor.blockingThreads() << " blocking threads"
+               << ", busy peak " << m_executor.blockingThreadsPeak()
+               << std::endl;
+  }
+  m_executor.stop();
+
+  if (m_initialized)
+  {
+    SDL_Quit();
+    m_initialized = 0;
+  }
+}
+
+int SessionManager::init(const Options& opt)
+{
+  m_options = opt;
+
+  // process wide, shared by every session
+  Uint32 flags = SDL_INIT_TIMER | SDL_INIT_EVENTS;
+  if (!opt.headless)
+  {
+    // video and audio are only needed when not headless
+    flags |= SDL_INIT_VIDEO | SDL_INIT_AUDIO;
+  }
+  if (SDL_Init(flags) != 0)
+  {
+    std::cerr << "Could not initialize SDL" << SDL_GetError() << std::endl;
+    return -1;
+  }
+  m_initialized = 1;
+
+  // one worker per core, or per core of the budget; a blocking thread per reader and per
+  // recorder so that a read stuck on the network never holds up another stream, fixed from now on
+  int blockingThreads = (int)opt.urls.size() * (opt.recordPath.empty() ? 1 : 2) + opt.ioThreads;
+  if (m_executor.start(opt.threadBudget > 0 ? opt.threadBudget : SDL_GetCPUCount(), blockingThreads) < 0)
+  {
+    std::cerr << "Could not start the executor" << std::endl;
+    return -1;
+  }
+
+  // every session is drawn into one window instead of a window per session
+  if (opt.mosaic && !opt.headless)
+  {
+    m_mosaic = std::make_unique<MosaicRenderer>();
+    if (m_mosaic->start(MOSAIC_DEFAULT_WIDTH, MOSAIC_DEFAULT_HEIGHT) < 0)
+    {
+      m_mosaic.reset();
+      return -1;
+    }
+  }
+
+  // trace points are compiled in, recording starts now or with the 't' key
+  if (!opt.tracePath.empty())
+  {
+    Tracer::setPath(opt.tracePath);
+    Tracer::start();
+  }
+
+  return 0;
+}
+
+int SessionManager::addSession(const std::string& url)
+{
+  std::unique_ptr<Session> session = std::make_unique<Session>();
+  session->id = m_nextId++;
+
+  // Create VideoState
+  session->videoState = std::make_shared<VideoState>();
+  session->videoState->filename = url;
+  session->videoState->executor = &m_executor;
+  session->videoState->active_sessions = &m_activeSessions;
+  session->videoState->av_sync_type = (SYNC_TYPE)m_options.syncType;
+  session->videoState->keyframe_only = m_options.keyframeOnly;
+
+  // every camera records to its own files
+  if (!m_options.recordPath.empty())
+  {
+    session->videoState->record_path = m_options.urls.size() > 1
+      ? StreamRecorder::sessionPath(m_options.recordPath, session->id)
+      : m_options.recordPath;
+  }
+
+  // known before the decoders are opened, so that they can decode at a reduced resolution
+  if (m_mosaic)
+  {
+    int width = 0;
+    int height = 0;
+    m_mosaic->cellSize((int)m_options.urls.size(), &width, &height);
+    session->videoState->target_width = width;
+    session->videoState->target_height = height;
+  }
+
+  // only one session plays its audio, the others do not even decode it
+  session->videoState->audio_disabled = !m_options.headless && session->id != m_options.audioSession;
+
+  // Create VideoReader
+  session->videoReader = std::make_unique<VideoReader>();
+  if (session->videoReader->start(session->videoState.get(), m_options) < 0)
+  {
+    std::cerr << "Could not start session " << session->id << std::endl;
+    return -1;
+  }
+  if (m_mosaic)
+  {
+    m_mosaic->addSession(session->videoState.get());
+  }
+
+  this->addMetrics(session.get());
+
+  m_sessions.push_back(std::move(session));
+  return m_sessions.back()->id;
+}
+
+int SessionManager::stopSession(int id)
+{
+  for (auto it = m_sessions.begin(); it != m_sessions.end(); ++it)
+  {
+    if ((*it)->id == id)
+    {
+      // waits for the session tasks unless reapSessions() saw them stopped, the other sessions keep running
+      if (m_mosaic)
+      {
+        m_mosaic->removeSession((*it)->videoState.get());
+      }
+      (*it)->videoReader->stop();
+      this->report(it->get());
+
+      // the last values of the session make it to the file before its series go
+      this->writeMetrics(true);
+      m_metrics.remove("session=\"" + std::to_string(id) + "\"");
+      m_sessions.erase(it);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int SessionManager::triggerEvent(int id)
+{
+  for (auto& session : m_sessions)
+  {
+    if (session->id == id || id < 0)
+    {
+      session->videoReader->triggerEvent();
+      if (id >= 0)
+      {
+        return 0;
+      }
+    }
+  }
+  return id < 0 ? 0 : -1;
+}
+
+int SessionManager::setKeyframeOnly(int id, int keyframeOnly)
+{
+  for (auto& session : m_sessions)
+  {
+    if (session->id == id)
+    {
+      // no reconnection, the reader and the decoder pick it up with the next packet
+      session->videoState->keyframe_only = keyframeOnly;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void SessionManager::abortAll()
+{
+  // every session winds down in parallel on the executor, reapSessions() removes them once stopped
+  for (auto& session : m_sessions)
+  {
+    session->videoReader->stopAsync();
+  }
+}
+
+void SessionManager::stopAll()
+{
+  // abort everything first so that the sessions wind down in parallel
+  this->abortAll();
+  while (!m_sessions.empty())
+  {
+    this->stopSession(m_sessions.front()->id);
+  }
+
+  // whatever was traced until the end
+  Tracer::stop();
+}
+
+int SessionManager::run()
+{
+  SDL_Event event;
+
+  // the one event loop of the process, it ends with the last session
+  while (!m_sessions.empty())
+  {
+    if (SDL_WaitEventTimeout(&event, 100))
+    {
+      this->handleEvent(event);
+    }
+    this->reapSessions();
+
+    // empty the trace buffers of the threads before they overflow
+    Tracer::collect();
+    this->writeMetrics(false);
+  }
+
+  return 0;
+}
+
+Session* SessionManager::findSession(const VideoState* videoState)
+{
+  for (auto& session : m_sessions)
+  {
+    if (session->videoState.get() == videoState)
+    {
+      return session.get();
+    }
+  }
+  return nullptr;
+}
+
+Session* SessionManager::findSessionByWindow(Uint32 windowID)
+{
+  for (auto& session : m_sessions)
+  {
+    VideoRenderer* videoRenderer = session->videoReader->renderer();
+    if (videoRenderer && videoRenderer->windowID() == windowID)
+    {
+      return session.get();
+    }
+  }
+  return nullptr;
+}
+
+void SessionManager::handleEvent(const SDL_Event& event)
+{
+  Session* session = nullptr;
+
+  switch (event.type)
+  {
+  case FF_REFRESH_EVENT:
+  {
+    // the refresh timer of a session that is already gone is dropped here
+    session = this->findSession((const VideoState*)event.user.data1);
+  }
+  break;
+
+  case FF_MOSAIC_REFRESH_EVENT:
+  {
+    if (m_mosaic)
+    {
+      m_mosaic->refresh();
+    }
+    return;
+  }
+  break;
+
+  case SDL_KEYDOWN:
+  {
+    session = this->findSessionByWindow(event.key.windowID);
+    if (event.key.keysym.sym == SDLK_r)
+    {
+      // record the event of that camera, of every camera from the mosaic
+      this->triggerEvent(session ? session->id : -1);
+      return;
+    }
+    if (event.key.keysym.sym == SDLK_t)
+    {
+      // a trace file per capture, written when tracing is switched off
+      if (Tracer::enabled())
+      {
+        Tracer::stop();
+      }
+      else
+      {
+        Tracer::start();
+      }
+      return;
+    }
+    if (event.key.keysym.sym == SDLK_k && session)
+    {
+      this->setKeyframeOnly(session->id, !session->videoState->keyframe_only);
+      return;
+    }
+  }
+  break;
+
+  case SDL_MOUSEBUTTONDOWN:
+  {
+    if (m_mosaic && event.button.windowID == m_mosaic->windowID())
+    {
+      // the enlarged tile is fully decoded, the grid only shows keyframes
+      VideoState *focus = m_mosaic->toggleFocus(event.button.x, event.button.y);
+      if (m_options.keyframeOnly)
+      {
+        for (auto& other : m_sessions)
+        {
+          this->setKeyframeOnly(other->id, other->videoState.get() != focus);
+        }
+      }
+    }
+    return;
+  }
+  break;
+
+  case SDL_WINDOWEVENT:
+  {
+    if (m_mosaic && event.window.windowID == m_mosaic->windowID())
+    {
+      // the mosaic holds every session
+      if (event.window.event == SDL_WINDOWEVENT_CLOSE)
+      {
+        this->abortAll();
+      }
+      else
+      {
+        m_mosaic->invalidate();
+      }
+      return;
+    }
+
+    // closing one window only stops that camera
+    if (event.window.event == SDL_WINDOWEVENT_CLOSE)
+    {
+      session = this->findSessionByWindow(event.window.windowID);
+      if (session)
+      {
+        session->videoState->abort();
+      }
+    }
+    return;
+  }
+  break;
+
+  case FF_QUIT_EVENT:
+  case SDL_QUIT:
+  {
+    // the event loop ends once reapSessions() removed the last session
+    this->abortAll();
+    return;
+  }
+  break;
+
+  default:
+  {
+    // nothing
+  }
+  break;
+  }
+
+  if (session)
+  {
+    VideoRenderer* videoRenderer = session->videoReader->renderer();
+    if (videoRenderer)
+    {
+      videoRenderer->handleEvent(event);
+    }
+  }
+}
+
+void SessionManager::reapSessions()
+{
+  for (size_t i = 0; i < m_sessions.size();)
+  {
+    if (m_sessions[i]->videoState->quit)
+    {
+      // the tasks wind down on the executor, the event loop keeps running meanwhile
+      m_sessions[i]->videoReader->stopAsync();
+      if (m_sessions[i]->videoReader->stopped())
+      {
+        // erases m_sessions[i]
+        this->stopSession(m_sessions[i]->id);
+        continue;
+      }
+    }
+    i++;
+  }
+}
+
+void SessionManager::addMetrics(Session* session)
+{
+  if (m_options.metricsFile.empty())
+  {
+    return;
+  }
+
+  // the values stay in the session, the registry reads them when exporting
+  VideoState* videoState = session->videoState.get();
+  std::string labels = "session=\"" + std::to_string(session->id) + "\"";
+  std::string video = labels + ",stream=\"video\"";
+  std::string audio = labels + ",stream=\"audio\"";
+
+  m_metrics.addCounter("rtsp_packets_total", "Packets queued for decoding.", video,
+    [videoState]() { return (double)videoState->videoq.put_count; });
+  m_metrics.addCounter("rtsp_packets_total", "Packets queued for decoding.", audio,
+    [videoState]() { return (double)videoState->audioq.put_count; });
+  m_metrics.addCounter("rtsp_queue_full_total", "Times the reader waited for a full packet queue.", video,
+    [videoState]() { return (double)videoState->videoq.full_count; });
+  m_metrics.addCounter("rtsp_queue_full_total", "Times the reader waited for a full packet queue.", audio,
+    [videoState]() { return (double)videoState->audioq.full_count; });
+  m_metrics.addCounter("rtsp_queue_drops_total", "Packets refused by a full packet queue.", video,
+    [videoState]() { return (double)videoState->videoq.drop_count; });
+  m_metrics.addCounter("rtsp_queue_drops_total", "Packets refused by a full packet queue.", audio,
+    [videoState]() { return (double)videoState->audioq.drop_count; });
+  m_metrics.addGauge("rtsp_queue_packets", "Packets waiting for the decoder.", video,
+    [videoState]() { return (double)videoState->videoq.nb_packets; });
+  m_metrics.addGauge("rtsp_queue_packets", "Packets waiting for the decoder.", audio,
+    [videoState]() { return (double)videoState->audioq.nb_packets; });
+  m_metrics.addGauge("rtsp_queue_bytes", "Bytes waiting for the decoder.", video,
+    [videoState]() { return (double)videoState->videoq.size; });
+  m_metrics.addGauge("rtsp_queue_bytes", "Bytes waiting for the decoder.", audio,
+    [videoState]() { return (double)videoState->audioq.size; });
+  m_metrics.addCounter("rtsp_frames_decoded_total", "Frames out of the decoder.", video,
+    [videoState]() { return (double)videoState->video_frames_decoded; });
+  m_metrics.addCounter("rtsp_frames_decoded_total", "Frames out of the decoder.", audio,
+    [videoState]() { return (double)videoState->audio_frames_decoded; });
+  m_metrics.addCounter("rtsp_decode_errors_total", "Packets or frames the decoder failed on.", video,
+    [videoState]() { return (double)videoState->video_decode_errors; });
+  m_metrics.addCounter("rtsp_decode_errors_total", "Packets or frames the decoder failed on.", audio,
+    [videoState]() { return (double)videoState->audio_decode_errors; });
+
+  m_metrics.addCounter("rtsp_late_pictures_dropped_total", "Pictures dropped behind the master clock.", labels,
+    [videoState]() { return (double)(videoState->decoder_drop_count + videoState->renderer_drop_count); });
+  m_metrics.addCounter("rtsp_backlog_drops_total", "Live mode backlogs dropped over the latency cap.", labels,
+    [videoState]() { return (double)videoState->live_flush_count; });
+  m_metrics.addCounter("rtsp_record_drops_total", "Packets the recorder could not keep up with.", labels,
+    [videoState]() { return (double)videoState->record_drops; });
+  m_metrics.addCounter("rtsp_reconnects_total", "Reconnections after the input was lost.", labels,
+    [videoState]() { return (double)videoState->reconnect_count; });
+  m_metrics.addGauge("rtsp_picture_queue_pictures", "Decoded pictures waiting for display.", labels,
+    [videoState]() { return (double)videoState->pictq_size; });
+  m_metrics.addCounter("rtsp_decoder_stalls_total", "Times the decoder waited for a full picture queue.", labels,
+    [videoState]() { return (double)videoState->pictq_full_count; });
+  m_metrics.addCounter("rtsp_renderer_underruns_total", "Times the renderer found the picture queue empty.", labels,
+    [videoState]() { return (double)videoState->pictq_empty_count; });
+  m_metrics.addCounter("rtsp_frames_rendered_total", "Pictures displayed, its rate is the rendered fps.", labels,
+    [videoState]() { return (double)videoState->frames_rendered; });
+  m_metrics.addHistogram("rtsp_frame_interval_seconds", "Time between two displayed pictures.", labels,
+    &videoState->frame_interval_hist);
+  m_metrics.addHistogram("rtsp_capture_to_display_seconds", "Age of a picture when displayed, from the camera wall clock (rtcp).", labels,
+    &videoState->capture_latency_hist);
+  m_metrics.addHistogram("rtsp_decode_latency_seconds", "Time from sending a packet to receiving its picture.", labels,
+    &videoState->decode_latency_hist);
+  if (videoState->live)
+  {
+    m_metrics.addGauge("rtsp_live_latency_seconds", "Media received but not yet presented.", labels,
+      [videoState]() { return videoState->live_latency / (double)AV_TIME_BASE; });
+  }
+}
+
+void SessionManager::writeMetrics(bool force)
+{
+  if (m_options.metricsFile.empty())
+  {
+    return;
+  }
+
+  int64_t now = av_gettime_relative();
+  if (!force && now - m_metricsTime < (int64_t)m_options.metricsIntervalSec * 1000000)
+  {
+    return;
+  }
+  m_metricsTime = now;
+  m_metrics.writeFile(m_options.metricsFile);
+}
+
+void SessionManager::report(Session* session)
+{
+  VideoState* videoState = session->videoState.get();
+
+  // Picture queue occupancy
+  std::wcout << "session " << session->id
+             << " picture queue : depth " << videoState->pictq_capacity
+             << ", peak " << videoState->pictq_size_max
+             << ", decoder stalls " << videoState->pictq_full_count
+             << ", renderer underruns " << videoState->pictq_empty_count
+             << std::endl;
+
+  std::wcout << "session " << session->id
+             << " time to first frame : " << videoState->first_frame_time << " ms"
+             << std::endl;
+
+  // Input recovery
+  if (videoState->reconnect_count > 0)
+  {
+    std::wcout << "session " << session->id
+               << " reconnects : " << videoState->reconnect_count
+               << ", last recovery " << videoState->recovery_time_last << " ms"
+               << ", max recovery " << videoState->recovery_time_max << " ms"
+               << std::endl;
+  }
+
+  // Decoding delay, depends on the threading
+  if (videoState->decode_latency_count > 0)
+  {
+    std::wcout << "session " << session->id
+               << " decode latency : avg "
+               << videoState->decode_latency_sum / videoState->decode_latency_count / 1000.0 << " ms"
+               << ", max " << videoState->decode_latency_max / 1000.0 << " ms"
+               << std::endl;
+  }
+
+  // Glass to glass latency, only with a camera wall clock
+  if (videoState->capture_latency_hist.count > 0)
+  {
+    std::wcout << "session " << session->id
+               << " capture to display : avg "
+               << videoState->capture_latency_hist.sum / (int64_t)videoState->capture_latency_hist.count / 1000.0 << " ms"
+               << ", last " << videoState->capture_latency_last / 1000.0 << " ms"
+               << std::endl;
+  }
+
+  // Pictures dropped for being late
+  std::wcout << "session " << session->id
+             << " late pictures : " << videoState->decoder_drop_count << " dropped before conversion"
+             << ", " << videoState->renderer_drop_count << " dropped before display"
+             << std::endl;
+
+  // Converted picture buffers
+  if (videoState->frame_pool.hits() + videoState->frame_pool.misses() > 0)
+  {
+    std::wcout << "session " << session->id
+               << " frame pool : " << videoState->frame_pool.hits() << " hits"
+               << ", " << videoState->frame_pool.misses() << " misses"
+               << ", " << videoState->frame_pool.residentBytes() / 1024 << " KB resident"
+               << std::endl;
+  }
+
+  // Recording
+  if (!videoState->record_path.empty())
+  {
+    std::wcout << "session " << session->id
+               << " recording : " << videoState->record_segments << " files"
+               << ", " << videoState->record_packets << " packets written"
+               << ", " << videoState->record_drops << " dropped"
+               << std::endl;
+  }
+
+  // Live latency control
+  if (videoState->live)
+  {
+    std::wcout << "session " << session->id
+               << " live latency : last " << videoState->live_latency / 1000 << " ms"
+               << ", backlog drops " << videoState->live_flush_count
+               << std::endl;
+  }
+
+  // Throughput report of the headless run
+  if (videoState->bench_stats)
+  {
+    videoState->bench_stats->setPictureQueuePeak(videoState->pictq_size_max);
+    videoState->bench_stats->report(std::wcout);
+  }
+}
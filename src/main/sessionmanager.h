@@ -0,0 +1,75 @@
+
+#ifndef SESSION_MANAGER_H_
+#define SESSION_MANAGER_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include "videostate.h"
+#include "videoreader.h"
+#include "mosaicrenderer.h"
+#include "streamrecorder.h"
+#include "metrics.h"
+#include "executor.h"
+#include "options.h"
+
+extern "C"
+{
+#include <SDL.h>
+}
+
+// One camera: its state and the reader owning its threads.
+struct Session
+{
+  int id = 0;
+  std::shared_ptr<VideoState> videoState;
+  std::unique_ptr<VideoReader> videoReader;
+};
+
+// Runs any number of independent sessions in one process.
+// SDL is initialised and shut down once here, the audio device is given to a
+// single session and the SDL event loop runs on the calling (main) thread.
+// Sessions are added, stopped and reaped from that thread only; a session stops on the
+// executor and is reaped once its tasks are over, the event loop never waits for it.
+// Their threads come from one executor: workers sized to the cores running the decoders,
+// sinks and conversions, and a fixed pool of blocking threads, one per reader and per
+// recorder, all joined when the manager goes.
+class SessionManager
+{
+public:
+  explicit SessionManager();
+  ~SessionManager();
+
+  int init(const Options& opt);
+  int addSession(const std::string& url);
+  int stopSession(int id);
+  int triggerEvent(int id);
+  int setKeyframeOnly(int id, int keyframeOnly);
+  void abortAll();
+  void stopAll();
+  int run();
+
+private:
+  Options m_options;
+  // outlives the sessions running on it
+  Executor m_executor;
+  // sessions sharing the thread budget, updated by their readers
+  std::atomic<int> m_activeSessions;
+  std::vector<std::unique_ptr<Session>> m_sessions;
+  std::unique_ptr<MosaicRenderer> m_mosaic;
+  int m_nextId;
+  int m_initialized;
+  MetricsRegistry m_metrics;
+  int64_t m_metricsTime;
+
+  Session* findSession(const VideoState* videoState);
+  Session* findSessionByWindow(Uint32 windowID);
+  void handleEvent(const SDL_Event& event);
+  void reapSessions();
+  void addMetrics(Session* session);
+  void writeMetrics(bool force);
+  void report(Session* session);
+};
+
+#endif // SESSION_MANAGER_H_
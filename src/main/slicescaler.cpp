@@ -0,0 +1,131 @@
+
+#include <algorithm>
+#include <iostream>
+#include "slicescaler.h"
+
+extern "C"
+{
+#include <libavutil/macros.h>
+}
+
+SliceScaler::SliceScaler()
+  : m_executor(nullptr)
+{
+}
+
+SliceScaler::~SliceScaler()
+{
+  this->stop();
+}
+
+int SliceScaler::init(int bands, Executor *executor)
+{
+  if (bands < 1 || !executor)
+  {
+    return -1;
+  }
+
+  m_executor = executor;
+  m_bands.resize(bands);
+  return 0;
+}
+
+void SliceScaler::stop()
+{
+  // scale() returns once its bands are done, nothing runs anymore
+  for (auto& band : m_bands)
+  {
+    sws_freeContext(band.ctx);
+    band.ctx = nullptr;
+  }
+  m_bands.clear();
+}
+
+int SliceScaler::scale(const AVFrame *src, AVFrame *dst, int flags)
+{
+  if (m_bands.empty())
+  {
+    return -1;
+  }
+
+  // no band is being converted, every band gets the same conversion
+  for (auto& band : m_bands)
+  {
+    band.ctx = sws_getCachedContext(
+      band.ctx
+      , src->width
+      , src->height
+      , (AVPixelFormat)src->format
+      , dst->width
+      , dst->height
+      , (AVPixelFormat)dst->format
+      , flags
+      , nullptr
+      , nullptr
+      , nullptr);
+    if (!band.ctx)
+    {
+      std::cerr << "Could not create the scaling context" << std::endl;
+      return -1;
+    }
+  }
+
+  // equal bands, their start aligned on what the filters of the context need
+  int count = (int)m_bands.size();
+  int align = sws_receive_slice_alignment(m_bands[0].ctx);
+  int height = FFALIGN((dst->height + count - 1) / count, align);
+  for (int i = 0; i < count; i++)
+  {
+    Band *band = &m_bands[i];
+    band->sliceStart = std::min(i * height, dst->height);
+    band->sliceHeight = std::min(height, dst->height - band->sliceStart);
+    band->ret = 0;
+  }
+
+  TaskGroup group;
+  for (int i = 1; i < count; i++)
+  {
+    Band *band = &m_bands[i];
+    m_executor->submit(group, [this, band, src, dst]()
+    {
+      band->ret = this->scaleSlice(band, src, dst);
+    });
+  }
+
+  int ret = this->scaleSlice(&m_bands[0], src, dst);
+
+  // wait for the other bands, converting some of them here if no worker took them yet
+  m_executor->wait(group);
+
+  for (auto& band : m_bands)
+  {
+    if (band.ret < 0)
+    {
+      ret = band.ret;
+    }
+  }
+
+  return ret;
+}
+
+int SliceScaler::scaleSlice(Band *band, const AVFrame *src, AVFrame *dst)
+{
+  if (band->sliceHeight <= 0)
+  {
+    return 0;
+  }
+
+  // the whole source goes in, only this band comes out
+  int ret = sws_frame_start(band->ctx, dst, src);
+  if (ret >= 0)
+  {
+    ret = sws_send_slice(band->ctx, 0, src->height);
+  }
+  if (ret >= 0)
+  {
+    ret = sws_receive_slice(band->ctx, band->sliceStart, band->sliceHeight);
+  }
+  sws_frame_end(band->ctx);
+
+  return ret;
+}
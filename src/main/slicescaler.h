@@ -0,0 +1,46 @@
+
+#ifndef SLICE_SCALER_H_
+#define SLICE_SCALER_H_
+
+#include <vector>
+#include "executor.h"
+
+extern "C"
+{
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+}
+
+// Colour conversion of one picture split into horizontal bands converted in parallel.
+// Every band has its own SwsContext, is given the whole source and only produces
+// its output rows (sws_receive_slice), so the vertical filters see the same
+// neighbours as a single sws_scale call and the output is bit-exact.
+// The calling thread converts the first band, the others are tasks of the executor
+// shared by every session.
+class SliceScaler
+{
+public:
+  explicit SliceScaler();
+  ~SliceScaler();
+
+  int init(int bands, Executor *executor);
+  void stop();
+  int scale(const AVFrame *src, AVFrame *dst, int flags);
+  int bands() const { return (int)m_bands.size(); }
+
+private:
+  struct Band
+  {
+    struct SwsContext *ctx = nullptr;
+    int sliceStart = 0;
+    int sliceHeight = 0;
+    int ret = 0;
+  };
+
+  std::vector<Band> m_bands;
+  Executor *m_executor;
+
+  int scaleSlice(Band *band, const AVFrame *src, AVFrame *dst);
+};
+
+#endif // SLICE_SCALER_H_
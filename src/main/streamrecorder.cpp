@@ -0,0 +1,496 @@
+
+#include <ctime>
+#include <iostream>
+#include "streamrecorder.h"
+
+StreamRecorder::StreamRecorder()
+  : m_videoState(nullptr)
+  , m_started(0)
+  , m_codecpar{nullptr, nullptr}
+  , m_timeBases{AVRational{1, AV_TIME_BASE}, AVRational{1, AV_TIME_BASE}}
+  , m_nbStreams(0)
+  , m_videoIndex(-1)
+  , m_audioIndex(-1)
+  , m_packet(nullptr)
+  , m_splitPacket(nullptr)
+  , m_historyPacket(nullptr)
+  , m_waitKeyframe(1)
+  , m_splitPending(0)
+  , m_ioPacket(nullptr)
+  , m_outCtx(nullptr)
+  , m_headerWritten(0)
+  , m_segmentStart(0)
+  , m_segmentDuration(0)
+  , m_segmentBytes(0)
+  , m_segmentIndex(0)
+{
+}
+
+StreamRecorder::~StreamRecorder()
+{
+  this->stop();
+
+  for (int i = 0; i < 2; i++)
+  {
+    avcodec_parameters_free(&m_codecpar[i]);
+  }
+  av_packet_free(&m_packet);
+  av_packet_free(&m_splitPacket);
+  av_packet_free(&m_historyPacket);
+  av_packet_free(&m_ioPacket);
+  for (AVPacket *packet : m_history)
+  {
+    av_packet_free(&packet);
+  }
+  m_history.clear();
+  m_videoState = nullptr;
+}
+
+int StreamRecorder::start(VideoState *videoState, const Options& opt)
+{
+  m_videoState = videoState;
+  if (!m_videoState)
+  {
+    return -1;
+  }
+
+  m_segmentDuration = (int64_t)opt.recordSegmentSec * AV_TIME_BASE;
+  m_segmentBytes = (int64_t)opt.recordSegmentMb * 1024 * 1024;
+
+  // the streams the session decodes are the ones recorded
+  const AVStream *streams[2] = {videoState->video_st, videoState->audio_st};
+  for (const AVStream *stream : streams)
+  {
+    if (!stream)
+    {
+      continue;
+    }
+    m_codecpar[m_nbStreams] = avcodec_parameters_alloc();
+    if (!m_codecpar[m_nbStreams] || avcodec_parameters_copy(m_codecpar[m_nbStreams], stream->codecpar) < 0)
+    {
+      std::cerr << "Could not copy the stream parameters to record" << std::endl;
+      return -1;
+    }
+    m_timeBases[m_nbStreams] = stream->time_base;
+    if (stream == videoState->video_st)
+    {
+      m_videoIndex = m_nbStreams;
+    }
+    else
+    {
+      m_audioIndex = m_nbStreams;
+    }
+    m_nbStreams++;
+  }
+  if (m_nbStreams == 0)
+  {
+    return -1;
+  }
+
+  m_packet = av_packet_alloc();
+  m_splitPacket = av_packet_alloc();
+  m_historyPacket = av_packet_alloc();
+  m_ioPacket = av_packet_alloc();
+  if (!m_packet || !m_splitPacket || !m_historyPacket || !m_ioPacket)
+  {
+    return -1;
+  }
+
+  // markers going through the queue like the flush packet of the decoders
+  m_splitPacket->data = (uint8_t*)"SPLIT";
+  m_historyPacket->data = (uint8_t*)"HISTORY";
+
+  // run on the blocking threads by the packets coming in
+  m_queue.init();
+  m_task.start(videoState->executor, true, [this]()
+  {
+    this->writeTask();
+  });
+  m_queue.setConsumer(&m_task);
+  m_started = 1;
+
+  return 0;
+}
+
+void StreamRecorder::stop()
+{
+  if (!m_started)
+  {
+    return;
+  }
+  m_started = 0;
+
+  // the reader is gone, what the task did not write yet is written here
+  m_task.stop();
+  this->writePackets(0);
+  this->closeSegment();
+}
+
+void StreamRecorder::stopAsync(std::function<void()> done)
+{
+  if (!m_started)
+  {
+    done();
+    return;
+  }
+  m_started = 0;
+
+  // the rest of the queue and the trailer are written on a blocking thread after the last run,
+  // the caller deletes the recorder once done is called
+  m_task.stopAsync([this, done]()
+  {
+    this->writePackets(0);
+    this->closeSegment();
+    done();
+  });
+}
+
+void StreamRecorder::write(const AVPacket *packet)
+{
+  int index = this->recordIndex(packet);
+  if (index < 0)
+  {
+    return;
+  }
+
+  // nothing is recorded ahead of the first keyframe, or after a drop
+  if (m_waitKeyframe && m_videoIndex >= 0 && !(index == m_videoIndex && (packet->flags & AV_PKT_FLAG_KEY)))
+  {
+    return;
+  }
+  m_waitKeyframe = 0;
+
+  if (m_splitPending)
+  {
+    if (m_queue.tryPut(m_splitPacket) < 0)
+    {
+      this->drop();
+      return;
+    }
+    m_splitPending = 0;
+  }
+
+  // the disk is behind, never make the reader wait for it
+  if (m_queue.size > STREAM_RECORDER_MAX_QUEUE_BYTES || av_packet_ref(m_packet, packet) < 0)
+  {
+    this->drop();
+    return;
+  }
+  m_packet->stream_index = index;
+  if (m_queue.tryPut(m_packet) < 0)
+  {
+    av_packet_unref(m_packet);
+    this->drop();
+  }
+}
+
+void StreamRecorder::writeHistory(std::deque<AVPacket*> packets)
+{
+  // the file being written ends first, without that the history is lost
+  if (m_splitPending && m_queue.tryPut(m_splitPacket) == 0)
+  {
+    m_splitPending = 0;
+  }
+
+  std::deque<AVPacket*> history;
+  for (AVPacket *packet : packets)
+  {
+    int index = this->recordIndex(packet);
+    if (index < 0 || m_splitPending)
+    {
+      av_packet_free(&packet);
+      continue;
+    }
+    packet->stream_index = index;
+    history.push_back(packet);
+  }
+  if (history.empty())
+  {
+    return;
+  }
+
+  // too many packets for the queue, they wait aside until the marker comes out of it
+  {
+    std::lock_guard<std::mutex> lock(m_historyMutex);
+    for (AVPacket *packet : history)
+    {
+      m_history.push_back(packet);
+    }
+  }
+  if (m_queue.tryPut(m_historyPacket) < 0)
+  {
+    std::lock_guard<std::mutex> lock(m_historyMutex);
+    for (AVPacket *packet : m_history)
+    {
+      av_packet_free(&packet);
+    }
+    m_history.clear();
+    this->drop();
+    return;
+  }
+
+  // the history starts at a keyframe, the live packets carry on from it
+  m_waitKeyframe = 0;
+}
+
+void StreamRecorder::split()
+{
+  // close the file right away, or with the next packet when the queue is full
+  if (m_queue.tryPut(m_splitPacket) < 0)
+  {
+    m_splitPending = 1;
+  }
+  m_waitKeyframe = 1;
+}
+
+int StreamRecorder::recordIndex(const AVPacket *packet)
+{
+  // map the input stream to the recorded one, the input indexes change with a reconnection
+  if (packet->stream_index == m_videoState->videoStream)
+  {
+    return m_videoIndex;
+  }
+  else if (packet->stream_index == m_videoState->audioStream)
+  {
+    return m_audioIndex;
+  }
+  return -1;
+}
+
+std::string StreamRecorder::sessionPath(const std::string& path, int id)
+{
+  // cam.mkv becomes cam-1.mkv
+  size_t dot = path.find_last_of('.');
+  size_t slash = path.find_last_of("/\\");
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+  {
+    dot = path.size();
+  }
+  return path.substr(0, dot) + "-" + std::to_string(id) + path.substr(dot);
+}
+
+void StreamRecorder::writeTask()
+{
+  // a full batch leaves more queued, the other blocking jobs go first
+  if (this->writePackets(STREAM_RECORDER_WRITES_PER_RUN) == STREAM_RECORDER_WRITES_PER_RUN)
+  {
+    m_task.notify();
+  }
+}
+
+int StreamRecorder::writePackets(int max)
+{
+  // up to max packets, all of them with 0
+  int count = 0;
+  while ((max <= 0 || count < max) && m_queue.get(m_ioPacket, 0) > 0)
+  {
+    count++;
+
+    if (m_ioPacket->data == m_historyPacket->data)
+    {
+      this->writeHistoryPackets();
+      continue;
+    }
+
+    if (m_ioPacket->data == m_splitPacket->data)
+    {
+      // the next keyframe opens a new file
+      this->closeSegment();
+      continue;
+    }
+
+    this->writePacket(m_ioPacket);
+  }
+
+  return count;
+}
+
+void StreamRecorder::writeHistoryPackets()
+{
+  std::deque<AVPacket*> history;
+  {
+    std::lock_guard<std::mutex> lock(m_historyMutex);
+    history.swap(m_history);
+  }
+
+  for (AVPacket *packet : history)
+  {
+    this->writePacket(packet);
+    av_packet_free(&packet);
+  }
+}
+
+int StreamRecorder::writePacket(AVPacket *packet)
+{
+  int index = packet->stream_index;
+  AVRational time_base = m_timeBases[index];
+
+  // packets without any timestamp cannot be placed in the file
+  int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+  if (ts == AV_NOPTS_VALUE)
+  {
+    av_packet_unref(packet);
+    return 0;
+  }
+  ts = av_rescale_q(ts, time_base, AVRational{1, AV_TIME_BASE});
+
+  // files start at a video keyframe, or anywhere without video
+  int cut = m_videoIndex < 0 || (index == m_videoIndex && (packet->flags & AV_PKT_FLAG_KEY));
+  if (m_outCtx && cut && (this->segmentFull(ts) || ts < m_segmentStart))
+  {
+    this->closeSegment();
+  }
+  if (!m_outCtx && (!cut || this->openSegment(ts) < 0))
+  {
+    av_packet_unref(packet);
+    return 0;
+  }
+
+  // i.e. audio captured just before the keyframe starting the file
+  if (ts < m_segmentStart)
+  {
+    av_packet_unref(packet);
+    return 0;
+  }
+
+  // every file starts at 0
+  int64_t offset = av_rescale_q(m_segmentStart, AVRational{1, AV_TIME_BASE}, time_base);
+  if (packet->pts != AV_NOPTS_VALUE)
+  {
+    packet->pts -= offset;
+  }
+  if (packet->dts != AV_NOPTS_VALUE)
+  {
+    packet->dts -= offset;
+  }
+  av_packet_rescale_ts(packet, time_base, m_outCtx->streams[index]->time_base);
+  packet->pos = -1;
+
+  // the muxer takes the reference
+  int ret = av_interleaved_write_frame(m_outCtx, packet);
+  if (ret < 0)
+  {
+    // i.e. the disk is full, try again with a new file at the next keyframe
+    char error[AV_ERROR_MAX_STRING_SIZE] = {0};
+    av_strerror(ret, error, sizeof(error));
+    std::cerr << "Could not record " << m_videoState->filename << " : " << error << std::endl;
+    this->closeSegment();
+    return ret;
+  }
+  m_videoState->record_packets++;
+
+  return 0;
+}
+
+bool StreamRecorder::segmentFull(int64_t ts)
+{
+  if (m_segmentDuration > 0 && ts - m_segmentStart >= m_segmentDuration)
+  {
+    return true;
+  }
+  return m_segmentBytes > 0 && m_outCtx->pb && avio_tell(m_outCtx->pb) >= m_segmentBytes;
+}
+
+int StreamRecorder::openSegment(int64_t start)
+{
+  std::string filename = this->segmentName();
+
+  // the container is guessed from the file extension
+  int ret = avformat_alloc_output_context2(&m_outCtx, nullptr, nullptr, filename.c_str());
+  if (ret < 0 || !m_outCtx)
+  {
+    std::cerr << "Could not find a container for " << filename << std::endl;
+    m_outCtx = nullptr;
+    return -1;
+  }
+
+  for (int i = 0; i < m_nbStreams; i++)
+  {
+    AVStream *stream = avformat_new_stream(m_outCtx, nullptr);
+    if (!stream || avcodec_parameters_copy(stream->codecpar, m_codecpar[i]) < 0)
+    {
+      std::cerr << "Could not add a stream to " << filename << std::endl;
+      this->closeSegment();
+      return -1;
+    }
+    // the input codec tag may mean nothing in another container
+    stream->codecpar->codec_tag = 0;
+    stream->time_base = m_timeBases[i];
+  }
+
+  if (!(m_outCtx->oformat->flags & AVFMT_NOFILE))
+  {
+    ret = avio_open(&m_outCtx->pb, filename.c_str(), AVIO_FLAG_WRITE);
+    if (ret < 0)
+    {
+      std::cerr << "Could not open " << filename << std::endl;
+      this->closeSegment();
+      return -1;
+    }
+  }
+
+  ret = avformat_write_header(m_outCtx, nullptr);
+  if (ret < 0)
+  {
+    std::cerr << "Could not write the header of " << filename << std::endl;
+    this->closeSegment();
+    return -1;
+  }
+  m_headerWritten = 1;
+  m_segmentStart = start;
+  m_videoState->record_segments++;
+
+  std::cerr << "Recording " << m_videoState->filename << " to " << filename << std::endl;
+  return 0;
+}
+
+void StreamRecorder::closeSegment()
+{
+  if (!m_outCtx)
+  {
+    return;
+  }
+
+  if (m_headerWritten)
+  {
+    av_write_trailer(m_outCtx);
+    m_headerWritten = 0;
+  }
+  if (!(m_outCtx->oformat->flags & AVFMT_NOFILE))
+  {
+    avio_closep(&m_outCtx->pb);
+  }
+  avformat_free_context(m_outCtx);
+  m_outCtx = nullptr;
+}
+
+std::string StreamRecorder::segmentName()
+{
+  // cam.mkv becomes cam-20240101-120000-0.mkv, files of previous runs are never overwritten
+  const std::string& path = m_videoState->record_path;
+  size_t dot = path.find_last_of('.');
+  size_t slash = path.find_last_of("/\\");
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+  {
+    dot = path.size();
+  }
+
+  std::time_t now = std::time(nullptr);
+  std::tm local = {};
+#ifdef _WIN32
+  localtime_s(&local, &now);
+#else
+  localtime_r(&now, &local);
+#endif
+  char date[32] = {0};
+  std::strftime(date, sizeof(date), "%Y%m%d-%H%M%S", &local);
+
+  return path.substr(0, dot) + "-" + date + "-" + std::to_string(m_segmentIndex++) + path.substr(dot);
+}
+
+void StreamRecorder::drop()
+{
+  // what follows a dropped packet cannot be decoded before the next keyframe
+  m_videoState->record_drops++;
+  m_waitKeyframe = 1;
+}
@@ -0,0 +1,93 @@
+
+#ifndef STREAM_RECORDER_H_
+#define STREAM_RECORDER_H_
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include "packetqueue.h"
+#include "videostate.h"
+#include "options.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+// packets waiting for the disk, beyond this the recorder drops until the next keyframe
+#define STREAM_RECORDER_MAX_QUEUE_BYTES (16 * 1024 * 1024)
+
+// packets written per run, the readers of every session share the blocking threads
+#define STREAM_RECORDER_WRITES_PER_RUN 64
+
+// Remuxes the packets of a session into files, without decoding.
+// write() is called by the reader and never blocks, the packets are written by a
+// task on the blocking threads of the executor so that a slow disk cannot stall playback.
+// The container follows the file extension (.mp4, .mkv, .ts), a new file is
+// started at a keyframe once a segment is long or big enough, and after a reconnection.
+// In event mode writeHistory() hands over the pre-event packets in one go,
+// they are written ahead of the live packets that follow.
+// stopAsync() writes what is left and closes the file on the same threads, stop() on the caller's.
+class StreamRecorder
+{
+public:
+  explicit StreamRecorder();
+  ~StreamRecorder();
+
+  int start(VideoState *videoState, const Options& opt);
+  void stop();
+  void stopAsync(std::function<void()> done);
+  void write(const AVPacket *packet);
+  void writeHistory(std::deque<AVPacket*> packets);
+  void split();
+
+  static std::string sessionPath(const std::string& path, int id);
+
+private:
+  VideoState* m_videoState;
+  SerialTask m_task;
+  int m_started;
+  PacketQueue m_queue;
+
+  // copies of the recorded streams, the input may be reopened meanwhile
+  AVCodecParameters* m_codecpar[2];
+  AVRational m_timeBases[2];
+  int m_nbStreams;
+  int m_videoIndex;
+  int m_audioIndex;
+
+  // reader side
+  AVPacket* m_packet;
+  AVPacket* m_splitPacket;
+  AVPacket* m_historyPacket;
+  int m_waitKeyframe;
+  int m_splitPending;
+
+  // pre-event packets waiting for the I/O task
+  std::mutex m_historyMutex;
+  std::deque<AVPacket*> m_history;
+
+  // I/O task side
+  AVPacket* m_ioPacket;
+  AVFormatContext* m_outCtx;
+  int m_headerWritten;
+  int64_t m_segmentStart;
+  int64_t m_segmentDuration;
+  int64_t m_segmentBytes;
+  int m_segmentIndex;
+
+  void writeTask();
+  int writePackets(int max);
+  int recordIndex(const AVPacket *packet);
+  void writeHistoryPackets();
+  int writePacket(AVPacket *packet);
+  bool segmentFull(int64_t ts);
+  int openSegment(int64_t start);
+  void closeSegment();
+  std::string segmentName();
+  void drop();
+};
+
+#endif // STREAM_RECORDER_H_
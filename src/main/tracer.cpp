@@ -0,0 +1,208 @@
+#include <fstream>
+#include <iostream>
+#include "tracer.h"
+
+// trace file written when none was given on the command line
+#define TRACE_DEFAULT_PATH "trace.json"
+
+std::atomic<int> Tracer::s_enabled(0);
+std::atomic<uint64_t> Tracer::s_dropped(0);
+std::mutex Tracer::s_mutex;
+std::vector<std::unique_ptr<TraceBuffer>> Tracer::s_buffers;
+std::vector<TraceEvent> Tracer::s_events;
+std::string Tracer::s_path(TRACE_DEFAULT_PATH);
+uint32_t Tracer::s_nextTid = 1;
+
+namespace
+{
+  // the buffer of the calling thread, given back when the thread ends
+  struct ThreadBufferOwner
+  {
+    TraceBuffer *buffer = nullptr;
+
+    ~ThreadBufferOwner()
+    {
+      if (buffer)
+      {
+        buffer->owned.store(0, std::memory_order_release);
+      }
+    }
+  };
+
+  thread_local ThreadBufferOwner t_owner;
+}
+
+TraceBuffer::TraceBuffer()
+  : owned(0)
+  , tid(0)
+  , m_head(0)
+  , m_tail(0)
+{
+}
+
+TraceBuffer::~TraceBuffer()
+{
+}
+
+bool TraceBuffer::push(const TraceEvent& event)
+{
+  uint32_t head = m_head.load(std::memory_order_relaxed);
+  if (head - m_tail.load(std::memory_order_acquire) >= TRACE_BUFFER_EVENTS)
+  {
+    return false;
+  }
+  m_events[head % TRACE_BUFFER_EVENTS] = event;
+  m_head.store(head + 1, std::memory_order_release);
+  return true;
+}
+
+size_t TraceBuffer::drain(std::vector<TraceEvent>& events, size_t max_events)
+{
+  uint32_t tail = m_tail.load(std::memory_order_relaxed);
+  uint32_t head = m_head.load(std::memory_order_acquire);
+  for (; tail != head && events.size() < max_events; tail++)
+  {
+    events.push_back(m_events[tail % TRACE_BUFFER_EVENTS]);
+  }
+  // what did not fit is dropped
+  m_tail.store(head, std::memory_order_release);
+  return head - tail;
+}
+
+void Tracer::setPath(const std::string& path)
+{
+  std::lock_guard<std::mutex> lock(s_mutex);
+  s_path = path;
+}
+
+void Tracer::start()
+{
+  std::lock_guard<std::mutex> lock(s_mutex);
+
+  // forget what was recorded before, i.e. scopes ending after the previous stop
+  s_events.clear();
+  for (auto& buffer : s_buffers)
+  {
+    buffer->drain(s_events, 0);
+  }
+  s_dropped = 0;
+  s_enabled = 1;
+  std::cerr << "Tracing to " << s_path << std::endl;
+}
+
+int Tracer::stop()
+{
+  std::lock_guard<std::mutex> lock(s_mutex);
+  if (!s_enabled.exchange(0))
+  {
+    return 0;
+  }
+
+  drainBuffers();
+  int ret = write();
+  s_events.clear();
+  s_events.shrink_to_fit();
+  return ret;
+}
+
+void Tracer::collect()
+{
+  if (!enabled())
+  {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(s_mutex);
+  drainBuffers();
+}
+
+void Tracer::record(const char *name, int64_t start, int64_t end)
+{
+  TraceBuffer *buffer = t_owner.buffer;
+  if (!buffer)
+  {
+    buffer = threadBuffer();
+    if (!buffer)
+    {
+      s_dropped++;
+      return;
+    }
+  }
+
+  TraceEvent event;
+  event.name = name;
+  event.start = start;
+  event.duration = end - start;
+  event.tid = buffer->tid;
+  if (!buffer->push(event))
+  {
+    // the event loop did not collect in time
+    s_dropped++;
+  }
+}
+
+TraceBuffer* Tracer::threadBuffer()
+{
+  std::lock_guard<std::mutex> lock(s_mutex);
+
+  // first event of this thread, reuse the buffer of a thread that ended
+  TraceBuffer *buffer = nullptr;
+  for (auto& candidate : s_buffers)
+  {
+    int owned = 0;
+    if (candidate->owned.compare_exchange_strong(owned, 1, std::memory_order_acquire))
+    {
+      buffer = candidate.get();
+      break;
+    }
+  }
+  if (!buffer)
+  {
+    s_buffers.push_back(std::make_unique<TraceBuffer>());
+    buffer = s_buffers.back().get();
+    buffer->owned = 1;
+  }
+  buffer->tid = s_nextTid++;
+  t_owner.buffer = buffer;
+  return buffer;
+}
+
+void Tracer::drainBuffers()
+{
+  for (auto& buffer : s_buffers)
+  {
+    s_dropped += buffer->drain(s_events, TRACE_MAX_EVENTS);
+  }
+}
+
+int Tracer::write()
+{
+  std::ofstream out(s_path, std::ios::out | std::ios::trunc);
+  if (!out)
+  {
+    std::cerr << "Could not open the trace file " << s_path << std::endl;
+    return -1;
+  }
+
+  // chrome trace event format, complete events in microseconds
+  out << "{\"traceEvents\":[";
+  for (size_t i = 0; i < s_events.size(); i++)
+  {
+    const TraceEvent& event = s_events[i];
+    out << (i ? ",\n" : "\n")
+        << "{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1"
+        << ",\"tid\":" << event.tid
+        << ",\"ts\":" << event.start
+        << ",\"dur\":" << event.duration << "}";
+  }
+  out << "\n],\"displayTimeUnit\":\"ms\"}" << std::endl;
+
+  std::cerr << "Trace written to " << s_path << " : " << s_events.size() << " events";
+  if (s_dropped > 0)
+  {
+    std::cerr << ", " << s_dropped << " dropped";
+  }
+  std::cerr << std::endl;
+
+  return out.good() ? 0 : -1;
+}
@@ -0,0 +1,109 @@
+
+#ifndef TRACER_H_
+#define TRACER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include <libavutil/time.h>
+}
+
+// events a thread can record between two collections of the event loop
+#define TRACE_BUFFER_EVENTS 16384
+
+// events kept in memory for one trace file
+#define TRACE_MAX_EVENTS (4 * 1024 * 1024)
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// times the rest of the enclosing block under the given name (a string literal)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+
+// One timed section of one thread.
+struct TraceEvent
+{
+  const char *name;
+  int64_t start;
+  int64_t duration;
+  uint32_t tid;
+};
+
+// Events of one thread, written by that thread only and read by the event loop.
+// A buffer is handed to another thread once its thread ended.
+class TraceBuffer
+{
+public:
+  explicit TraceBuffer();
+  ~TraceBuffer();
+
+  bool push(const TraceEvent& event);
+  size_t drain(std::vector<TraceEvent>& events, size_t max_events);
+
+  std::atomic<int> owned;
+  uint32_t tid;
+
+private:
+  TraceEvent m_events[TRACE_BUFFER_EVENTS];
+  std::atomic<uint32_t> m_head;
+  std::atomic<uint32_t> m_tail;
+};
+
+// Scoped trace points of the reading, decoding, conversion and display stages.
+// Disabled, a trace point costs one relaxed atomic load. Enabled, it costs two clock
+// reads and a store into the lock free buffer of its thread; the event loop moves
+// the buffers into memory and stop() writes them as a Chrome trace (chrome://tracing, Perfetto).
+class Tracer
+{
+public:
+  static void setPath(const std::string& path);
+  static void start();
+  static int stop();
+  static void collect();
+  static bool enabled() { return s_enabled.load(std::memory_order_relaxed) != 0; }
+  static void record(const char *name, int64_t start, int64_t end);
+
+private:
+  static std::atomic<int> s_enabled;
+  static std::atomic<uint64_t> s_dropped;
+  static std::mutex s_mutex;
+  static std::vector<std::unique_ptr<TraceBuffer>> s_buffers;
+  static std::vector<TraceEvent> s_events;
+  static std::string s_path;
+  static uint32_t s_nextTid;
+
+  static TraceBuffer* threadBuffer();
+  static void drainBuffers();
+  static int write();
+};
+
+// Records the time between its construction and its destruction.
+class TraceScope
+{
+public:
+  explicit TraceScope(const char *name)
+    : m_name(name)
+    , m_start(Tracer::enabled() ? av_gettime_relative() : 0)
+  {
+  }
+
+  ~TraceScope()
+  {
+    if (m_start)
+    {
+      Tracer::record(m_name, m_start, av_gettime_relative());
+    }
+  }
+
+private:
+  const char *m_name;
+  int64_t m_start;
+};
+
+#endif // TRACER_H_
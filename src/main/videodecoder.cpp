@@ -1,138 +1,295 @@
 
+#include <algorithm>
 #include <iostream>
-#include <thread>
 #include "videodecoder.h"
+#include "tracer.h"
 
 VideoDecoder::VideoDecoder()
   : m_videoState(nullptr)
+  , m_packet(nullptr)
+  , m_frame(nullptr)
+  , m_receiving(0)
+  , m_pendingPicture(0)
+  , m_pendingPts(0)
+  , m_decodeUs(0)
+  , m_lateFrames(0)
+  , m_overloaded(0)
 {
 }
 
 VideoDecoder::~VideoDecoder()
 {
+  this->stop();
+
+  // every task of the session is stopped, nothing reads these anymore
+  if (m_videoState)
+  {
+    m_videoState->videoq.setConsumer(nullptr);
+    m_videoState->picture_producer = nullptr;
+  }
+
+  // wipe the frame and the packet
+  av_frame_free(&m_frame);
+  av_packet_free(&m_packet);
   m_videoState = nullptr;
 }
 
 int VideoDecoder::start(VideoState *videoState)
 {
   m_videoState = videoState;
-  if (m_videoState)
-  {
-    std::thread([&](VideoDecoder *decoder)
-      {
-        decoder->videoThread(m_videoState);
-      }, this).detach();
-  }
-  else
+  if (!m_videoState)
   {
     return -1;
   }
-  return 0;
-}
-
-int VideoDecoder::videoThread(void *arg)
-{
-  // retrieve global videostate
-  VideoState *videoState = (VideoState *)arg;
 
   // allocate an AVPacket to be used to retrieve data from the videoq.
-  AVPacket *packet = av_packet_alloc();
-  if (packet == nullptr)
+  m_packet = av_packet_alloc();
+  if (m_packet == nullptr)
   {
     std::cerr << "Could not alloc packet" << std::endl;
     return -1;
   }
 
-  // set this when we are done decoding an entire frame
-  int frameFinished = 0;
-
   // allocate a new AVFrame, used to decode video packets
-  static AVFrame *pFrame = nullptr;
-  pFrame = av_frame_alloc();
-  if (!pFrame)
+  m_frame = av_frame_alloc();
+  if (!m_frame)
   {
     std::cerr << "Could not allocate AVFrame" << std::endl;
     return -1;
   }
 
-  double pts = 0.0;
+  // run on the workers by the packets coming in and the picture slots freed
+  m_task.start(m_videoState->executor, false, [this]()
+  {
+    this->decodeTask();
+  });
+  m_videoState->videoq.setConsumer(&m_task);
+  m_videoState->picture_producer = &m_task;
+  m_task.notify();
 
-  for (;;)
+  return 0;
+}
+
+void VideoDecoder::stop()
+{
+  // waits for the current run, notifying the task does nothing from now on
+  m_task.stop();
+}
+
+void VideoDecoder::stopAsync(std::function<void()> done)
+{
+  // without waiting, done is called on a worker after the current run
+  m_task.stopAsync(std::move(done));
+}
+
+void VideoDecoder::decodeTask()
+{
+  VideoState *videoState = m_videoState;
+
+  // Check global quit flag
+  if (videoState->quit)
+  {
+    return;
+  }
+
+  // the picture kept for a full queue goes first, then the other frames of its packet
+  if (m_pendingPicture)
   {
-    // get a packet from videq
-    int ret = videoState->videoq.get(packet, 1);
+    int ret = videoState->queuePicture(m_frame, m_pendingPts);
+    if (ret == AVERROR(EAGAIN))
+    {
+      return;
+    }
+    m_pendingPicture = 0;
     if (ret < 0)
     {
-      // means we quit getting packets
-      break;
+      m_receiving = 0;
     }
+  }
+  if (m_receiving && this->receiveFrames(videoState) == AVERROR(EAGAIN))
+  {
+    return;
+  }
 
-    if (packet->data == videoState->flush_pkt->data)
+  // get a packet from videq
+  int ret = videoState->videoq.get(m_packet, 0);
+  if (ret <= 0)
+  {
+    // quitting, or nothing queued: the reader notifies this task with the next packet
+    return;
+  }
+
+  if (m_packet->data == videoState->flush_pkt->data)
+  {
+    avcodec_flush_buffers(videoState->video_ctx);
+    videoState->video_skip_to_flush = 0;
+  }
+  else if (videoState->video_skip_to_flush)
+  {
+    // live mode went over its latency cap, the backlog up to the flush packet is dropped
+    av_packet_unref(m_packet);
+  }
+  else
+  {
+    this->applySkipFrame(videoState);
+
+    // give the decoder raw compressed data in an AVPacket
+    int64_t decode_start = av_gettime_relative();
+    m_packet->opaque = (void*)(intptr_t)decode_start;
     {
-      avcodec_flush_buffers(videoState->video_ctx);
-      continue;
+      TRACE_SCOPE("avcodec_send_packet");
+      ret = avcodec_send_packet(videoState->video_ctx, m_packet);
     }
+    m_decodeUs += av_gettime_relative() - decode_start;
 
-    // init set pts to 0 for all frames
-    pts = 0.0;
+    // wipe the packet, the decoder holds its own reference
+    av_packet_unref(m_packet);
 
-    // give the decoder raw compressed data in an AVPacket
-    ret = avcodec_send_packet(videoState->video_ctx, packet);
     if (ret < 0)
     {
+      // a corrupt or lost packet, the next keyframe repairs the picture
+      videoState->video_decode_errors++;
       std::cerr << "Error sending packet for decoding" << std::endl;
-      return -1;
     }
-
-    while (ret >= 0)
+    else
     {
-      // get decoded output data from decoder
-      ret = avcodec_receive_frame(videoState->video_ctx, pFrame);
-      if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+      m_receiving = 1;
+      if (this->receiveFrames(videoState) == AVERROR(EAGAIN))
       {
-        break;
-      }
-      else if (ret < 0)
-      {
-        std::cerr << "Error while decoding" << std::endl;
-        return -1;
-      }
-      else
-      {
-        frameFinished = 1;
+        return;
       }
+    }
+  }
 
-      pts = this->guessCorrectPts(videoState->video_ctx, pFrame->pts, pFrame->pkt_dts);
-      // in case we get an undefined timestamp value
-      if (pts == AV_NOPTS_VALUE)
-      {
-        // set pts to the default value of 0
-        pts = 0.0;
-      }
+  // one packet per run, the workers go to the other sessions in between
+  if (videoState->videoq.nb_packets > 0)
+  {
+    m_task.notify();
+  }
+}
 
-      pts *= av_q2d(videoState->video_st->time_base);
+int VideoDecoder::receiveFrames(VideoState *videoState)
+{
+  for (;;)
+  {
+    // get decoded output data from decoder
+    int64_t decode_start = av_gettime_relative();
+    int ret = 0;
+    {
+      TRACE_SCOPE("avcodec_receive_frame");
+      ret = avcodec_receive_frame(videoState->video_ctx, m_frame);
+    }
+    m_decodeUs += av_gettime_relative() - decode_start;
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+    {
+      break;
+    }
+    else if (ret < 0)
+    {
+      // counted, decoding goes on with the next packet
+      videoState->video_decode_errors++;
+      std::cerr << "Error while decoding" << std::endl;
+      break;
+    }
 
-      // did we get an entire video frame?
-      if (frameFinished)
-      {
-        pts = this->syncVideo(videoState, pFrame, pts);
-        if (m_videoState->queuePicture(pFrame, pts) < 0)
-        {
-          break;
-        }
-      }
+    videoState->video_frames_decoded.fetch_add(1, std::memory_order_relaxed);
+    if (videoState->bench_stats)
+    {
+      videoState->bench_stats->addVideoFrame(m_decodeUs);
+    }
+    m_decodeUs = 0;
+    this->addDecodeLatency(videoState, m_frame);
+
+    double pts = this->guessCorrectPts(videoState->video_ctx, m_frame->pts, m_frame->pkt_dts);
+    // in case we get an undefined timestamp value
+    if (pts == AV_NOPTS_VALUE)
+    {
+      // set pts to the default value of 0
+      pts = 0.0;
     }
-    // wipe the packet
-    av_packet_unref(packet);
-  }
 
-  // wipe the frame
-  av_frame_free(&pFrame);
-  av_free(pFrame);
+    pts *= av_q2d(videoState->video_ctx->pkt_timebase);
+    pts = this->syncVideo(videoState, m_frame, pts);
+
+    // a picture already behind the master clock is not worth converting, unless it is the last one
+    int late = videoState->videoq.nb_packets > 0 && videoState->isLate(pts);
+    this->countLateFrame(late);
+    if (late)
+    {
+      videoState->decoder_drop_count++;
+      continue;
+    }
+
+    ret = videoState->queuePicture(m_frame, pts);
+    if (ret == AVERROR(EAGAIN))
+    {
+      // the picture queue is full, kept until popPicture() notifies this task
+      m_pendingPicture = 1;
+      m_pendingPts = pts;
+      return ret;
+    }
+    else if (ret < 0)
+    {
+      break;
+    }
+  }
 
+  m_receiving = 0;
   return 0;
 }
 
+void VideoDecoder::applySkipFrame(VideoState *videoState)
+{
+  if (videoState->keyframe_only)
+  {
+    // whatever was queued before the reader started dropping the other packets
+    videoState->video_ctx->skip_frame = AVDISCARD_NONKEY;
+  }
+  else if (videoState->live_catchup || m_overloaded)
+  {
+    // live catch-up or a machine that cannot keep up: do not decode pictures no other picture refers to
+    videoState->video_ctx->skip_frame = AVDISCARD_NONREF;
+  }
+  else
+  {
+    videoState->video_ctx->skip_frame = AVDISCARD_DEFAULT;
+  }
+}
+
+void VideoDecoder::addDecodeLatency(VideoState *videoState, const AVFrame *frame)
+{
+  // from sending the packet to getting its picture, grows with frame threading
+  if (!frame->opaque)
+  {
+    return;
+  }
+  int64_t latency = av_gettime_relative() - (intptr_t)frame->opaque;
+  videoState->decode_latency_hist.observe(latency);
+  videoState->decode_latency_sum += latency;
+  videoState->decode_latency_count++;
+  if (latency > videoState->decode_latency_max)
+  {
+    videoState->decode_latency_max = latency;
+  }
+}
+
+void VideoDecoder::countLateFrame(int late)
+{
+  // overloaded after a run of late pictures, back to normal once they are all on time again
+  if (late)
+  {
+    m_lateFrames = std::min(m_lateFrames + 1, LATE_FRAMES_OVERLOAD);
+    if (m_lateFrames == LATE_FRAMES_OVERLOAD && !m_overloaded)
+    {
+      m_overloaded = 1;
+      std::cerr << "Decoder of " << m_videoState->filename << " overloaded, skipping non reference frames" << std::endl;
+    }
+  }
+  else if (m_lateFrames > 0 && --m_lateFrames == 0)
+  {
+    m_overloaded = 0;
+  }
+}
 
 int64_t VideoDecoder::guessCorrectPts(AVCodecContext *ctx, int64_t reordered_pts, int64_t dts)
 {
@@ -14,6 +14,12 @@ extern "C"
 
 #include "videostate.h"
 
+// late pictures in a row before non reference frames are skipped, and back
+#define LATE_FRAMES_OVERLOAD 8
+
+// Decodes the video packets of one session on the executor workers.
+// Each run decodes one packet and returns, the reader notifies it with the next one.
+// A picture finding the picture queue full is kept until the renderer frees a slot.
 class VideoDecoder
 {
 public:
@@ -21,12 +27,29 @@ public:
   ~VideoDecoder();
 
   int start(VideoState *videoState);
+  void stop();
+  void stopAsync(std::function<void()> done);
 
 private:
   VideoState *m_videoState;
-
-  int videoThread(void *arg);
+  SerialTask m_task;
+  AVPacket *m_packet;
+  AVFrame *m_frame;
+  // frames of the last packet still to receive, a picture waiting for a slot and its pts
+  int m_receiving;
+  int m_pendingPicture;
+  double m_pendingPts;
+  // time spent inside the codec since the last decoded frame
+  int64_t m_decodeUs;
+  int m_lateFrames;
+  int m_overloaded;
+
+  void decodeTask();
+  int receiveFrames(VideoState *videoState);
   int64_t guessCorrectPts(AVCodecContext *ctx, int64_t reordered_pts, int64_t dts);
+  void applySkipFrame(VideoState *videoState);
+  void countLateFrame(int late);
+  void addDecodeLatency(VideoState *videoState, const AVFrame *frame);
   double syncVideo(VideoState *videoState, AVFrame *src_frame, double pts);
 };
 
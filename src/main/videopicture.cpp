@@ -7,10 +7,16 @@ VideoPicture::VideoPicture()
   , height(0)
   , allocated(0)
   , pts(0.0)
+  , capture_time(0)
 {
 }
 
 VideoPicture::~VideoPicture()
 {
+  // releases either the conversion buffer or the referenced decoder frame
+  if (frame)
+  {
+    av_frame_free(&frame);
+  }
 }
 
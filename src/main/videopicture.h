@@ -18,6 +18,8 @@ public:
   int height;
   int allocated;
   double pts;
+  // camera wall clock of the picture, us since the epoch (0 when unknown)
+  int64_t capture_time;
 };
 
 #endif // VIDEO_PICTURE_H_
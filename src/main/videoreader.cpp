@@ -1,25 +1,53 @@
 
+#include <algorithm>
 #include <cstring>
-#include <thread>
 #include "videoreader.h"
+#include "tracer.h"
 
-#define MAX_QUEUE_SIZE (15 * 1024 * 1024)
+// first delay between two reconnection attempts, doubled after each failure
+#define RECONNECT_BACKOFF_MIN_MS 100
+
+// packets read per run, stopping and the timers get a chance in between
+#define READER_PACKETS_PER_RUN 32
+
+// delay before reading again when the demuxer has no data yet
+#define READER_RETRY_MS 10
 
 VideoReader::VideoReader()
   : m_videoDecoder(nullptr)
+  , m_audioDecoder(nullptr)
   , m_videoRenderer(nullptr)
+  , m_headlessSink(nullptr)
+  , m_recorder(nullptr)
+  , m_preEventBuffer(nullptr)
+  , m_eventTrigger(0)
+  , m_eventEnd(0)
+  , m_postEventDuration(0)
   , m_videoState(nullptr)
   , m_deviceID(0)
+  , m_packet(nullptr)
+  , m_opened(0)
+  , m_eof(0)
+  , m_reconnectDelay(0)
+  , m_reconnectStart(0)
+  , m_waitKeyframe(0)
+  , m_flushOnKeyframe(0)
+  , m_keyframeOnly(0)
+  , m_active(false)
+  , m_stopping(0)
+  , m_pendingStops(0)
+  , m_stopped(0)
 {
 }
 
 VideoReader::~VideoReader()
 {
+  this->stop();
 }
 
 int VideoReader::start(VideoState* videoState, const Options& opt)
 {
-  if (videoState == nullptr)
+  if (videoState == nullptr || videoState->executor == nullptr)
   {
     return -1;
   }
@@ -28,98 +56,256 @@ int VideoReader::start(VideoState* videoState, const Options& opt)
   // set output audio device index
   m_videoState->output_audio_device_index = opt.audioIndex;
 
-  // start read thread
-  std::thread([&](VideoReader *reader, const Options& opt)
+  // set the amount of decoded audio buffered ahead of the audio device
+  m_videoState->audio_buffer_ms = opt.audioBufferMs;
+
+  // headless mode decodes as fast as possible into null sinks and collects throughput stats
+  m_videoState->headless = opt.headless;
+  if (opt.headless)
+  {
+    m_videoState->bench_stats.reset(new BenchStats());
+  }
+
+  // limit what is buffered between the reader and the decoders
+  m_videoState->queue_budget.init(opt.maxQueueBytes, (int64_t)(opt.maxQueueSeconds * AV_TIME_BASE));
+
+  // pictures behind the master clock are dropped before conversion and display,
+  // headless runs measure the full decode and keep them all
+  m_videoState->late_drop_threshold = opt.headless ? 0 : opt.lateDropMs / 1000.0;
+
+  // decoder threads: fixed per stream, or a share of the cores for every session
+  m_videoState->decoder_threads = opt.decoderThreads;
+  m_videoState->decoder_thread_type = opt.threadType;
+  m_videoState->thread_budget = opt.threadBudget;
+  if (opt.live && opt.threadType == 0)
+  {
+    // frame threading holds back one picture per thread, slices do not
+    m_videoState->decoder_thread_type = FF_THREAD_SLICE;
+  }
+
+  // colour conversion bands converted in parallel
+  if (opt.swsThreads > 1 && m_videoState->slice_scaler.init(opt.swsThreads, m_videoState->executor) < 0)
+  {
+    return -1;
+  }
+
+  // pictures are converted at the size the renderer shows them
+  m_videoState->downscale = opt.downscale;
+  m_videoState->latency_overlay = opt.latencyOverlay;
+
+  // live mode keeps the buffered latency around the target
+  m_videoState->live = opt.live;
+  m_videoState->latency_target = (int64_t)opt.latencyTargetMs * 1000;
+  m_videoState->latency_cap = (int64_t)opt.latencyCapMs * 1000;
+
+  // allocate the decoded picture queue
+  if (m_videoState->initPictureQueue(opt.pictureQueueSize) < 0)
+  {
+    return -1;
+  }
+
+  // start the read task, its first run opens the input; the session is over once it sets quit
+  m_options = opt;
+  m_videoState->queue_budget.setWaiter(&m_readTask);
+  this->setActive(true);
+  m_readTask.start(m_videoState->executor, true, [this]()
   {
-    reader->readThread(m_videoState, opt);
-  }, this, opt).detach();
+    this->readTask();
+  });
+  m_readTask.notify();
 
   return 0;
 }
 
-int VideoReader::readThread(void *arg, const Options& opt)
+void VideoReader::stopAsync()
 {
-  int ret = -1;
+  if (!m_videoState || m_stopping)
+  {
+    return;
+  }
+  m_stopping = 1;
 
-  // Retrieve global VideoState reference
-  VideoState *videoState = (VideoState *)arg;
-  videoState->quit = 0;
+  // wake up and stop every task of this session without waiting, other sessions are left untouched
+  m_videoState->abort();
+  m_readTask.stopAsync([this]()
+  {
+    this->readStopped();
+  });
+}
 
-  int videoStream = -1;
-  int audioStream = -1;
+void VideoReader::stop()
+{
+  if (!m_videoState)
+  {
+    return;
+  }
 
-  AVFormatContext* pFormatCtx = nullptr;
-  AVDictionary* options = nullptr;
+  // the event loop only gets here once stopped(), the destructor and the end of the program wait
+  this->stopAsync();
+  {
+    std::unique_lock<std::mutex> lock(m_stopMutex);
+    m_stopCond.wait(lock, [this]() { return m_stopped != 0; });
+  }
 
-  pFormatCtx = avformat_alloc_context();
-  if (!pFormatCtx)
+  // no task of the session runs anymore, what is left belongs to the event loop thread
+  if (m_recorder)
   {
-    std::cerr << "Failed to alloc avformat context." << std::endl;
-    return -1;
+    delete m_recorder;
+    m_recorder = nullptr;
+  }
+  if (m_preEventBuffer)
+  {
+    delete m_preEventBuffer;
+    m_preEventBuffer = nullptr;
   }
-  // interrupt_callback is a callback function for checking interrupted I/O operations.
-  pFormatCtx->interrupt_callback.callback = decodeInterruptCB;
-  pFormatCtx->interrupt_callback.opaque = videoState;
 
-  if (opt.scanAllPmts)
+  // no audio callback notifies the audio decoder once the device is closed
+  this->releasePointer();
+  if (m_videoDecoder)
   {
-    // 'scan_all_pmts' is an option primarily related to streaming MPEG-TS and reading files.
-    // When enabled, all PMTs are scanned, not just the first PMT.
-    // For MPEG-TS with multiple PMTs, all stream information can be retrieved.
-    // This option is always set in ffplay.
-    av_dict_set(&options, "scan_all_pmts", "1", AV_DICT_DONT_OVERWRITE);
+    delete m_videoDecoder;
+    m_videoDecoder = nullptr;
+  }
+  if (m_audioDecoder)
+  {
+    delete m_audioDecoder;
+    m_audioDecoder = nullptr;
   }
+  if (m_headlessSink)
+  {
+    delete m_headlessSink;
+    m_headlessSink = nullptr;
+  }
+  m_videoState->queue_budget.setWaiter(nullptr);
 
-  if (opt.rtspTransport)
+  // the window belongs to the event loop thread, which is the one calling stop()
+  VideoRenderer* videoRenderer = m_videoRenderer.exchange(nullptr);
+  if (videoRenderer)
   {
-    // 'rtsp_transport' sets the receive protocol for the RTSP stream.
-    // The default is to use UDP.
-    av_dict_set(&options, "rtsp_transport", "tcp", 0);
+    delete videoRenderer;
   }
 
-  if (opt.maxDelay > 0)
+  m_videoState = nullptr;
+  m_stopping = 0;
+  m_stopped = 0;
+}
+
+void VideoReader::readStopped()
+{
+  // on a blocking thread, after the last run of the read task
+  this->setActive(false);
+
+  // the read task may have (re)initialised a queue while stopping, abort again
+  m_videoState->abort();
+
+  // the decoders and the sink notify each other through the picture queue, they are all
+  // stopped before stop() deletes any of them; the last one to stop ends the session
+  m_pendingStops = 1;
+  std::function<void()> done = [this]()
   {
-    // Sets the maximum delay time.
-    // The unit is us.
-    av_dict_set(&options, "max_delay", std::to_string(opt.maxDelay).c_str(), 0);
+    this->taskStopped();
+  };
+
+  // no packet comes in anymore, the recorder writes what it still holds on its own thread
+  if (m_recorder)
+  {
+    m_pendingStops++;
+    m_recorder->stopAsync(done);
   }
+  if (m_headlessSink)
+  {
+    m_pendingStops++;
+    m_headlessSink->stopAsync(done);
+  }
+  if (m_videoDecoder)
+  {
+    m_pendingStops++;
+    m_videoDecoder->stopAsync(done);
+  }
+  if (m_audioDecoder)
+  {
+    m_pendingStops++;
+    m_audioDecoder->stopAsync(done);
+  }
+  this->taskStopped();
+}
 
-  if (opt.stimeout > 0)
+void VideoReader::taskStopped()
+{
+  if (--m_pendingStops > 0)
   {
-    // set timeout (in microseconds) of socket TCP I/O operations.
-    av_dict_set(&options, "stimeout", std::to_string(opt.stimeout).c_str(), 0);
+    return;
   }
 
-  if (opt.bufferSize > 0)
+  // reapSessions() sees it on its next pass, stop() wakes up
+  std::lock_guard<std::mutex> lock(m_stopMutex);
+  m_stopped = 1;
+  m_stopCond.notify_all();
+}
+
+void VideoReader::readTask()
+{
+  VideoState *videoState = m_videoState;
+
+  // Check global quit flag
+  if (videoState->quit)
   {
-    // Underlying protocol send/receive buffer size.
-    av_dict_set(&options, "buffer_size", std::to_string(opt.bufferSize).c_str(), 0);
+    return;
+  }
+
+  int ret = 0;
+  if (!m_opened)
+  {
+    // the first run opens the input and the decoders
+    m_opened = 1;
+    ret = this->openStreams(videoState, m_options);
+    if (ret == 0)
+    {
+      m_readTask.notify();
+    }
+  }
+  else if (m_reconnectDelay > 0)
+  {
+    ret = this->reconnect(videoState, m_options);
+  }
+  else
+  {
+    ret = this->readPackets(videoState, m_options);
   }
 
-  ret = avformat_open_input(&pFormatCtx, videoState->filename.c_str(), nullptr, &options);
   if (ret < 0)
   {
-    std::cerr << "Could not open file " << videoState->filename << std::endl;
-    return -1;
+    // the session is over, the session manager reaps it
+    this->setActive(false);
+    videoState->quit = 1;
   }
-  av_dict_free(&options);
-  options = nullptr;
+}
+
+int VideoReader::openStreams(VideoState *videoState, const Options& opt)
+{
+  int ret = -1;
+
+  // time to first picture is measured from here
+  videoState->session_start_time = av_gettime_relative();
+
+  int videoStream = -1;
+  int audioStream = -1;
+
+  AVFormatContext* pFormatCtx = nullptr;
 
   // Reset streamindex
   videoState->videoStream = -1;
   videoState->audioStream = -1;
 
-  // Set the avformatcontext for the global videostate ref
-  videoState->pFormatCtx = pFormatCtx;
-
-  // Read packets of the media file to get stream info
-  ret = avformat_find_stream_info(pFormatCtx, nullptr);
+  ret = this->openInput(videoState, opt, &pFormatCtx);
   if (ret < 0)
   {
-    std::cerr << "Could not find stream info " << videoState->filename << std::endl;
     return -1;
   }
 
+  // Set the avformatcontext for the global videostate ref
+  videoState->pFormatCtx = pFormatCtx;
+
   // Dump info about file onto standard error
   av_dump_format(pFormatCtx, 0, videoState->filename.c_str(), 0);
 
@@ -157,16 +343,31 @@ int VideoReader::readThread(void *arg, const Options& opt)
       return -1;
     }
 
-    m_videoRenderer = new VideoRenderer();
-    m_videoRenderer->start(videoState);
+    if (videoState->headless)
+    {
+      m_headlessSink = new HeadlessSink();
+      m_headlessSink->start(videoState);
+    }
+    else if (!opt.mosaic)
+    {
+      // presenting several windows from the one event loop must not wait for vsync on each
+      VideoRenderer* videoRenderer = new VideoRenderer();
+      m_videoRenderer = videoRenderer;
+      videoRenderer->start(videoState, opt.urls.size() <= 1);
+    }
   }
 
-  // Return with error in case no audio stream was found
-  if (audioStream == -1)
+  // Without audio (no audio stream, or another session owns the audio device) sync to the video clock
+  if (audioStream == -1 || videoState->audio_disabled)
   {
-    std::cerr << "Could not find audio stream" << std::endl;
-    this->releasePointer();
-    return -1;
+    if (audioStream == -1)
+    {
+      std::cerr << "Could not find audio stream" << std::endl;
+    }
+    if (videoState->av_sync_type == SYNC_TYPE::AV_SYNC_AUDIO_MASTER)
+    {
+      videoState->av_sync_type = SYNC_TYPE::AV_SYNC_VIDEO_MASTER;
+    }
   }
   else
   {
@@ -179,7 +380,7 @@ int VideoReader::readThread(void *arg, const Options& opt)
       return -1;
     }
   }
-  if (videoState->videoStream < 0 || videoState->audioStream < 0)
+  if (videoState->videoStream < 0)
   {
     std::cerr << "Could not open codecs " << videoState->filename << std::endl;
     this->releasePointer();
@@ -194,77 +395,603 @@ int VideoReader::readThread(void *arg, const Options& opt)
     return -1;
   }
 
+  // remux the packets to disk next to playing them
+  if (!videoState->record_path.empty())
+  {
+    m_recorder = new StreamRecorder();
+    if (m_recorder->start(videoState, opt) < 0)
+    {
+      std::cerr << "Could not record " << videoState->filename << std::endl;
+      delete m_recorder;
+      m_recorder = nullptr;
+    }
+  }
+
+  // event mode: only the seconds around a trigger are recorded
+  if (m_recorder && opt.preEventSec > 0)
+  {
+    m_preEventBuffer = new PreEventBuffer();
+    m_preEventBuffer->init(
+      (int64_t)opt.preEventSec * AV_TIME_BASE
+      , (int64_t)opt.preEventMaxMb * 1024 * 1024
+      , (int64_t)opt.preEventTotalMb * 1024 * 1024
+      , videoState->videoStream >= 0);
+    m_postEventDuration = (int64_t)opt.postEventSec * AV_TIME_BASE;
+  }
+
+  // throughput is measured from the first packet read, stream probing excluded
+  if (videoState->bench_stats)
+  {
+    videoState->bench_stats->start();
+  }
+
+  // in fast start mode nothing is queued before the first keyframe
+  m_waitKeyframe = opt.fastStart;
+
+  return 0;
+}
+
+int VideoReader::readPackets(VideoState *videoState, const Options& opt)
+{
+  int ret = 0;
+
   // Main decode loop. read in a packet and put it on the queue
-  for (;;)
+  for (int count = 0; count < READER_PACKETS_PER_RUN; count++)
   {
     // Check global quit flag
     if (videoState->quit)
     {
-      break;
+      return -1;
+    }
+
+    if (m_eof)
+    {
+      // Wait for the decoders to drain both queues, the last get notifies this task
+      if (!videoState->queue_budget.wait([videoState]()
+      {
+        return videoState->quit || (videoState->videoq.nb_packets == 0 && videoState->audioq.nb_packets == 0);
+      }))
+      {
+        return 0;
+      }
+
+      if (videoState->bench_stats)
+      {
+        videoState->bench_stats->stop();
+      }
+
+      // Media EOF reached, quit
+      return -1;
     }
 
-    // Check audio and video packets queues size
-    if (videoState->audioq.size + videoState->videoq.size > MAX_QUEUE_SIZE)
+    // Wait for the decoders to bring the audio and video queues back under budget, they notify this task
+    if (!videoState->queue_budget.wait([videoState]()
     {
-      // Wait for audio and video queues to decrease size
-      SDL_Delay(10);
-      continue;
+      return videoState->quit || !videoState->queuesFull();
+    }))
+    {
+      this->countFullQueues(videoState);
+      return 0;
+    }
+    if (videoState->quit)
+    {
+      return -1;
     }
+
     // Read data from the AVFormatContext by repeatedly calling av_read_frame
-    ret = av_read_frame(videoState->pFormatCtx, m_packet);
+    {
+      TRACE_SCOPE("av_read_frame");
+      ret = av_read_frame(videoState->pFormatCtx, m_packet);
+    }
     if (ret < 0)
     {
-      if (ret == AVERROR_EOF)
+      if (videoState->quit)
       {
-        // Wait for the rest of the program to end
-        while (videoState->videoq.nb_packets > 0 && videoState->audioq.nb_packets > 0)
-        {
-          SDL_Delay(10);
-        }
-
-        // Media EOF reached, quit
-        videoState->quit = 1;
-        break;
+        return -1;
+      }
+      else if (ret == AVERROR(EAGAIN))
+      {
+        // No data yet, try again without holding the thread
+        m_readTask.notifyAfter(READER_RETRY_MS);
+        return 0;
+      }
+      else if (opt.reconnectMaxMs > 0 && (ret != AVERROR_EOF || isNetworkInput(videoState->filename)))
+      {
+        // the camera dropped the session, or a live stream ended: reopen it
+        this->loseInput(videoState);
+        return this->reconnect(videoState, opt);
       }
-      else if (!videoState->pFormatCtx->pb && videoState->pFormatCtx->pb->error == 0)
+      else if (ret == AVERROR_EOF)
       {
-        // No read error, wait for user input
-        SDL_Delay(10);
+        m_eof = 1;
         continue;
       }
       else
       {
-        // Exit for loop in case of error
-        break;
+        // Exit in case of error, the session ends
+        std::cerr << "Could not read " << videoState->filename << std::endl;
+        return -1;
+      }
+    }
+
+    if (m_reconnectStart)
+    {
+      // first packet of the new session, the outage is over
+      int64_t recovery_ms = (av_gettime_relative() - m_reconnectStart) / 1000;
+      m_reconnectStart = 0;
+      videoState->recovery_time_last = recovery_ms;
+      if (recovery_ms > videoState->recovery_time_max)
+      {
+        videoState->recovery_time_max = recovery_ms;
       }
+      std::cerr << "Reconnected " << videoState->filename << " in " << recovery_ms << " ms" << std::endl;
+    }
+
+    if (videoState->bench_stats)
+    {
+      videoState->bench_stats->addPacket(videoState->videoq.nb_packets, videoState->audioq.nb_packets);
+    }
+
+    // the recorder takes its own reference, it never blocks
+    if (m_recorder)
+    {
+      this->recordPacket(videoState);
     }
 
     // Put the packet in the appropriate queue
     if (m_packet->stream_index == videoState->videoStream)
     {
-      videoState->videoq.put(m_packet);
+      int keyframeOnly = videoState->keyframe_only;
+      if (keyframeOnly != m_keyframeOnly)
+      {
+        // back to full decoding, the next pictures need the references that were dropped
+        m_waitKeyframe |= !keyframeOnly;
+        m_keyframeOnly = keyframeOnly;
+      }
+      if ((m_waitKeyframe || m_keyframeOnly) && !(m_packet->flags & AV_PKT_FLAG_KEY))
+      {
+        // nothing can be decoded before the first keyframe, or is wanted in keyframe only mode
+        av_packet_unref(m_packet);
+        continue;
+      }
+      m_waitKeyframe = 0;
+      if (m_flushOnKeyframe)
+      {
+        // the video decoder drops everything queued before this keyframe
+        videoState->videoq.tryPut(videoState->flush_pkt);
+        m_flushOnKeyframe = 0;
+      }
+      this->stampCaptureTime(videoState);
+      TRACE_SCOPE("videoq.put");
+      if (videoState->videoq.tryPut(m_packet) < 0)
+      {
+        // only on quit, queuesFull() keeps room for it; the next pictures need a keyframe
+        av_packet_unref(m_packet);
+        m_waitKeyframe = 1;
+      }
     }
     else if (m_packet->stream_index == videoState->audioStream)
     {
-      videoState->audioq.put(m_packet);
+      TRACE_SCOPE("audioq.put");
+      if (videoState->audioq.tryPut(m_packet) < 0)
+      {
+        av_packet_unref(m_packet);
+      }
     }
     else
     {
       // Otherwise free the memory
       av_packet_unref(m_packet);
     }
+
+    if (videoState->live)
+    {
+      this->updateLiveLatency(videoState);
+    }
+  }
+
+  // more to read, the jobs queued meanwhile get the thread in between
+  m_readTask.notify();
+
+  return 0;
+}
+
+void VideoReader::countFullQueues(VideoState *videoState)
+{
+  // the ring that parked the reader, not the byte or duration budget
+  if (videoState->videoq.full(READER_QUEUE_SLOTS))
+  {
+    videoState->videoq.full_count++;
   }
+  if (videoState->audioq.full(READER_QUEUE_SLOTS))
+  {
+    videoState->audioq.full_count++;
+  }
+}
+
+void VideoReader::updateLiveLatency(VideoState *videoState)
+{
+  int64_t latency = videoState->bufferedLatency();
+  videoState->live_latency = latency;
+
+  if (latency > videoState->latency_cap)
+  {
+    // a previous flush is still in progress
+    if (m_flushOnKeyframe || videoState->video_skip_to_flush || videoState->audio_skip_to_flush)
+    {
+      return;
+    }
 
-  // Wait for the rest of the program to end
-  while (!videoState->quit)
+    // too far behind to catch up smoothly: drop the backlog and restart at the next keyframe
+    std::cerr << "Live latency of " << videoState->filename << " at " << latency / 1000
+              << " ms, dropping the backlog" << std::endl;
+    videoState->live_flush_count++;
+    if (videoState->videoStream >= 0)
+    {
+      videoState->video_skip_to_flush = 1;
+      m_waitKeyframe = 1;
+      m_flushOnKeyframe = 1;
+    }
+    if (videoState->audioStream >= 0)
+    {
+      videoState->audio_skip_to_flush = 1;
+      videoState->audioq.tryPut(videoState->flush_pkt);
+    }
+  }
+  else if (latency > videoState->latency_target)
   {
-    SDL_Delay(100);
+    // play slightly faster until the latency is back under the target
+    videoState->live_catchup = 1;
   }
+  else if (latency < videoState->latency_target * LIVE_CATCHUP_EXIT_PERCENT / 100)
+  {
+    videoState->live_catchup = 0;
+  }
+}
 
-  this->releasePointer();
+void VideoReader::triggerEvent()
+{
+  // picked up by the read task with its next packet
+  m_eventTrigger = 1;
+}
+
+void VideoReader::stampCaptureTime(VideoState *videoState)
+{
+  // known once the rtsp demuxer got an rtcp sender report: pts 0 was captured at this wall clock time
+  int64_t realtime = videoState->pFormatCtx->start_time_realtime;
+  if (realtime == AV_NOPTS_VALUE || realtime <= 0 || m_packet->pts == AV_NOPTS_VALUE)
+  {
+    return;
+  }
+
+  // rides along with the packet through the queue and the decoder (AV_CODEC_FLAG_COPY_OPAQUE)
+  int64_t capture_time = realtime + av_rescale_q(m_packet->pts, videoState->video_st->time_base, AVRational{1, AV_TIME_BASE});
+  av_buffer_unref(&m_packet->opaque_ref);
+  m_packet->opaque_ref = av_buffer_alloc(sizeof(capture_time));
+  if (m_packet->opaque_ref)
+  {
+    memcpy(m_packet->opaque_ref->data, &capture_time, sizeof(capture_time));
+  }
+}
+
+void VideoReader::recordPacket(VideoState *videoState)
+{
+  if (!m_preEventBuffer)
+  {
+    m_recorder->write(m_packet);
+    return;
+  }
+
+  int64_t now = av_gettime_relative();
+  if (m_eventTrigger.exchange(0))
+  {
+    if (!m_eventEnd)
+    {
+      // the history goes to disk first, the live packets follow
+      std::cerr << "Event on " << videoState->filename << ", recording the last "
+                << m_preEventBuffer->duration() / 1000 << " ms" << std::endl;
+      m_recorder->writeHistory(m_preEventBuffer->take());
+    }
+    // a new trigger during the event extends it
+    m_eventEnd = now + m_postEventDuration;
+  }
+  else if (m_eventEnd && now >= m_eventEnd)
+  {
+    // the event is over, close its file and buffer again
+    m_eventEnd = 0;
+    m_recorder->split();
+  }
+
+  if (m_eventEnd)
+  {
+    m_recorder->write(m_packet);
+  }
+  else if (m_packet->stream_index == videoState->videoStream || m_packet->stream_index == videoState->audioStream)
+  {
+    m_preEventBuffer->add(
+      m_packet
+      , videoState->pFormatCtx->streams[m_packet->stream_index]->time_base
+      , m_packet->stream_index == videoState->videoStream);
+  }
+}
+
+int VideoReader::openInput(VideoState *videoState, const Options& opt, AVFormatContext** ppFormatCtx)
+{
+  AVFormatContext* pFormatCtx = nullptr;
+  AVDictionary* options = nullptr;
+
+  pFormatCtx = avformat_alloc_context();
+  if (!pFormatCtx)
+  {
+    std::cerr << "Failed to alloc avformat context." << std::endl;
+    return -1;
+  }
+  // interrupt_callback is a callback function for checking interrupted I/O operations.
+  pFormatCtx->interrupt_callback.callback = decodeInterruptCB;
+  pFormatCtx->interrupt_callback.opaque = videoState;
+
+  if (opt.scanAllPmts)
+  {
+    // 'scan_all_pmts' is an option primarily related to streaming MPEG-TS and reading files.
+    // When enabled, all PMTs are scanned, not just the first PMT.
+    // For MPEG-TS with multiple PMTs, all stream information can be retrieved.
+    // This option is always set in ffplay.
+    av_dict_set(&options, "scan_all_pmts", "1", AV_DICT_DONT_OVERWRITE);
+  }
+
+  if (opt.rtspTransport)
+  {
+    // 'rtsp_transport' sets the receive protocol for the RTSP stream.
+    // The default is to use UDP.
+    av_dict_set(&options, "rtsp_transport", "tcp", 0);
+  }
+
+  if (opt.maxDelay > 0)
+  {
+    // Sets the maximum delay time.
+    // The unit is us.
+    av_dict_set(&options, "max_delay", std::to_string(opt.maxDelay).c_str(), 0);
+  }
+
+  if (opt.stimeout > 0)
+  {
+    // set timeout (in microseconds) of socket TCP I/O operations.
+    av_dict_set(&options, "stimeout", std::to_string(opt.stimeout).c_str(), 0);
+  }
+
+  if (opt.bufferSize > 0)
+  {
+    // Underlying protocol send/receive buffer size.
+    av_dict_set(&options, "buffer_size", std::to_string(opt.bufferSize).c_str(), 0);
+  }
+
+  if (opt.fastStart)
+  {
+    // probe as little as possible, cameras describe their streams in the SDP
+    av_dict_set(&options, "probesize", "32768", 0);
+    av_dict_set(&options, "analyzeduration", "100000", 0);
+    av_dict_set(&options, "fpsprobesize", "0", 0);
+  }
+
+  int64_t open_start = av_gettime_relative();
+
+  // on failure the context is freed by avformat_open_input
+  int ret = avformat_open_input(&pFormatCtx, videoState->filename.c_str(), nullptr, &options);
+  av_dict_free(&options);
+  if (ret < 0)
+  {
+    std::cerr << "Could not open file " << videoState->filename << std::endl;
+    return -1;
+  }
+
+  int64_t probe_start = av_gettime_relative();
+
+  // Read packets of the media file to get stream info, unless fast start trusts what the SDP gave
+  if (!opt.fastStart || !hasCodecParameters(pFormatCtx))
+  {
+    ret = avformat_find_stream_info(pFormatCtx, nullptr);
+    if (ret < 0)
+    {
+      std::cerr << "Could not find stream info " << videoState->filename << std::endl;
+      avformat_close_input(&pFormatCtx);
+      return -1;
+    }
+  }
+
+  int64_t probe_end = av_gettime_relative();
+  std::cerr << "Opened " << videoState->filename
+            << " in " << (probe_start - open_start) / 1000 << " ms"
+            << ", stream info in " << (probe_end - probe_start) / 1000 << " ms" << std::endl;
+
+  *ppFormatCtx = pFormatCtx;
   return 0;
 }
 
+void VideoReader::loseInput(VideoState *videoState)
+{
+  // the outage is measured from the first failed read to the first packet read again
+  m_reconnectStart = av_gettime_relative();
+  std::cerr << "Lost " << videoState->filename << ", reconnecting" << std::endl;
+
+  // no share of the thread budget while waiting, the session ends if reconnecting fails
+  this->setActive(false);
+  m_reconnectDelay = RECONNECT_BACKOFF_MIN_MS;
+}
+
+int VideoReader::reconnect(VideoState *videoState, const Options& opt)
+{
+  // the flush packets of the resumed input need room in the rings, the decoders notify this task
+  if (!videoState->queue_budget.wait([videoState]()
+  {
+    return videoState->quit || !videoState->queuesFull();
+  }))
+  {
+    return 0;
+  }
+  if (videoState->quit)
+  {
+    return -1;
+  }
+
+  // one attempt per run
+  AVFormatContext* pFormatCtx = nullptr;
+  if (this->openInput(videoState, opt, &pFormatCtx) == 0)
+  {
+    m_reconnectDelay = 0;
+    if (this->resumeInput(videoState, pFormatCtx) < 0)
+    {
+      avformat_close_input(&pFormatCtx);
+      return -1;
+    }
+    this->setActive(true);
+    m_readTask.notify();
+    return 0;
+  }
+  if (videoState->quit)
+  {
+    return -1;
+  }
+
+  // the next attempt is notified by a timer, nothing holds a thread meanwhile
+  m_readTask.notifyAfter(m_reconnectDelay);
+  m_reconnectDelay = std::min(m_reconnectDelay * 2, opt.reconnectMaxMs);
+  return 0;
+}
+
+int VideoReader::resumeInput(VideoState *videoState, AVFormatContext* pFormatCtx)
+{
+  int videoStream = -1;
+  int audioStream = -1;
+
+  // Look for the streams being decoded in the new input
+  for (int i = 0; i < pFormatCtx->nb_streams; i++)
+  {
+    if (pFormatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && videoStream < 0)
+    {
+      videoStream = i;
+    }
+    if (pFormatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO && audioStream < 0)
+    {
+      audioStream = i;
+    }
+  }
+
+  // the opened codecs can only be reused if nothing changed
+  if (videoState->videoStream >= 0 &&
+      (videoStream < 0 || !sameStreamParameters(videoState->video_ctx, pFormatCtx->streams[videoStream])))
+  {
+    std::cerr << "Video parameters of " << videoState->filename << " changed, cannot resume" << std::endl;
+    return -1;
+  }
+  if (videoState->audioStream >= 0 &&
+      (audioStream < 0 || !sameStreamParameters(videoState->audio_ctx, pFormatCtx->streams[audioStream])))
+  {
+    std::cerr << "Audio parameters of " << videoState->filename << " changed, cannot resume" << std::endl;
+    return -1;
+  }
+
+  // swap the inputs, codecs, audio device, window and texture are kept; the renderers only
+  // read the copied video size, the streams being closed here belong to this task
+  AVFormatContext* oldFormatCtx = videoState->pFormatCtx;
+  if (videoState->videoStream >= 0)
+  {
+    videoState->videoStream = videoStream;
+    videoState->video_st = pFormatCtx->streams[videoStream];
+  }
+  if (videoState->audioStream >= 0)
+  {
+    videoState->audioStream = audioStream;
+    videoState->audio_st = pFormatCtx->streams[audioStream];
+  }
+  videoState->pFormatCtx = pFormatCtx;
+  avformat_close_input(&oldFormatCtx);
+
+  // drop what the decoders still hold of the lost session, reconnect() made room for it
+  if (videoState->videoStream >= 0)
+  {
+    videoState->videoq.tryPut(videoState->flush_pkt);
+  }
+  if (videoState->audioStream >= 0)
+  {
+    videoState->audioq.tryPut(videoState->flush_pkt);
+  }
+
+  // the flushed decoders need a keyframe to start again
+  m_waitKeyframe = 1;
+
+  // so does the recording, in a new file
+  if (m_recorder)
+  {
+    m_recorder->split();
+  }
+  if (m_preEventBuffer)
+  {
+    m_preEventBuffer->clear();
+  }
+
+  // timestamps restart with the new session
+  videoState->frame_timer = (double)av_gettime() / 1000000.0;
+  videoState->frame_last_pts = 0;
+  videoState->reconnect_count++;
+
+  return 0;
+}
+
+bool VideoReader::hasCodecParameters(const AVFormatContext* pFormatCtx)
+{
+  // the decoders can be opened without probing if every stream is fully described,
+  // i.e. the SPS/PPS came as extradata in the SDP (sprop-parameter-sets)
+  for (unsigned int i = 0; i < pFormatCtx->nb_streams; i++)
+  {
+    const AVCodecParameters* par = pFormatCtx->streams[i]->codecpar;
+    if (par->codec_type == AVMEDIA_TYPE_VIDEO &&
+        (par->codec_id == AV_CODEC_ID_NONE || par->extradata_size <= 0))
+    {
+      return false;
+    }
+    if (par->codec_type == AVMEDIA_TYPE_AUDIO &&
+        (par->codec_id == AV_CODEC_ID_NONE || par->sample_rate <= 0 || par->ch_layout.nb_channels <= 0))
+    {
+      return false;
+    }
+  }
+  return pFormatCtx->nb_streams > 0;
+}
+
+bool VideoReader::sameStreamParameters(const AVCodecContext* codecCtx, const AVStream* stream)
+{
+  const AVCodecParameters* par = stream->codecpar;
+  if (par->codec_id != codecCtx->codec_id ||
+      av_cmp_q(stream->time_base, codecCtx->pkt_timebase) != 0)
+  {
+    return false;
+  }
+
+  if (par->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    // without probing (fast start) the size is only known from the first SPS, the running
+    // decoder picks up a change there like any mid-stream resolution change
+    if (par->width <= 0 || par->height <= 0)
+    {
+      return true;
+    }
+
+    // a decoder opened with lowres reports the reduced size
+    return AV_CEIL_RSHIFT(par->width, codecCtx->lowres) == codecCtx->width &&
+           AV_CEIL_RSHIFT(par->height, codecCtx->lowres) == codecCtx->height;
+  }
+
+  return par->sample_rate == codecCtx->sample_rate &&
+         par->ch_layout.nb_channels == codecCtx->ch_layout.nb_channels;
+}
+
+bool VideoReader::isNetworkInput(const std::string& url)
+{
+  // anything with a protocol other than file: is a live source that may come back
+  size_t pos = url.find("://");
+  return pos != std::string::npos && url.compare(0, pos, "file") != 0;
+}
+
 int VideoReader::streamComponentOpen(VideoState *videoState, int stream_index)
 {
   // retrieve file I/O context
@@ -297,7 +1024,10 @@ int VideoReader::streamComponentOpen(VideoState *videoState, int stream_index)
     return -1;
   }
 
-  if (codecCtx->codec_type == AVMEDIA_TYPE_AUDIO)
+  // the decoders convert timestamps with this, not with the stream which goes away on reconnect
+  codecCtx->pkt_timebase = pFormatCtx->streams[stream_index]->time_base;
+
+  if (codecCtx->codec_type == AVMEDIA_TYPE_AUDIO && !videoState->headless)
   {
     SDL_AudioSpec wants;
     SDL_AudioSpec spec;
@@ -307,7 +1037,7 @@ int VideoReader::streamComponentOpen(VideoState *videoState, int stream_index)
     wants.channels = codecCtx->ch_layout.nb_channels;
     wants.silence = 0;
     wants.samples = SDL_AUDIO_BUFFER_SIZE;
-    wants.callback = audioCallback;
+    wants.callback = AudioDecoder::audioCallback;
     wants.userdata = videoState;
 
     // open audio device
@@ -318,6 +1048,47 @@ int VideoReader::streamComponentOpen(VideoState *videoState, int stream_index)
       return -1;
     }
   }
+  if (codecCtx->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    // a share of the budget between the sessions running now, kept until the decoder is reopened
+    if (videoState->thread_budget > 0)
+    {
+      int sessions = videoState->active_sessions ? (int)*videoState->active_sessions : 1;
+      videoState->decoder_threads = std::max(1, videoState->thread_budget / std::max(1, sessions));
+    }
+
+    // left at 0 libavcodec starts a thread per core for every stream
+    codecCtx->thread_count = videoState->decoder_threads;
+    if (videoState->decoder_thread_type)
+    {
+      codecCtx->thread_type = videoState->decoder_thread_type;
+    }
+
+    // the packet send time comes back with the decoded frame
+    codecCtx->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+
+    // decode at a reduced resolution when the display is known to be that small,
+    // only set before opening: the decoders do not follow a change mid stream
+    int target_width = videoState->target_width;
+    int target_height = videoState->target_height;
+    if (videoState->downscale && target_width > 0 && target_height > 0)
+    {
+      int lowres = 0;
+      while (lowres < codec->max_lowres &&
+             AV_CEIL_RSHIFT(codecCtx->width, lowres + 1) >= target_width &&
+             AV_CEIL_RSHIFT(codecCtx->height, lowres + 1) >= target_height)
+      {
+        lowres++;
+      }
+      codecCtx->lowres = lowres;
+    }
+  }
+  else
+  {
+    // audio is cheap to decode, a thread pool per stream is not worth it
+    codecCtx->thread_count = 1;
+  }
+
   // init the AVCodecContext to use the given AVCodec
   if (avcodec_open2(codecCtx, codec, nullptr) < 0)
   {
@@ -325,6 +1096,14 @@ int VideoReader::streamComponentOpen(VideoState *videoState, int stream_index)
     return -1;
   }
 
+  if (codecCtx->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    std::cerr << "Video decoder of " << videoState->filename << " : " << codecCtx->thread_count << " threads"
+              << (codecCtx->active_thread_type == FF_THREAD_FRAME ? ", frame threading"
+                  : codecCtx->active_thread_type == FF_THREAD_SLICE ? ", slice threading" : "")
+              << std::endl;
+  }
+
   switch (codecCtx->codec_type)
   {
     case AVMEDIA_TYPE_AUDIO:
@@ -333,15 +1112,33 @@ int VideoReader::streamComponentOpen(VideoState *videoState, int stream_index)
       videoState->audioStream = stream_index;
       videoState->audio_st = pFormatCtx->streams[stream_index];
       videoState->audio_ctx = codecCtx;
-      videoState->audio_buf_size = 0;
-      videoState->audio_buf_index = 0;
-      videoState->av_sync_type = DEFAULT_AV_SYNC_TYPE;
-
-      // zero out the block of memory pointed
-      std::memset(&videoState->audio_pkt, 0, sizeof(videoState->audio_pkt));
 
       // init audio pkt queue
       videoState->audioq.init();
+      videoState->audioq.setTimeBase(videoState->audio_st->time_base);
+      videoState->audioq.setBudget(&videoState->queue_budget);
+
+      // start the audio decoder task, its pcm is dropped when there is no audio device
+      if (videoState->headless)
+      {
+        m_audioDecoder = new AudioDecoder();
+        m_audioDecoder->start(videoState);
+        break;
+      }
+
+      // size the pcm ring in time, independently of the sdl callback buffer
+      int bytes_per_sec = codecCtx->sample_rate * codecCtx->ch_layout.nb_channels * 2;
+      int ring_size = (int)((int64_t)bytes_per_sec * videoState->audio_buffer_ms / 1000);
+      ring_size = std::max(ring_size, SDL_AUDIO_BUFFER_SIZE * codecCtx->ch_layout.nb_channels * 2 * 2);
+      if (videoState->audio_ring.init(ring_size) < 0)
+      {
+        std::cerr << "Could not create the pcm ring buffer" << std::endl;
+        return -1;
+      }
+
+      // start the audio decoder task
+      m_audioDecoder = new AudioDecoder();
+      m_audioDecoder->start(videoState);
 
       // start playing audio device
       SDL_PauseAudioDevice(m_deviceID, 0);
@@ -354,6 +1151,8 @@ int VideoReader::streamComponentOpen(VideoState *videoState, int stream_index)
       videoState->videoStream = stream_index;
       videoState->video_st = pFormatCtx->streams[stream_index];
       videoState->video_ctx = codecCtx;
+      videoState->video_width = videoState->video_st->codecpar->width;
+      videoState->video_height = videoState->video_st->codecpar->height;
 
       // !!! Don't forget to init the frame timer
       // previous frame delay: 1ms = 1e-6s
@@ -363,22 +1162,15 @@ int VideoReader::streamComponentOpen(VideoState *videoState, int stream_index)
 
       // init video packet queue
       videoState->videoq.init();
+      videoState->videoq.setTimeBase(videoState->video_st->time_base);
+      videoState->videoq.setBudget(&videoState->queue_budget);
 
-      // start video thread
+      // start the video decoder task
       m_videoDecoder = new VideoDecoder();
       m_videoDecoder->start(videoState);
 
-      // set up the videostate swscontext to convert the image data to yuv420
-      videoState->sws_ctx = sws_getContext(videoState->video_ctx->width
-                                           , videoState->video_ctx->height
-                                           , videoState->video_ctx->pix_fmt
-                                           , videoState->video_ctx->width
-                                           , videoState->video_ctx->height
-                                           , AV_PIX_FMT_YUV420P
-                                           , SWS_BILINEAR
-                                           , nullptr
-                                           , nullptr
-                                           , nullptr);
+      // the swscontext is created by the decoder task once the decoded format is known,
+      // the size may not even be known yet when stream probing was skipped
       // init sdl_surface mutex ref
       videoState->screen_mutex = SDL_CreateMutex();
 
@@ -406,12 +1198,21 @@ void VideoReader::releasePointer()
   }
   m_deviceID = 0;
 
-  SDL_Quit();
-
+  // SDL itself is shared by every session and shut down by the SessionManager
   if (m_packet)
   {
-    m_packet = nullptr;
+    av_packet_free(&m_packet);
+  }
+}
+
+void VideoReader::setActive(bool active)
+{
+  // counted in or out once, the count is shared with the other sessions
+  if (m_videoState->active_sessions && m_active != active)
+  {
+    *m_videoState->active_sessions += active ? 1 : -1;
   }
+  m_active = active;
 }
 
 int VideoReader::decodeInterruptCB(void* videoState)
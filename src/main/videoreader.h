@@ -2,13 +2,19 @@
 #ifndef VIDEO_READER_H_
 #define VIDEO_READER_H_
 
-#include <string>
+#include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <string>
 #include "videostate.h"
 #include "videodecoder.h"
 #include "audiodecoder.h"
 #include "audioresamplingstate.h"
 #include "videorenderer.h"
+#include "headlesssink.h"
+#include "streamrecorder.h"
+#include "preeventbuffer.h"
 #include "options.h"
 
 extern "C"
@@ -25,6 +31,10 @@ extern "C"
 #include <SDL_thread.h>
 }
 
+// Reads one session: opens the input and the decoders, then hands the packets over to them.
+// Runs as a task on the blocking threads of the executor, a bounded batch of packets per run;
+// it returns while the queues are over budget, the decoders notify it once they made room,
+// and waits for the next reconnection attempt on an executor timer.
 class VideoReader
 {
 public:
@@ -32,18 +42,63 @@ public:
   ~VideoReader();
 
   int start(VideoState* videoState, const Options& opt);
+  void stop();
+  void stopAsync();
+  bool stopped() const { return m_stopped != 0; }
   int quitStatus() { return m_videoState->quit; }
+  VideoRenderer* renderer() { return m_videoRenderer; }
+  void triggerEvent();
 
 private:
   VideoDecoder* m_videoDecoder;
-  VideoRenderer* m_videoRenderer;
+  AudioDecoder* m_audioDecoder;
+  std::atomic<VideoRenderer*> m_videoRenderer;
+  HeadlessSink* m_headlessSink;
+  StreamRecorder* m_recorder;
+  PreEventBuffer* m_preEventBuffer;
+  std::atomic<int> m_eventTrigger;
+  int64_t m_eventEnd;
+  int64_t m_postEventDuration;
   VideoState* m_videoState;
   int m_deviceID;
   AVPacket* m_packet;
+  Options m_options;
+  SerialTask m_readTask;
+  int m_opened;
+  int m_eof;
+  int m_reconnectDelay;
+  int64_t m_reconnectStart;
+  int m_waitKeyframe;
+  int m_flushOnKeyframe;
+  int m_keyframeOnly;
+  bool m_active;
+
+  // stopAsync() was called, the tasks still to stop, all of them are
+  int m_stopping;
+  std::atomic<int> m_pendingStops;
+  std::atomic<int> m_stopped;
+  std::mutex m_stopMutex;
+  std::condition_variable m_stopCond;
 
+  int openInput(VideoState *videoState, const Options& opt, AVFormatContext** ppFormatCtx);
+  void loseInput(VideoState *videoState);
+  int reconnect(VideoState *videoState, const Options& opt);
+  int resumeInput(VideoState *videoState, AVFormatContext* pFormatCtx);
+  static bool hasCodecParameters(const AVFormatContext* pFormatCtx);
+  static bool sameStreamParameters(const AVCodecContext* codecCtx, const AVStream* stream);
+  static bool isNetworkInput(const std::string& url);
+  void updateLiveLatency(VideoState *videoState);
+  void recordPacket(VideoState *videoState);
+  void stampCaptureTime(VideoState *videoState);
   int streamComponentOpen(VideoState *videoState, int stream_index);
-  int readThread(void *arg, const Options& opt);
+  void readTask();
+  int openStreams(VideoState *videoState, const Options& opt);
+  int readPackets(VideoState *videoState, const Options& opt);
+  void readStopped();
+  void taskStopped();
+  void countFullQueues(VideoState *videoState);
   void releasePointer();
+  void setActive(bool active);
   static int decodeInterruptCB(void *videoState);
 };
 
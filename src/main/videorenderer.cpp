@@ -2,44 +2,36 @@
 #if (WIN32)
 #include <windows.h>
 #endif
+#include <algorithm>
 #include <iostream>
 #include <thread>
 #include "videorenderer.h"
-
-#define FF_REFRESH_EVENT (SDL_USEREVENT)
-#define FF_QUIT_EVENT    (SDL_USEREVENT + 1)
-
-// av sync correction is done if the clock difference is above the max av sync threshold
-#define AV_SYNC_THRESHOLD 0.01
-
-// no av sync correction is done if the clock difference is below the minimum av sync shreshold
-#define AV_NOSYNC_THRESHOLD 1.0
+#include "tracer.h"
 
 VideoRenderer::VideoRenderer()
   : m_videoState(nullptr)
   , m_screen(nullptr)
+  , m_pictqStarved(0)
+  , m_vsync(1)
+  , m_textureWidth(0)
+  , m_textureHeight(0)
+  , m_lastDisplay(0)
+  , m_titleTime(0)
 {
 }
 
 VideoRenderer::~VideoRenderer()
 {
-  if (m_screen)
-  {
-    SDL_DestroyWindow(m_screen);
-    m_screen = nullptr;
-  }
+  this->stop();
 }
 
-int VideoRenderer::start(VideoState *videoState)
+int VideoRenderer::start(VideoState *videoState, int vsync)
 {
   m_videoState = videoState;
+  m_vsync = vsync;
   if (m_videoState)
   {
-    std::thread([&](VideoRenderer *vr)
-    {
-      vr->displayThread();
-
-    }, this).detach();
+    this->scheduleRefresh(100);
   }
   else
   {
@@ -49,118 +41,116 @@ int VideoRenderer::start(VideoState *videoState)
   return 0;
 }
 
-int VideoRenderer::displayThread()
+void VideoRenderer::stop()
 {
-  SDL_Event event;
-  int ret = -1;
-
-  this->scheduleRefresh(100);
-
-  for (;;)
+  // must be called from the thread running the event loop, like the rendering itself
+  if (m_videoState)
   {
-    double incr = 0, pos = 0;
-    // Wait indefinitely for the next available event
-    ret = SDL_WaitEvent(&event);
-    if (ret == 0)
+    SDL_LockMutex(m_videoState->screen_mutex);
+    if (m_videoState->texture)
     {
-      std::cerr << "SDL_WaitEvent failed : " << SDL_GetError() << std::endl;
+      SDL_DestroyTexture(m_videoState->texture);
+      m_videoState->texture = nullptr;
     }
-
-    // Switch on the retrieved event type
-    switch (event.type)
+    m_textureWidth = 0;
+    m_textureHeight = 0;
+    if (m_videoState->renderer)
     {
-    case SDL_KEYDOWN:
+      SDL_DestroyRenderer(m_videoState->renderer);
+      m_videoState->renderer = nullptr;
+    }
+    SDL_UnlockMutex(m_videoState->screen_mutex);
+  }
+
+  if (m_screen)
+  {
+    SDL_DestroyWindow(m_screen);
+    m_screen = nullptr;
+  }
+  m_videoState = nullptr;
+}
+
+Uint32 VideoRenderer::windowID() const
+{
+  return m_screen ? SDL_GetWindowID(m_screen) : 0;
+}
+
+void VideoRenderer::handleEvent(const SDL_Event& event)
+{
+  double incr = 0, pos = 0;
+
+  if (!m_videoState)
+  {
+    return;
+  }
+
+  // Switch on the retrieved event type
+  switch (event.type)
+  {
+  case SDL_KEYDOWN:
+  {
+    switch (event.key.keysym.sym)
     {
-      switch (event.key.keysym.sym)
+      case SDLK_LEFT:
       {
-        case SDLK_LEFT:
-        {
-          incr = -10.0;
-          goto do_seek;
-        }
-        break;
-
-        case SDLK_RIGHT:
-        {
-          incr = 10.0;
-          goto do_seek;
-        }
-        break;
-
-        case SDLK_DOWN:
-        {
-          incr = -60.0;
-          goto do_seek;
-        }
-        break;
-
-        case SDLK_UP:
-        {
-          incr = 60.0;
-          goto do_seek;
-        }
-        break;
-
-        do_seek:
-        {
-          if (m_videoState)
-          {
-            pos = m_videoState->getMasterClock();
-            pos += incr;
-            m_videoState->streamSeek((int64_t)(pos * AV_TIME_BASE), incr);
-          }
-        }
-        break;
-
-        default:
-        {
-          // nothing
-        }
-        break;
+        incr = -10.0;
+        goto do_seek;
       }
-    }
-    break;
+      break;
 
-    case FF_QUIT_EVENT:
-    case SDL_QUIT:
-    {
-      SDL_CondSignal(m_videoState->audioq.cond);
-      SDL_CondSignal(m_videoState->videoq.cond);
-      m_videoState->quit = 1;
-    }
-    break;
+      case SDLK_RIGHT:
+      {
+        incr = 10.0;
+        goto do_seek;
+      }
+      break;
 
-    case FF_REFRESH_EVENT:
-    {
-      this->videoRefreshTimer();
-    }
-    break;
+      case SDLK_DOWN:
+      {
+        incr = -60.0;
+        goto do_seek;
+      }
+      break;
 
-    default:
-    {
-      // nothing
-    }
-    break;
-    }
+      case SDLK_UP:
+      {
+        incr = 60.0;
+        goto do_seek;
+      }
+      break;
 
-    // Check global quit flag
-    if (m_videoState->quit)
-    {
-      // Exit for loop
+      do_seek:
+      {
+        pos = m_videoState->getMasterClock();
+        pos += incr;
+        m_videoState->streamSeek((int64_t)(pos * AV_TIME_BASE), incr);
+      }
+      break;
+
+      default:
+      {
+        // nothing
+      }
       break;
     }
   }
+  break;
 
-  if (m_screen)
+  case FF_REFRESH_EVENT:
   {
-    SDL_DestroyWindow(m_screen);
-    m_screen = nullptr;
+    if (!m_videoState->quit)
+    {
+      this->videoRefreshTimer();
+    }
   }
+  break;
 
-  m_videoState->quit = 1;
-  m_videoState = nullptr;
-
-  return 0;
+  default:
+  {
+    // nothing
+  }
+  break;
+  }
 }
 
 void VideoRenderer::scheduleRefresh(int delay)
@@ -177,105 +167,44 @@ void VideoRenderer::videoRefreshTimer()
 {
   // We will later see how to property use this
   VideoPicture *videoPicture = nullptr;
-
-  // Used for video frames display delay and audio video sync
-  double pts_delay = 0;
-  double ref_clock = 0;
-  double sync_threshold = 0;
   double real_delay = 0;
-  double audio_video_delay = 0;
-  double diff = 0;
 
   // Check the video stream was correctly opened
-  if (m_videoState->video_st)
+  if (m_videoState->video_width > 0)
   {
     // Check the videopicture queue contains decoded frames
     if (m_videoState->pictq_size == 0)
     {
+      // the decoder is behind, count each time the queue runs dry
+      if (!m_pictqStarved)
+      {
+        m_videoState->pictq_empty_count++;
+        m_pictqStarved = 1;
+      }
       this->scheduleRefresh(1);
     }
     else
     {
-      // Get videopicture reference using the queue read index
-      videoPicture = &m_videoState->pictq[m_videoState->pictq_rindex];
-
-      // Get last frame pts
-      pts_delay = videoPicture->pts - m_videoState->frame_last_pts;
+      m_pictqStarved = 0;
 
-      // If the obtained delay is incorrect
-      if (pts_delay <= 0 || pts_delay >= 1.0)
-      {
-        // Use the previously calculated delay
-        pts_delay = m_videoState->frame_last_delay;
-      }
+      // Skip what is already late when a newer picture is waiting
+      m_videoState->dropLatePictures();
 
-      // Save delay information for the next time
-      m_videoState->frame_last_delay = pts_delay;
-      m_videoState->frame_last_pts = videoPicture->pts;
-
-#if 1
-      // Update delay to sync to audio if not master source
-      if (m_videoState->av_sync_type != SYNC_TYPE::AV_SYNC_VIDEO_MASTER)
-      {
-        ref_clock = m_videoState->getMasterClock();
-        diff = videoPicture->pts - ref_clock;
-
-        // Skip or repeat the frame taking into account the delay
-        sync_threshold = (pts_delay > AV_SYNC_THRESHOLD) ? pts_delay : AV_SYNC_THRESHOLD;
-        //std::cout << "sync threshold : " << sync_threshold << std::endl;
-
-        // Check audio video delay absolute value is below sync threshold
-        if (fabs(audio_video_delay) < AV_NOSYNC_THRESHOLD)
-        {
-          if (audio_video_delay <= -sync_threshold)
-          {
-            pts_delay = 0;
-          }
-          else if (audio_video_delay >= sync_threshold)
-          {
-            pts_delay = 2 * pts_delay;
-          }
-        }
-        //std::cout << "corrected pts delay : " << pts_delay << std::endl;
-      }
-#else
-      sync_threshold = AV_SYNC_THRESHOLD;
-      pts_delay = 0;
-#endif
+      // Get videopicture reference using the queue read index
+      videoPicture = &m_videoState->pictq[m_videoState->pictq_rindex];
 
-      m_videoState->frame_timer += pts_delay;
-      // Compute the real delay
-      real_delay = m_videoState->frame_timer - (av_gettime() / 1000000.0);
-      //std::cout << "real delay : " << real_delay << std::endl;
-      if (real_delay < 0.010)
-      {
-        real_delay = 0.010;
-      }
-      //std::cout << "corrected real delay : " << real_delay << std::endl;
+      // Compute when the next picture is due, synced to the master clock
+      real_delay = m_videoState->computeRefreshDelay(videoPicture);
 
       this->scheduleRefresh((int)(real_delay * 1000 + 0.5));
       //std::cout << "next schedule refresh : " << (int)(real_delay * 1000 + 0.5) << std::endl;
 
       // Show the frame on the sdl_surface
       this->videoDisplay();
+      this->countDisplay(videoPicture);
 
-      // Update read index for the next frame
-      if (++m_videoState->pictq_rindex == VIDEO_PICTURE_QUEUE_SIZE)
-      {
-        m_videoState->pictq_rindex = 0;
-      }
-
-      // Lock videopicture queue mutex
-      SDL_LockMutex(m_videoState->pictq_mutex);
-
-      // Decrease videopicture queue size
-      m_videoState->pictq_size--;
-
-      // Notify other threads waiting for the videoPicture queue
-      SDL_CondSignal(m_videoState->pictq_cond);
-
-      // Unlock videoPicture queue mutex
-      SDL_UnlockMutex(m_videoState->pictq_mutex);
+      // Release the slot for the decoder
+      m_videoState->popPicture();
     }
   }
   else
@@ -297,22 +226,61 @@ Uint32 VideoRenderer::sdlRefreshTimerCB(Uint32 interval, void *param)
   return 0;
 }
 
+void VideoRenderer::countDisplay(const VideoPicture *videoPicture)
+{
+  // the rendered frame rate and its jitter
+  int64_t now = av_gettime_relative();
+  if (m_lastDisplay)
+  {
+    m_videoState->frame_interval_hist.observe(now - m_lastDisplay);
+  }
+  m_lastDisplay = now;
+  m_videoState->frames_rendered.fetch_add(1, std::memory_order_relaxed);
+
+  // how old the picture is now that it is on screen
+  m_videoState->addCaptureLatency(videoPicture->capture_time);
+  if (m_videoState->latency_overlay && m_screen && videoPicture->capture_time > 0 && now - m_titleTime >= 1000000)
+  {
+    // once a second, updating the title is not free
+    m_titleTime = now;
+    std::string title = "RTSP Client - capture to display " + std::to_string(m_videoState->capture_latency_last / 1000) + " ms";
+    SDL_SetWindowTitle(m_screen, title.c_str());
+  }
+}
+
+void VideoRenderer::createWindow()
+{
+  // the source size, shrunk to what the display can show
+  int width = m_videoState->video_width;
+  int height = m_videoState->video_height;
+  SDL_Rect bounds{};
+  if (SDL_GetDisplayUsableBounds(0, &bounds) == 0 && bounds.w > 0 && bounds.h > 0 &&
+      (width > bounds.w || height > bounds.h))
+  {
+    double scale = std::min((double)bounds.w / width, (double)bounds.h / height);
+    width = (int)(width * scale);
+    height = (int)(height * scale);
+  }
+
+  //int flags = SDL_WINDOW_OPENGL | SDL_WINDOW_ALLOW_HIGHDPI | SDL_WINDOW_RESIZABLE | SDL_WINDOW_BORDERLESS | SDL_WINDOW_TOOLTIP;
+  int flags = SDL_WINDOW_OPENGL | SDL_WINDOW_ALLOW_HIGHDPI | SDL_WINDOW_RESIZABLE;
+  m_screen = SDL_CreateWindow(
+    "RTSP Client"
+    , SDL_WINDOWPOS_UNDEFINED
+    , SDL_WINDOWPOS_UNDEFINED
+    , std::max(width, 1)
+    , std::max(height, 1)
+    , flags
+    );
+  SDL_GL_SetSwapInterval(m_vsync);
+}
+
 void VideoRenderer::videoDisplay()
 {
   // Create window, renderer and textures if not already created
   if (!m_screen)
   {
-    //int flags = SDL_WINDOW_OPENGL | SDL_WINDOW_ALLOW_HIGHDPI | SDL_WINDOW_RESIZABLE | SDL_WINDOW_BORDERLESS | SDL_WINDOW_TOOLTIP;
-    int flags = SDL_WINDOW_OPENGL | SDL_WINDOW_ALLOW_HIGHDPI | SDL_WINDOW_RESIZABLE;
-    m_screen = SDL_CreateWindow(
-      "RTSP Client"
-      , SDL_WINDOWPOS_UNDEFINED
-      , SDL_WINDOWPOS_UNDEFINED
-      , m_videoState->video_ctx->width / 2
-      , m_videoState->video_ctx->height / 2
-      , flags
-      );
-    SDL_GL_SetSwapInterval(1);
+    this->createWindow();
   }
 
   // Check window was correctly created
@@ -325,24 +293,15 @@ void VideoRenderer::videoDisplay()
   if (!m_videoState->renderer)
   {
     // Create a 2d rendering context for the sdl_window
-    m_videoState->renderer = SDL_CreateRenderer(
-      m_screen
-      , -1
-      , SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC | SDL_RENDERER_TARGETTEXTURE
-      );
+    // several windows are presented from the one event loop thread, waiting for vsync on each would serialize them
+    Uint32 flags = SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE;
+    if (m_vsync)
+    {
+      flags |= SDL_RENDERER_PRESENTVSYNC;
+    }
+    m_videoState->renderer = SDL_CreateRenderer(m_screen, -1, flags);
   }
 
-  if (!m_videoState->texture)
-  {
-    // Create a texture for a rendering context
-    m_videoState->texture = SDL_CreateTexture(
-      m_videoState->renderer
-      , SDL_PIXELFORMAT_YV12
-      , SDL_TEXTUREACCESS_STREAMING
-      , m_videoState->video_ctx->width
-      , m_videoState->video_ctx->height
-      );
-  }
   // Reference for the next videopicture to be displayed
   VideoPicture *videoPicture = nullptr;
   float aspect_ratio = 0;
@@ -352,6 +311,37 @@ void VideoRenderer::videoDisplay()
   videoPicture = &m_videoState->pictq[m_videoState->pictq_rindex];
   if (videoPicture->frame)
   {
+    AVFrame *frame = videoPicture->frame;
+
+    // (re)create the texture when the picture size changes, i.e. the window was resized with --downscale
+    if (!m_videoState->texture || m_textureWidth != frame->width || m_textureHeight != frame->height)
+    {
+      SDL_LockMutex(m_videoState->screen_mutex);
+      if (m_videoState->texture)
+      {
+        SDL_DestroyTexture(m_videoState->texture);
+      }
+      // Create a texture for a rendering context
+      m_videoState->texture = SDL_CreateTexture(
+        m_videoState->renderer
+        , SDL_PIXELFORMAT_YV12
+        , SDL_TEXTUREACCESS_STREAMING
+        , frame->width
+        , frame->height
+        );
+      SDL_UnlockMutex(m_videoState->screen_mutex);
+      if (!m_videoState->texture)
+      {
+        std::cerr << "SDL : could not create texture : " << SDL_GetError() << std::endl;
+        m_textureWidth = 0;
+        m_textureHeight = 0;
+        return;
+      }
+      m_textureWidth = frame->width;
+      m_textureHeight = frame->height;
+    }
+
+    // the aspect ratio of the source, whatever size the picture was converted to
     if (m_videoState->video_ctx->sample_aspect_ratio.num == 0)
     {
       aspect_ratio = 0;
@@ -368,10 +358,10 @@ void VideoRenderer::videoDisplay()
         / (float)m_videoState->video_ctx->height;
     }
 
-    // Get the size of a window's client area
+    // Get the size of the rendering target in pixels (larger than the window in high dpi)
     int screen_width = -1;
     int screen_height = -1;
-    SDL_GetWindowSize(m_screen, &screen_width, &screen_height);
+    SDL_GetRendererOutputSize(m_videoState->renderer, &screen_width, &screen_height);
 
     // Global sdl_surface height
     h = screen_height;
@@ -389,41 +379,51 @@ void VideoRenderer::videoDisplay()
       h = ((int) rint(w / aspect_ratio)) & -3;
     }
 
-    x = (screen_width - w);
-    y = (screen_height - h);
+    // center the picture, black bars around it
+    x = (screen_width - w) / 2;
+    y = (screen_height - h) / 2;
+
+    // the decoder side converts the next pictures to this size
+    m_videoState->target_width = w;
+    m_videoState->target_height = h;
 
-    // Check the number of frames to decode was not exceeded
     {
       // Set blit area x and y coordinates, width and height
       SDL_Rect rect{0};
       rect.x = x;
       rect.y = y;
-      rect.w = 2 * w;
-      rect.h = 2 * h;
+      rect.w = w;
+      rect.h = h;
 
       // Lock screen mutex
       SDL_LockMutex(m_videoState->screen_mutex);
 
-      // Update the texture with the new pixel data
-      SDL_UpdateYUVTexture(
-        m_videoState->texture
-        , &rect
-        , videoPicture->frame->data[0]
-        , videoPicture->frame->linesize[0]
-        , videoPicture->frame->data[1]
-        , videoPicture->frame->linesize[1]
-        , videoPicture->frame->data[2]
-        , videoPicture->frame->linesize[2]
-        );
+      // Update the whole texture with the new pixel data
+      {
+        TRACE_SCOPE("SDL_UpdateYUVTexture");
+        SDL_UpdateYUVTexture(
+          m_videoState->texture
+          , nullptr
+          , frame->data[0]
+          , frame->linesize[0]
+          , frame->data[1]
+          , frame->linesize[1]
+          , frame->data[2]
+          , frame->linesize[2]
+          );
+      }
 
       // Clear the current rendering target with the drawing color
       SDL_RenderClear(m_videoState->renderer);
 
-      // Copy a portion of the texture to the current rendering target
-      SDL_RenderCopy(m_videoState->renderer, m_videoState->texture, &rect, nullptr);
+      // Copy the texture into the blit area of the current rendering target
+      SDL_RenderCopy(m_videoState->renderer, m_videoState->texture, nullptr, &rect);
 
       // Update the screen with any rendering performed since the previous call
-      SDL_RenderPresent(m_videoState->renderer);
+      {
+        TRACE_SCOPE("SDL_RenderPresent");
+        SDL_RenderPresent(m_videoState->renderer);
+      }
 
       // Unlock screen mutex
       SDL_UnlockMutex(m_videoState->screen_mutex);
@@ -4,23 +4,39 @@
 
 #include "videostate.h"
 
+#define FF_REFRESH_EVENT (SDL_USEREVENT)
+#define FF_QUIT_EVENT    (SDL_USEREVENT + 1)
+
+// Renders one session into its own window.
+// SDL events are not polled here, the SessionManager runs the one event loop
+// of the process on the main thread and hands each renderer its own events.
 class VideoRenderer
 {
 public:
   explicit VideoRenderer();
   ~VideoRenderer();
 
-  int start(VideoState *videoState);
+  int start(VideoState *videoState, int vsync);
+  void stop();
+  void handleEvent(const SDL_Event& event);
+  Uint32 windowID() const;
 
 private:
   VideoState* m_videoState;
   SDL_Window* m_screen;
+  int m_pictqStarved;
+  int m_vsync;
+  int m_textureWidth;
+  int m_textureHeight;
+  int64_t m_lastDisplay;
+  int64_t m_titleTime;
 
-  int displayThread();
   void scheduleRefresh(int delay);
   void videoRefreshTimer();
   static Uint32 sdlRefreshTimerCB(Uint32 interval, void *param);
+  void createWindow();
   void videoDisplay();
+  void countDisplay(const VideoPicture *videoPicture);
 };
 
 #endif // VIDEO_RENDERER_H_
@@ -1,42 +1,96 @@
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include "videostate.h"
+#include "tracer.h"
+
+// av sync correction is done if the clock difference is above the max av sync threshold
+#define AV_SYNC_THRESHOLD 0.01
+
+// no av sync correction is done if the clock difference is below the minimum av sync shreshold
+#define AV_NOSYNC_THRESHOLD 1.0
 
 VideoState::VideoState()
   : pFormatCtx(nullptr)
+  , executor(nullptr)
   , audioStream(-1)
   , audio_st(nullptr)
   , audio_ctx(nullptr)
-  , audio_buf_size(0)
-  , audio_buf_index(0)
-  , audio_pkt_data(nullptr)
-  , audio_pkt_size(0)
+  , audio_buffer_ms(0)
   , audio_clock(0)
-  , audio_diff_cum(0)
-  , audio_diff_avg_coef(0)
-  , audio_diff_threshold(0)
-  , audio_diff_avg_count(0)
   , videoStream(-1)
   , video_st(nullptr)
+  , video_width(0)
+  , video_height(0)
   , video_ctx(nullptr)
-  , video_clock(0)
-  , video_current_pts(0)
-  , video_current_pts_time(0)
   , texture(nullptr)
   , renderer(nullptr)
   , sws_ctx(nullptr)
   , frame_timer(0)
   , frame_last_pts(0)
   , frame_last_delay(0)
-  , quit(0)
+  , video_clock(0)
+  , video_current_pts(0)
+  , video_current_pts_time(0)
+  , audio_diff_cum(0)
+  , audio_diff_avg_coef(0)
+  , audio_diff_threshold(0)
+  , audio_diff_avg_count(0)
+  , av_sync_type(DEFAULT_AV_SYNC_TYPE)
+  , screen_mutex(SDL_CreateMutex())
+  , pictq_capacity(0)
   , pictq_size(0)
   , pictq_rindex(0)
   , pictq_windex(0)
-  , pictq_cond(SDL_CreateCond())
   , pictq_mutex(SDL_CreateMutex())
-  , screen_mutex(SDL_CreateMutex())
+  , picture_producer(nullptr)
+  , picture_consumer(nullptr)
+  , pictq_size_max(0)
+  , pictq_full_count(0)
+  , pictq_empty_count(0)
   , output_audio_device_index(0)
-  , av_sync_type(DEFAULT_AV_SYNC_TYPE)
+  , quit(0)
+  , session_start_time(0)
+  , first_frame_time(-1)
+  , reconnect_count(0)
+  , recovery_time_last(0)
+  , recovery_time_max(0)
+  , audio_disabled(0)
+  , headless(0)
+  , late_drop_threshold(0)
+  , decoder_drop_count(0)
+  , renderer_drop_count(0)
+  , decoder_threads(0)
+  , decoder_thread_type(0)
+  , decode_latency_max(0)
+  , decode_latency_sum(0)
+  , decode_latency_count(0)
+  , thread_budget(0)
+  , active_sessions(nullptr)
+  , downscale(0)
+  , target_width(0)
+  , target_height(0)
+  , video_frames_decoded(0)
+  , audio_frames_decoded(0)
+  , video_decode_errors(0)
+  , audio_decode_errors(0)
+  , frames_rendered(0)
+  , capture_latency_last(0)
+  , latency_overlay(0)
+  , keyframe_only(0)
+  , record_segments(0)
+  , record_packets(0)
+  , record_drops(0)
+  , live(0)
+  , latency_target(0)
+  , latency_cap(0)
+  , live_latency(0)
+  , live_catchup(0)
+  , live_flush_count(0)
+  , video_skip_to_flush(0)
+  , audio_skip_to_flush(0)
 {
   flush_pkt = av_packet_alloc();
   flush_pkt->data = (uint8_t*)"FLUSH";
@@ -67,6 +121,12 @@ VideoState::~VideoState()
     video_ctx = nullptr;
   }
 
+  if (sws_ctx)
+  {
+    sws_freeContext(sws_ctx);
+    sws_ctx = nullptr;
+  }
+
   if (texture)
   {
     SDL_DestroyTexture(texture);
@@ -79,77 +139,204 @@ VideoState::~VideoState()
   }
 }
 
-void VideoState::allocPicture()
+int VideoState::initPictureQueue(int size)
 {
-  VideoPicture *videoPicture = nullptr;
-  videoPicture = &pictq[pictq_windex];
+  if (size < 1 || size > VIDEO_PICTURE_QUEUE_SIZE_MAX)
+  {
+    std::cerr << "Invalid picture queue size " << size << std::endl;
+    return -1;
+  }
 
-  // check if the sdl_overlay is allocated
-  if (videoPicture->frame)
+  // pre-allocate the frames of every slot, the image buffers follow the stream size later
+  pictq.reset(new VideoPicture[size]);
+  for (int i = 0; i < size; i++)
   {
-    // we already have an avframe allocated, free memory
-    av_frame_free(&videoPicture->frame);
-    av_free(videoPicture->frame);
+    pictq[i].frame = av_frame_alloc();
+    if (!pictq[i].frame)
+    {
+      return -1;
+    }
   }
+  pictq_capacity = size;
+  pictq_size = 0;
+  pictq_rindex = 0;
+  pictq_windex = 0;
+  pictq_size_max = 0;
+  pictq_full_count = 0;
+  pictq_empty_count = 0;
 
-  // lock global screen mutex
-  SDL_LockMutex(screen_mutex);
+  return 0;
+}
 
-  // get the size in bytes required to store an image with the given parameters
-  int numBytes = 0;
-  numBytes = av_image_get_buffer_size(
-    AV_PIX_FMT_YUV420P
-    , video_ctx->width
-    , video_ctx->height
-    , 32
-    );
+void VideoState::abort()
+{
+  quit = 1;
 
-  // allocate image data buffer
-  uint8_t *buffer = nullptr;
-  buffer = (uint8_t*)av_malloc(numBytes * sizeof(uint8_t));
+  // wake up every task of this session that may be waiting
+  videoq.abort();
+  audioq.abort();
+  audio_ring.wakeUp();
+  queue_budget.wakeUp();
+}
 
-  // alloc the avframe later used to contain the scaled frame
-  videoPicture->frame = av_frame_alloc();
-  if (videoPicture->frame == nullptr)
+bool VideoState::queuesFull()
+{
+  // the reader never waits in put(), a ring without room for the next packet parks it too
+  if (videoq.full(READER_QUEUE_SLOTS) || audioq.full(READER_QUEUE_SLOTS))
   {
+    return true;
+  }
+
+  // audio and video cover the same span of time, the longer queue counts
+  int64_t bytes = (int64_t)videoq.size + audioq.size;
+  int64_t duration = std::max(videoq.duration.load(), audioq.duration.load());
+  return queue_budget.exceeded(bytes, duration);
+}
 
+int64_t VideoState::bufferedLatency()
+{
+  // packets not decoded yet plus pictures not displayed yet, the reader calls this
+  SDL_LockMutex(pictq_mutex);
+  int pictures = pictq_size;
+  SDL_UnlockMutex(pictq_mutex);
+  int64_t video = videoq.duration + (int64_t)(pictures * frame_last_delay * AV_TIME_BASE);
+
+  // packets not decoded yet plus pcm not played yet
+  int64_t audio = audioq.duration;
+  if (audio_ctx && audio_ctx->sample_rate > 0)
+  {
+    int64_t bytes_per_sec = (int64_t)audio_ctx->sample_rate * 2 * audio_ctx->ch_layout.nb_channels;
+    audio += (int64_t)audio_ring.size() * AV_TIME_BASE / bytes_per_sec;
+  }
+
+  return std::max(video, audio);
+}
+
+bool VideoState::isLate(double pts)
+{
+  // the video clock follows the pictures, they cannot be late on it; headless, nothing paces
+  // the audio clock, which runs ahead of the decoded video
+  if (late_drop_threshold <= 0 || av_sync_type == SYNC_TYPE::AV_SYNC_VIDEO_MASTER || headless)
+  {
+    return false;
+  }
+
+  // beyond the no sync threshold the clocks are unrelated (timestamp jump), keep the picture
+  double diff = pts - this->getMasterClock();
+  return diff < -late_drop_threshold && diff > -AV_NOSYNC_THRESHOLD;
+}
+
+void VideoState::dropLatePictures()
+{
+  // the last queued picture is always shown, even if late
+  while (pictq_size > 1 && this->isLate(pictq[pictq_rindex].pts))
+  {
+    renderer_drop_count++;
+    this->popPicture();
+  }
+}
+
+void VideoState::pictureSize(const AVFrame *pFrame, int *width, int *height)
+{
+  *width = pFrame->width;
+  *height = pFrame->height;
+  int target_w = target_width;
+  int target_h = target_height;
+  if (!downscale || target_w <= 0 || target_h <= 0)
+  {
     return;
   }
 
-  // the fields of the given image are filled in by using the buffer which points to the image data buffer
-  av_image_fill_arrays(
-    videoPicture->frame->data
-    , videoPicture->frame->linesize
-    , buffer
-    , AV_PIX_FMT_YUV420P
-    , video_ctx->width
-    , video_ctx->height
-    , 32
-    );
+  // in steps of 1/16 of the source so that resizing a window does not reallocate every frame
+  double scale = std::max((double)target_w / pFrame->width, (double)target_h / pFrame->height);
+  int steps = std::max(1, (int)std::ceil(scale * 16));
+  if (steps < 16)
+  {
+    // the chroma planes want even sizes
+    *width = FFALIGN(pFrame->width * steps / 16, 2);
+    *height = FFALIGN(pFrame->height * steps / 16, 2);
+  }
+}
+
+void VideoState::allocPicture(int width, int height)
+{
+  VideoPicture *videoPicture = nullptr;
+  videoPicture = &pictq[pictq_windex];
+
+  // alloc the avframe later used to contain the scaled frame
+  if (!videoPicture->frame)
+  {
+    videoPicture->frame = av_frame_alloc();
+    if (videoPicture->frame == nullptr)
+    {
+      return;
+    }
+  }
+
+  // release whatever the slot still references (old buffer or a decoded frame)
+  av_frame_unref(videoPicture->frame);
+
+  // lock global screen mutex
+  SDL_LockMutex(screen_mutex);
+
+  // borrow an image buffer from the pool, av_frame_unref gives it back
+  videoPicture->frame->format = AV_PIX_FMT_YUV420P;
+  videoPicture->frame->width = width;
+  videoPicture->frame->height = height;
+  int ret = frame_pool.getBuffer(videoPicture->frame);
 
   // unlock mutex
   SDL_UnlockMutex(screen_mutex);
 
+  if (ret < 0)
+  {
+    std::cerr << "Could not allocate the picture buffer" << std::endl;
+    return;
+  }
+
   // update videoPicture struct fields
-  videoPicture->width = video_ctx->width;
-  videoPicture->height = video_ctx->height;
+  videoPicture->width = width;
+  videoPicture->height = height;
   videoPicture->allocated = 1;
 }
 
+void VideoState::addCaptureLatency(int64_t capture_time)
+{
+  if (capture_time <= 0)
+  {
+    return;
+  }
+
+  // a camera clock ahead of ours would give negative latencies, they are not counted
+  int64_t latency = av_gettime() - capture_time;
+  capture_latency_last = latency;
+  if (latency >= 0)
+  {
+    capture_latency_hist.observe(latency);
+  }
+}
+
 int VideoState::queuePicture(AVFrame *pFrame, double pts)
 {
   // lock videostate pictq mutex
   SDL_LockMutex(pictq_mutex);
 
-  // wait until we have space for a new picture in pictq
-  while (pictq_size >= VIDEO_PICTURE_QUEUE_SIZE && !quit)
+  // the decoder does not wait for space in pictq, it keeps the frame until popPicture() notifies it
+  int full = pictq_size >= pictq_capacity;
+  if (full)
   {
-    SDL_CondWait(pictq_cond, pictq_mutex);
+    // the renderer is behind, count how often decoding had to stall
+    pictq_full_count++;
   }
 
   // unlock pictq mutex
   SDL_UnlockMutex(pictq_mutex);
 
+  if (full)
+  {
+    return AVERROR(EAGAIN);
+  }
+
   // check global quit flag
   if (quit)
   {
@@ -159,29 +346,63 @@ int VideoState::queuePicture(AVFrame *pFrame, double pts)
   VideoPicture *videoPicture;
   videoPicture = &pictq[pictq_windex];
 
-  // if the videopicture sdl_overlay is not allocated or has a different width, height
-  if (!videoPicture->frame ||
-      videoPicture->width != video_ctx->width ||
-      videoPicture->height != video_ctx->height)
-  {
-    // set sdl_overlay not allocated
-    videoPicture->allocated = 0;
-
-    // allocate a new sdl_overlay for the videoPicture struct
-    this->allocPicture();
+  // the size the picture is displayed at, or the decoded size
+  int width = 0;
+  int height = 0;
+  this->pictureSize(pFrame, &width, &height);
 
-    // check global quit flag
-    if (quit)
+  if (pFrame->format == AV_PIX_FMT_YUV420P &&
+      pFrame->width == width &&
+      pFrame->height == height)
+  {
+    // the decoder output is already what the texture wants, keep a reference instead of converting
+    if (!videoPicture->frame)
+    {
+      videoPicture->frame = av_frame_alloc();
+      if (!videoPicture->frame)
+      {
+        return -1;
+      }
+    }
+    av_frame_unref(videoPicture->frame);
+    if (av_frame_ref(videoPicture->frame, pFrame) < 0)
     {
       return -1;
     }
-  }
 
-  // check the new sdl_overlay was correctly allocated
-  if (videoPicture->frame)
+    // the slot no longer holds a conversion buffer
+    videoPicture->allocated = 0;
+    videoPicture->width = pFrame->width;
+    videoPicture->height = pFrame->height;
+    if (bench_stats)
+    {
+      bench_stats->addPassthrough();
+    }
+  }
+  else
   {
-    // so now we've got pictures lining up onto our picture queue with proper PTS values
-    videoPicture->pts = pts;
+    // if the videopicture buffer is not allocated or has a different width, height,
+    // or is still referenced elsewhere (i.e. a mosaic tile) and must not be overwritten
+    if (!videoPicture->allocated ||
+        videoPicture->width != width ||
+        videoPicture->height != height ||
+        !av_frame_is_writable(videoPicture->frame))
+    {
+      // allocate a new buffer for the videoPicture struct
+      this->allocPicture(width, height);
+
+      // check global quit flag
+      if (quit)
+      {
+        return -1;
+      }
+    }
+
+    // check the new buffer was correctly allocated
+    if (!videoPicture->allocated)
+    {
+      return 0;
+    }
 
     // set videopicture avframe info using the last decoded frame
     videoPicture->frame->pict_type = pFrame->pict_type;
@@ -189,42 +410,205 @@ int VideoState::queuePicture(AVFrame *pFrame, double pts)
     videoPicture->frame->pkt_dts = pFrame->pkt_dts;
     videoPicture->frame->key_frame = pFrame->key_frame;
     videoPicture->frame->best_effort_timestamp = pFrame->best_effort_timestamp;
-    videoPicture->frame->width = pFrame->width;
-    videoPicture->frame->height = pFrame->height;
-
-    // scale the image in pFrame->data and put the resulting scaled image in pict->data
-    sws_scale(
-      sws_ctx
-      , (uint8_t const* const*)pFrame->data
-      , pFrame->linesize
-      , 0
-      , video_ctx->height
-      , videoPicture->frame->data
-      , videoPicture->frame->linesize
-      );
-
-    // update videopicture queue write index
-    pictq_windex++;
-
-    // if the write index has reached the videopicture queue size
-    if (pictq_windex == VIDEO_PICTURE_QUEUE_SIZE)
+    videoPicture->frame->sample_aspect_ratio = pFrame->sample_aspect_ratio;
+
+    // shrinking to the display size does not need the better filter
+    int sws_flags = width < pFrame->width ? SWS_FAST_BILINEAR : SWS_BILINEAR;
+
+    TRACE_SCOPE("sws_scale");
+    int64_t scale_start = av_gettime_relative();
+    if (slice_scaler.bands() > 1)
+    {
+      // horizontal bands converted in parallel, same output as a single sws_scale
+      if (slice_scaler.scale(pFrame, videoPicture->frame, sws_flags) < 0)
+      {
+        std::cerr << "Could not convert the picture" << std::endl;
+        return -1;
+      }
+    }
+    else
+    {
+      // the decoded format is only known for sure once the first frame is out
+      sws_ctx = sws_getCachedContext(
+        sws_ctx
+        , pFrame->width
+        , pFrame->height
+        , (AVPixelFormat)pFrame->format
+        , width
+        , height
+        , AV_PIX_FMT_YUV420P
+        , sws_flags
+        , nullptr
+        , nullptr
+        , nullptr);
+      if (!sws_ctx)
+      {
+        std::cerr << "Could not create the scaling context" << std::endl;
+        return -1;
+      }
+
+      // scale the image in pFrame->data and put the resulting scaled image in pict->data
+      sws_scale(
+        sws_ctx
+        , (uint8_t const* const*)pFrame->data
+        , pFrame->linesize
+        , 0
+        , pFrame->height
+        , videoPicture->frame->data
+        , videoPicture->frame->linesize
+        );
+    }
+    if (bench_stats)
     {
-      pictq_windex = 0;
+      bench_stats->addScale(av_gettime_relative() - scale_start);
     }
+  }
 
-    // lock videopicture queue
-    SDL_LockMutex(pictq_mutex);
+  // so now we've got pictures lining up onto our picture queue with proper PTS values
+  videoPicture->pts = pts;
 
-    // increase videopictq queue size
-    pictq_size++;
+  // camera wall clock stamped by the reader, carried by the decoder
+  videoPicture->capture_time = 0;
+  if (pFrame->opaque_ref && pFrame->opaque_ref->size >= sizeof(int64_t))
+  {
+    memcpy(&videoPicture->capture_time, pFrame->opaque_ref->data, sizeof(int64_t));
+  }
 
-    // unlock videopicture queue
-    SDL_UnlockMutex(pictq_mutex);
+  // update videopicture queue write index
+  pictq_windex++;
+
+  // if the write index has reached the videopicture queue size
+  if (pictq_windex == pictq_capacity)
+  {
+    pictq_windex = 0;
+  }
+
+  // lock videopicture queue
+  SDL_LockMutex(pictq_mutex);
+
+  // increase videopictq queue size
+  pictq_size++;
+  if (pictq_size > pictq_size_max)
+  {
+    pictq_size_max = pictq_size;
+  }
+
+  // unlock videopicture queue
+  SDL_UnlockMutex(pictq_mutex);
+
+  // run the consumer waiting for a picture (the headless sink)
+  if (picture_consumer)
+  {
+    picture_consumer->notify();
+  }
+
+  // time to first picture, from the start of the session
+  if (first_frame_time < 0 && session_start_time > 0)
+  {
+    first_frame_time = (av_gettime_relative() - session_start_time) / 1000;
+    std::cerr << "First picture of " << filename << " after " << first_frame_time << " ms" << std::endl;
   }
 
   return 0;
 }
 
+double VideoState::computeRefreshDelay(const VideoPicture *videoPicture)
+{
+  // Used for video frames display delay and audio video sync
+  double pts_delay = 0;
+  double ref_clock = 0;
+  double sync_threshold = 0;
+  double real_delay = 0;
+  double diff = 0;
+
+  // Get last frame pts
+  pts_delay = videoPicture->pts - frame_last_pts;
+
+  // If the obtained delay is incorrect
+  if (pts_delay <= 0 || pts_delay >= 1.0)
+  {
+    // Use the previously calculated delay
+    pts_delay = frame_last_delay;
+  }
+
+  // Save delay information for the next time
+  frame_last_delay = pts_delay;
+  frame_last_pts = videoPicture->pts;
+
+  // live catch-up: show the pictures slightly faster than they were captured
+  if (live_catchup)
+  {
+    pts_delay = pts_delay * 100 / (100 + LIVE_CATCHUP_SPEED_PERCENT);
+  }
+
+#if 1
+  // Update delay to sync to audio if not master source
+  if (av_sync_type != SYNC_TYPE::AV_SYNC_VIDEO_MASTER)
+  {
+    ref_clock = this->getMasterClock();
+    diff = videoPicture->pts - ref_clock;
+
+    // Skip or repeat the frame taking into account the delay
+    sync_threshold = (pts_delay > AV_SYNC_THRESHOLD) ? pts_delay : AV_SYNC_THRESHOLD;
+    //std::cout << "sync threshold : " << sync_threshold << std::endl;
+
+    // Check audio video delay absolute value is below sync threshold
+    if (fabs(diff) < AV_NOSYNC_THRESHOLD)
+    {
+      if (diff <= -sync_threshold)
+      {
+        pts_delay = 0;
+      }
+      else if (diff >= sync_threshold)
+      {
+        pts_delay = 2 * pts_delay;
+      }
+    }
+    //std::cout << "corrected pts delay : " << pts_delay << std::endl;
+  }
+#else
+  sync_threshold = AV_SYNC_THRESHOLD;
+  pts_delay = 0;
+#endif
+
+  frame_timer += pts_delay;
+  // Compute the real delay
+  real_delay = frame_timer - (av_gettime() / 1000000.0);
+  //std::cout << "real delay : " << real_delay << std::endl;
+  if (real_delay < 0.010)
+  {
+    real_delay = 0.010;
+  }
+  //std::cout << "corrected real delay : " << real_delay << std::endl;
+
+  return real_delay;
+}
+
+void VideoState::popPicture()
+{
+  // Update read index for the next frame
+  if (++pictq_rindex == pictq_capacity)
+  {
+    pictq_rindex = 0;
+  }
+
+  // Lock videopicture queue mutex
+  SDL_LockMutex(pictq_mutex);
+
+  // Decrease videopicture queue size, the decoder only waits on a full queue
+  int wasFull = pictq_size == pictq_capacity;
+  pictq_size--;
+
+  // Unlock videoPicture queue mutex
+  SDL_UnlockMutex(pictq_mutex);
+
+  // Run the decoder again, it kept its picture for this slot
+  if (wasFull && picture_producer)
+  {
+    picture_producer->notify();
+  }
+}
+
 double VideoState::getMasterClock()
 {
   if (av_sync_type == SYNC_TYPE::AV_SYNC_VIDEO_MASTER)
@@ -255,12 +639,13 @@ double VideoState::getVideoClock()
 double VideoState::getAudioClock()
 {
   double pts = audio_clock;
-  int hw_buf_size = audio_buf_size - audio_buf_index;
+  // pcm decoded but not yet consumed by the audio callback
+  int hw_buf_size = (int)audio_ring.size();
   int bytes_per_sec = 0;
-  int n = 2 * audio_ctx->ch_layout.nb_channels;
 
-  if (audio_st)
+  if (audio_ctx)
   {
+    int n = 2 * audio_ctx->ch_layout.nb_channels;
     bytes_per_sec = audio_ctx->sample_rate * n;
   }
 
@@ -2,10 +2,19 @@
 #ifndef VIDEO_STATE_H_
 #define VIDEO_STATE_H_
 
+#include <atomic>
 #include <string>
 #include <memory>
 #include "packetqueue.h"
+#include "queuebudget.h"
 #include "videopicture.h"
+#include "audioresamplingstate.h"
+#include "pcmringbuffer.h"
+#include "benchstats.h"
+#include "executor.h"
+#include "slicescaler.h"
+#include "framepool.h"
+#include "metrics.h"
 
 extern "C"
 {
@@ -23,7 +32,16 @@ extern "C"
 #define SDL_AUDIO_BUFFER_SIZE 1024
 #define MAX_AUDIO_FRAME_SIZE 192000
 
+// default and upper bound of the video picture queue depth
 #define VIDEO_PICTURE_QUEUE_SIZE 1
+#define VIDEO_PICTURE_QUEUE_SIZE_MAX 16
+
+// live mode catch-up: playback speed-up, and the latency (percent of the target) where it ends
+#define LIVE_CATCHUP_SPEED_PERCENT 5
+#define LIVE_CATCHUP_EXIT_PERCENT 80
+
+// ring slots the reader needs for one packet read: the packet and a flush packet
+#define READER_QUEUE_SLOTS 2
 
 #define DEFAULT_AV_SYNC_TYPE SYNC_TYPE::AV_SYNC_AUDIO_MASTER
 
@@ -43,7 +61,16 @@ public:
   explicit VideoState();
   ~VideoState();
 
+  int initPictureQueue(int size);
+  void abort();
+  bool queuesFull();
+  int64_t bufferedLatency();
+  bool isLate(double pts);
+  void dropLatePictures();
   int queuePicture(AVFrame *pFrame, double pts);
+  void addCaptureLatency(int64_t capture_time);
+  double computeRefreshDelay(const VideoPicture *videoPicture);
+  void popPicture();
 
   double getMasterClock();
   double getVideoClock();
@@ -53,31 +80,43 @@ public:
 
   AVFormatContext *pFormatCtx;
 
+  // threads of every session, owned by the session manager
+  Executor *executor;
+
+  // budget shared by the packet queues, must outlive them
+  QueueBudget queue_budget;
+
+  // buffers of the converted pictures, must outlive the picture queue
+  FramePool frame_pool;
+
   // audio
   int audioStream;
   AVStream* audio_st;
   AVCodecContext* audio_ctx;
   PacketQueue audioq;
   uint8_t audio_buf[(MAX_AUDIO_FRAME_SIZE * 3) /2];
-  unsigned int audio_buf_size;
-  unsigned int audio_buf_index;
-  AVFrame audio_frame;
-  AVPacket audio_pkt;
-  uint8_t* audio_pkt_data;
-  int audio_pkt_size;
+  PcmRingBuffer audio_ring;
+  int audio_buffer_ms;
   double audio_clock;
+  AudioReSamplingState audio_resampler;
 
   // video
   int videoStream;
   AVStream* video_st;
+  // size of the video stream, copied when it is opened (0 until then): the renderers run on
+  // the main thread and must not touch video_st, the reader replaces it on reconnection
+  std::atomic<int> video_width;
+  std::atomic<int> video_height;
   AVCodecContext* video_ctx;
   SDL_Texture* texture;
   SDL_Renderer* renderer;
   PacketQueue videoq;
   struct SwsContext *sws_ctx;
+  SliceScaler slice_scaler;
   double frame_timer;
   double frame_last_pts;
-  double frame_last_delay;
+  // written by the renderer, read by the reader in live mode
+  std::atomic<double> frame_last_delay;
   double video_clock;
   double video_current_pts;
   int64_t video_current_pts_time;
@@ -100,12 +139,22 @@ public:
   SDL_mutex* screen_mutex;
 
   // video picture queue
-  VideoPicture pictq[VIDEO_PICTURE_QUEUE_SIZE];
+  std::unique_ptr<VideoPicture[]> pictq;
+  int pictq_capacity;
   int pictq_size;
   int pictq_rindex;
   int pictq_windex;
   SDL_mutex* pictq_mutex;
-  SDL_cond* pictq_cond;
+
+  // tasks notified by the picture queue: the decoder when a slot is free again,
+  // the headless sink when a picture comes in (the renderers poll it on a timer)
+  SerialTask* picture_producer;
+  SerialTask* picture_consumer;
+
+  // video picture queue occupancy counters
+  int pictq_size_max;
+  std::atomic<uint64_t> pictq_full_count;
+  std::atomic<uint64_t> pictq_empty_count;
 
   // file name
   std::string filename;
@@ -114,13 +163,92 @@ public:
   int output_audio_device_index;
 
   // quit flag
-  int quit;
+  std::atomic<int> quit;
+
+  // start of the session and delay until its first decoded picture (ms, -1 until then)
+  int64_t session_start_time;
+  std::atomic<int64_t> first_frame_time;
+
+  // reconnections after the input was lost, recovery times in ms
+  std::atomic<int> reconnect_count;
+  std::atomic<int64_t> recovery_time_last;
+  std::atomic<int64_t> recovery_time_max;
+
+  // audio is left alone when another session owns the audio device
+  int audio_disabled;
+
+  // headless mode: no window, no audio device, decoded data is dropped
+  int headless;
+  std::unique_ptr<BenchStats> bench_stats;
+
+  // pictures behind the master clock by more than this (seconds, 0 to keep them all) are dropped
+  double late_drop_threshold;
+  std::atomic<uint64_t> decoder_drop_count;
+  std::atomic<uint64_t> renderer_drop_count;
+
+  // video decoder threading (0 for the libavcodec defaults), and the time from
+  // sending a packet to receiving its picture, in us
+  int decoder_threads;
+  int decoder_thread_type;
+  std::atomic<int64_t> decode_latency_max;
+  std::atomic<int64_t> decode_latency_sum;
+  std::atomic<int64_t> decode_latency_count;
+
+  // --thread-budget: cores split between the video decoders of the active sessions when each
+  // decoder opens; the count belongs to the session manager, the readers count themselves in
+  // while running and out while waiting to reconnect
+  int thread_budget;
+  std::atomic<int> *active_sessions;
+
+  // pictures are converted to the size the renderer displays them at (pixels, 0 until known)
+  int downscale;
+  std::atomic<int> target_width;
+  std::atomic<int> target_height;
+
+  // exported metrics: decoded frames and errors, pictures shown, and how long
+  // decoding and the interval between two displayed pictures take (us)
+  std::atomic<uint64_t> video_frames_decoded;
+  std::atomic<uint64_t> audio_frames_decoded;
+  std::atomic<uint64_t> video_decode_errors;
+  std::atomic<uint64_t> audio_decode_errors;
+  std::atomic<uint64_t> frames_rendered;
+  MetricHistogram decode_latency_hist;
+  MetricHistogram frame_interval_hist;
+
+  // glass to glass: from the camera capture to the display of a picture (us), needs rtcp
+  // sender reports and the camera and this machine synchronised to the same clock (ntp)
+  MetricHistogram capture_latency_hist;
+  std::atomic<int64_t> capture_latency_last;
+  int latency_overlay;
+
+  // only keyframes are decoded (thumbnail walls), switched at any time
+  std::atomic<int> keyframe_only;
+
+  // recording: base file name, files written, packets written and dropped
+  std::string record_path;
+  std::atomic<int> record_segments;
+  std::atomic<uint64_t> record_packets;
+  std::atomic<uint64_t> record_drops;
+
+  // live mode: received but not yet presented media is kept around latency_target,
+  // above latency_cap the backlog is dropped (AV_TIME_BASE units)
+  int live;
+  int64_t latency_target;
+  int64_t latency_cap;
+  std::atomic<int64_t> live_latency;
+  std::atomic<int> live_catchup;
+  std::atomic<int> live_flush_count;
+
+  // the decoders drop their packets up to the next flush packet
+  std::atomic<int> video_skip_to_flush;
+  std::atomic<int> audio_skip_to_flush;
 
   //
   AVPacket* flush_pkt;
 
 private:
-  void allocPicture();
+  void pictureSize(const AVFrame *pFrame, int *width, int *height);
+  void allocPicture(int width, int height);
 };
 
 #endif // VIDEO_STATE_H_
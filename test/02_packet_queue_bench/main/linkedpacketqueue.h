@@ -0,0 +1,38 @@
+
+// Baseline linked-list packet queue, kept for comparison with the SPSC ring in src/main.
+#ifndef LINKED_PACKET_QUEUE_H_
+#define LINKED_PACKET_QUEUE_H_
+
+extern "C"
+{
+#include <SDL.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "myavpacketlist.h"
+
+class LinkedPacketQueue
+{
+public:
+  explicit LinkedPacketQueue();
+  ~LinkedPacketQueue();
+
+  void init();
+  int put(AVPacket *packet);
+  int get(AVPacket *pkt, int block);
+  void clear();
+  void flush();
+
+  int size;
+  int nb_packets;
+  int quit;
+  SDL_cond *cond;
+
+private:
+  MyAVPacketList* first_pkt;
+  MyAVPacketList* last_pkt;
+  SDL_mutex *mutex;
+};
+
+#endif // LINKED_PACKET_QUEUE_H_
@@ -0,0 +1,142 @@
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "packetqueue.h"
+#include "linkedpacketqueue.h"
+
+#undef main
+
+// payload size of every packet, roughly one RTP payload
+#define BENCH_PACKET_SIZE 1400
+// length of each paced run
+#define BENCH_DURATION_SEC 2
+// number of packets of the unpaced run
+#define BENCH_UNPACED_PACKETS 1000000
+
+struct BenchResult
+{
+  double packetsPerSec = 0;
+  double p50Us = 0;
+  double p99Us = 0;
+  double maxUs = 0;
+};
+
+static inline int64_t nowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline double percentile(std::vector<int64_t>& values, double p)
+{
+  if (values.empty())
+  {
+    return 0;
+  }
+  size_t index = std::min(values.size() - 1, (size_t)(p * values.size()));
+  std::nth_element(values.begin(), values.begin() + index, values.end());
+  return values[index] / 1000.0;
+}
+
+template <class Queue>
+static BenchResult runBench(int rate, int count, const AVPacket *source)
+{
+  Queue queue;
+  queue.init();
+
+  // put -> get latency of every packet, measured on the consumer side
+  std::vector<int64_t> latencies;
+  latencies.reserve(count);
+
+  std::thread consumer([&]()
+  {
+    AVPacket *packet = av_packet_alloc();
+    for (int i = 0; i < count; i++)
+    {
+      if (queue.get(packet, 1) < 0)
+      {
+        break;
+      }
+      latencies.push_back(nowNs() - packet->pts);
+      av_packet_unref(packet);
+    }
+    av_packet_free(&packet);
+  });
+
+  AVPacket *packet = av_packet_alloc();
+  int64_t interval = rate > 0 ? 1000000000LL / rate : 0;
+  int64_t start = nowNs();
+  for (int i = 0; i < count; i++)
+  {
+    // pace the producer, sleeping is far too coarse at 100k packets/s
+    int64_t due = start + interval * i;
+    while (nowNs() < due)
+    {
+    }
+
+    // only the reference count is touched, the payload is shared
+    av_packet_ref(packet, source);
+    packet->pts = nowNs();
+    queue.put(packet);
+  }
+  consumer.join();
+  int64_t elapsed = nowNs() - start;
+  av_packet_free(&packet);
+
+  BenchResult result;
+  result.packetsPerSec = (double)latencies.size() * 1000000000.0 / (double)elapsed;
+  result.p50Us = percentile(latencies, 0.50);
+  result.p99Us = percentile(latencies, 0.99);
+  result.maxUs = percentile(latencies, 1.0);
+  return result;
+}
+
+static inline void printResult(const std::string& name, int rate, const BenchResult& result)
+{
+  std::cout << std::left << std::setw(14) << name
+            << std::right << std::setw(10) << (rate > 0 ? std::to_string(rate) : std::string("unpaced"))
+            << std::setw(14) << std::fixed << std::setprecision(0) << result.packetsPerSec
+            << std::setw(12) << std::setprecision(2) << result.p50Us
+            << std::setw(12) << result.p99Us
+            << std::setw(12) << result.maxUs
+            << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  AVPacket *source = av_packet_alloc();
+  if (!source || av_new_packet(source, BENCH_PACKET_SIZE) < 0)
+  {
+    std::cerr << "Could not alloc packet" << std::endl;
+    return -1;
+  }
+
+  std::cout << std::left << std::setw(14) << "queue"
+            << std::right << std::setw(10) << "rate"
+            << std::setw(14) << "packets/s"
+            << std::setw(12) << "p50 us"
+            << std::setw(12) << "p99 us"
+            << std::setw(12) << "max us"
+            << std::endl;
+
+  const int rates[] = { 1000, 10000, 100000 };
+  for (int rate : rates)
+  {
+    int count = rate * BENCH_DURATION_SEC;
+    printResult("linked list", rate, runBench<LinkedPacketQueue>(rate, count, source));
+    printResult("spsc ring", rate, runBench<PacketQueue>(rate, count, source));
+  }
+
+  // unpaced, limited by the queue itself
+  printResult("linked list", 0, runBench<LinkedPacketQueue>(0, BENCH_UNPACED_PACKETS, source));
+  printResult("spsc ring", 0, runBench<PacketQueue>(0, BENCH_UNPACED_PACKETS, source));
+
+  av_packet_free(&source);
+  return 0;
+}
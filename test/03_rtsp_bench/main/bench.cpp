@@ -0,0 +1,406 @@
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "corpus.h"
+#include "rtspstandin.h"
+
+// files written in the working directory
+#define BENCH_METRICS_FILE "rtspBench-metrics.prom"
+#define BENCH_CLIENT_LOG "rtspBench-client.log"
+
+struct BenchOptions
+{
+  std::string client;
+  std::string clientArgs;
+  std::vector<int> sessions = { 1, 2, 4, 8, 16, 32, 64 };
+  int warmupSec = 5;
+  int measureSec = 20;
+  // a session keeps up when it decodes at least this part of the source frame rate
+  double fpsRatio = 0.95;
+  // exit code 1 below this many sustained streams (0 to only report)
+  int minStreams = 0;
+};
+
+struct LevelResult
+{
+  int sessions = 0;
+  int sustained = 0;
+  double minFps = 0;
+  double captureP50 = 0;
+  double captureP95 = 0;
+  double captureP99 = 0;
+  double decodeP50 = 0;
+  double decodeP95 = 0;
+  double decodeP99 = 0;
+};
+
+// "name{labels}" -> value
+typedef std::map<std::string, double> MetricSnapshot;
+
+static void usage()
+{
+  std::cout << "usage: rtspBench --client=path/to/rtspClient [options]" << std::endl;
+  std::cout << "Runs the headless client against the local stand-in server with more and more sessions." << std::endl;
+  std::cout << "--client=path : rtspClient binary. Required." << std::endl;
+  std::cout << "--client-args=\"...\" : Additional options of the client, e.g. \"--decoder-threads=1\"." << std::endl;
+  std::cout << "--sessions=1,2,4 : Session counts to run. Default 1,2,4,8,16,32,64." << std::endl;
+  std::cout << "--warmup=value : Seconds before measuring each level. Default 5." << std::endl;
+  std::cout << "--measure=value : Seconds measured at each level. Default 20." << std::endl;
+  std::cout << "--fps-ratio=value : Part of the source frame rate every session must decode. Default 0.95." << std::endl;
+  std::cout << "--min-streams=value : Fail when fewer streams are sustained. Default 0, report only." << std::endl;
+  std::cout << "The server options --media, --port, --loss-percent, --jitter-ms, --bitrate-kbps, --seed" << std::endl;
+  std::cout << "and the --corpus-* options of rtspStandIn are accepted as well." << std::endl;
+}
+
+static int parseBenchOption(const std::string& name, const std::string& value, BenchOptions& opt)
+{
+  if (name == "--client")
+  {
+    opt.client = value;
+    return value.empty() ? -1 : 1;
+  }
+
+  if (name == "--client-args")
+  {
+    opt.clientArgs = value;
+    return 1;
+  }
+
+  if (name == "--sessions")
+  {
+    opt.sessions.clear();
+    std::istringstream list(value);
+    std::string count;
+    while (std::getline(list, count, ','))
+    {
+      opt.sessions.push_back(std::stoi(count));
+      if (opt.sessions.back() <= 0)
+      {
+        return -1;
+      }
+    }
+    return opt.sessions.empty() ? -1 : 1;
+  }
+
+  if (name == "--warmup")
+  {
+    opt.warmupSec = std::stoi(value);
+    return opt.warmupSec >= 0 ? 1 : -1;
+  }
+
+  if (name == "--measure")
+  {
+    opt.measureSec = std::stoi(value);
+    return opt.measureSec > 0 ? 1 : -1;
+  }
+
+  if (name == "--fps-ratio")
+  {
+    opt.fpsRatio = std::stod(value);
+    return opt.fpsRatio > 0 && opt.fpsRatio <= 1 ? 1 : -1;
+  }
+
+  if (name == "--min-streams")
+  {
+    opt.minStreams = std::stoi(value);
+    return opt.minStreams >= 0 ? 1 : -1;
+  }
+
+  return 0;
+}
+
+// Frame rate of the first video stream, what every session has to keep up with.
+static double mediaFps(const std::string& path)
+{
+  AVFormatContext *formatCtx = nullptr;
+  if (avformat_open_input(&formatCtx, path.c_str(), nullptr, nullptr) < 0)
+  {
+    std::cerr << "Could not open " << path << std::endl;
+    return 0;
+  }
+
+  double fps = 0;
+  if (avformat_find_stream_info(formatCtx, nullptr) >= 0)
+  {
+    int index = av_find_best_stream(formatCtx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (index >= 0)
+    {
+      AVRational rate = formatCtx->streams[index]->avg_frame_rate;
+      fps = rate.den ? av_q2d(rate) : 0;
+    }
+  }
+  avformat_close_input(&formatCtx);
+  return fps;
+}
+
+static MetricSnapshot readMetrics()
+{
+  MetricSnapshot snapshot;
+  std::ifstream in(BENCH_METRICS_FILE);
+  std::string line;
+  while (std::getline(in, line))
+  {
+    if (line.empty() || line[0] == '#')
+    {
+      continue;
+    }
+    size_t pos = line.rfind(' ');
+    if (pos == std::string::npos)
+    {
+      continue;
+    }
+    snapshot[line.substr(0, pos)] = std::strtod(line.c_str() + pos + 1, nullptr);
+  }
+  return snapshot;
+}
+
+static double counterDelta(const MetricSnapshot& before, const MetricSnapshot& after, const std::string& key)
+{
+  auto b = before.find(key);
+  auto a = after.find(key);
+  if (a == after.end())
+  {
+    return 0;
+  }
+  return a->second - (b == before.end() ? 0 : b->second);
+}
+
+// p50/p95/p99 in ms of a histogram family over the measured window, merged over every session.
+// Values are interpolated inside their bucket; the +Inf bucket reports its lower bound.
+static void histogramPercentiles(const MetricSnapshot& before, const MetricSnapshot& after, const std::string& family,
+  double *p50, double *p95, double *p99)
+{
+  // upper bound (s) -> cumulative count in the window
+  std::map<double, double> buckets;
+  std::string prefix = family + "_bucket{";
+  for (auto it = after.lower_bound(prefix); it != after.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+  {
+    size_t pos = it->first.find("le=\"");
+    if (pos == std::string::npos)
+    {
+      continue;
+    }
+    std::string le = it->first.substr(pos + 4, it->first.find('"', pos + 4) - pos - 4);
+    double bound = le == "+Inf" ? HUGE_VAL : std::strtod(le.c_str(), nullptr);
+    buckets[bound] += counterDelta(before, after, it->first);
+  }
+
+  double total = buckets.empty() ? 0 : buckets.rbegin()->second;
+  double *results[] = { p50, p95, p99 };
+  const double ranks[] = { 0.50, 0.95, 0.99 };
+  for (int i = 0; i < 3; i++)
+  {
+    *results[i] = 0;
+    if (total <= 0)
+    {
+      continue;
+    }
+
+    double rank = ranks[i] * total;
+    double lowerBound = 0;
+    double lowerCount = 0;
+    for (auto& bucket : buckets)
+    {
+      if (bucket.second >= rank)
+      {
+        double value = lowerBound;
+        if (bucket.first != HUGE_VAL && bucket.second > lowerCount)
+        {
+          value += (bucket.first - lowerBound) * (rank - lowerCount) / (bucket.second - lowerCount);
+        }
+        *results[i] = value * 1000;
+        break;
+      }
+      lowerBound = bucket.first;
+      lowerCount = bucket.second;
+    }
+  }
+}
+
+static LevelResult runLevel(int sessions, double sourceFps, const BenchOptions& opt, const StandInOptions& standInOpt)
+{
+  LevelResult result;
+  result.sessions = sessions;
+
+  RtspStandIn standIn;
+  if (standIn.start(standInOpt) < 0)
+  {
+    return result;
+  }
+
+  // a lost stream ends its session instead of reconnecting, the session then misses from the metrics
+  std::string command = "\"" + opt.client + "\" " + standIn.url("stream0") + " --headless";
+  for (int i = 1; i < sessions; i++)
+  {
+    command += " --url=" + standIn.url("stream" + std::to_string(i));
+  }
+  command += " --metrics-file=" BENCH_METRICS_FILE " --metrics-interval=1 --reconnect-max-ms=0 " + opt.clientArgs;
+  command += " > " BENCH_CLIENT_LOG " 2>&1";
+
+  std::remove(BENCH_METRICS_FILE);
+  std::thread client([command]()
+  {
+    if (std::system(command.c_str()) != 0)
+    {
+      std::cerr << "The client exited with an error, see " BENCH_CLIENT_LOG << std::endl;
+    }
+  });
+
+  std::this_thread::sleep_for(std::chrono::seconds(opt.warmupSec));
+  MetricSnapshot before = readMetrics();
+  std::this_thread::sleep_for(std::chrono::seconds(opt.measureSec));
+  MetricSnapshot after = readMetrics();
+
+  // the client ends with its streams
+  standIn.stop();
+  client.join();
+
+  result.minFps = HUGE_VAL;
+  for (int i = 0; i < sessions; i++)
+  {
+    std::string key = "rtsp_frames_decoded_total{session=\"" + std::to_string(i) + "\",stream=\"video\"}";
+    double fps = counterDelta(before, after, key) / opt.measureSec;
+    result.minFps = std::min(result.minFps, fps);
+  }
+  if (result.minFps >= opt.fpsRatio * sourceFps)
+  {
+    result.sustained = sessions;
+  }
+
+  histogramPercentiles(before, after, "rtsp_capture_to_display_seconds", &result.captureP50, &result.captureP95, &result.captureP99);
+  histogramPercentiles(before, after, "rtsp_decode_latency_seconds", &result.decodeP50, &result.decodeP95, &result.decodeP99);
+  return result;
+}
+
+static void printResult(const LevelResult& result)
+{
+  std::cout << std::setw(10) << result.sessions
+            << std::setw(10) << (result.sustained ? "yes" : "no")
+            << std::fixed << std::setprecision(1)
+            << std::setw(10) << result.minFps
+            << std::setw(10) << result.captureP50
+            << std::setw(10) << result.captureP95
+            << std::setw(10) << result.captureP99
+            << std::setw(10) << result.decodeP50
+            << std::setw(10) << result.decodeP95
+            << std::setw(10) << result.decodeP99
+            << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  BenchOptions opt;
+  StandInOptions standInOpt;
+  CorpusOptions corpus;
+  for (int i = 1; i < argc; i++)
+  {
+    // Options are given as "--name=value"
+    std::string arg = argv[i];
+    std::string name = arg;
+    std::string value;
+    size_t pos = arg.find('=');
+    if (pos != std::string::npos)
+    {
+      name = arg.substr(0, pos);
+      value = arg.substr(pos + 1);
+    }
+
+    int ret = 0;
+    try
+    {
+      ret = parseBenchOption(name, value, opt);
+      if (ret == 0)
+      {
+        ret = parseStandInOption(name, value, standInOpt);
+      }
+      if (ret == 0)
+      {
+        ret = parseCorpusOption(name, value, corpus);
+      }
+    }
+    catch (const std::exception&)
+    {
+      ret = -1;
+    }
+    if (ret <= 0)
+    {
+      std::cerr << "Failed to set option " << arg << std::endl;
+      usage();
+      return -1;
+    }
+  }
+
+  if (opt.client.empty())
+  {
+    usage();
+    return -1;
+  }
+
+  if (standInOpt.media.empty())
+  {
+    if (prepareCorpus(corpus) < 0)
+    {
+      return -1;
+    }
+    standInOpt.media = corpus.path;
+  }
+  double sourceFps = mediaFps(standInOpt.media);
+  if (sourceFps <= 0)
+  {
+    std::cerr << "No video frame rate in " << standInOpt.media << std::endl;
+    return -1;
+  }
+
+  unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+  std::cout << "media " << standInOpt.media << ", " << sourceFps << " fps, loss " << standInOpt.lossPercent
+            << "%, jitter " << standInOpt.jitterMs << " ms, link " << standInOpt.bitrateKbps << " kbps, "
+            << cores << " cores" << std::endl;
+  std::cout << std::setw(10) << "sessions"
+            << std::setw(10) << "sustained"
+            << std::setw(10) << "min fps"
+            << std::setw(10) << "c2d p50"
+            << std::setw(10) << "c2d p95"
+            << std::setw(10) << "c2d p99"
+            << std::setw(10) << "dec p50"
+            << std::setw(10) << "dec p95"
+            << std::setw(10) << "dec p99"
+            << std::endl;
+
+  // the levels go up until one is not sustained, the ones above it would not be either
+  int sustained = 0;
+  std::vector<int> levels = opt.sessions;
+  std::sort(levels.begin(), levels.end());
+  for (int sessions : levels)
+  {
+    LevelResult result = runLevel(sessions, sourceFps, opt, standInOpt);
+    printResult(result);
+    if (!result.sustained)
+    {
+      break;
+    }
+    sustained = result.sustained;
+  }
+
+  std::cout << "sustained streams " << sustained << ", streams per core "
+            << std::setprecision(2) << (double)sustained / cores
+            << " (latencies in ms, c2d: capture to display, dec: decode)" << std::endl;
+
+  if (sustained < opt.minStreams)
+  {
+    std::cerr << "Fewer than " << opt.minStreams << " streams sustained" << std::endl;
+    return 1;
+  }
+  return 0;
+}
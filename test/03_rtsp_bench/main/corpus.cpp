@@ -0,0 +1,262 @@
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include "corpus.h"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+}
+
+int parseCorpusOption(const std::string& name, const std::string& value, CorpusOptions& opt)
+{
+  if (name == "--corpus-size")
+  {
+    // WIDTHxHEIGHT, even for the 4:2:0 chroma planes
+    size_t pos = value.find('x');
+    if (pos == std::string::npos)
+    {
+      return -1;
+    }
+    opt.width = std::stoi(value.substr(0, pos));
+    opt.height = std::stoi(value.substr(pos + 1));
+    return opt.width > 0 && opt.height > 0 && opt.width % 2 == 0 && opt.height % 2 == 0 ? 1 : -1;
+  }
+
+  if (name == "--corpus-fps")
+  {
+    opt.fps = std::stoi(value);
+    return opt.fps > 0 ? 1 : -1;
+  }
+
+  if (name == "--corpus-kbps")
+  {
+    opt.bitrateKbps = std::stoi(value);
+    return opt.bitrateKbps > 0 ? 1 : -1;
+  }
+
+  if (name == "--corpus-seconds")
+  {
+    opt.seconds = std::stoi(value);
+    return opt.seconds > 0 ? 1 : -1;
+  }
+
+  if (name == "--corpus-gop")
+  {
+    opt.gop = std::stoi(value);
+    return opt.gop > 0 ? 1 : -1;
+  }
+
+  if (name == "--corpus-codec")
+  {
+    opt.codec = value;
+    return value.empty() ? -1 : 1;
+  }
+
+  return 0;
+}
+
+std::string corpusName(const CorpusOptions& opt)
+{
+  return "corpus-" + std::to_string(opt.width) + "x" + std::to_string(opt.height)
+    + "-" + std::to_string(opt.fps) + "fps-" + std::to_string(opt.bitrateKbps) + "kbps-"
+    + opt.codec + ".mp4";
+}
+
+// Moving gradient with a bar sweeping across it, enough motion to keep the encoder busy.
+static void drawFrame(AVFrame *frame, int index)
+{
+  for (int y = 0; y < frame->height; y++)
+  {
+    uint8_t *line = frame->data[0] + y * frame->linesize[0];
+    for (int x = 0; x < frame->width; x++)
+    {
+      line[x] = (uint8_t)(x + y + index * 3);
+    }
+  }
+
+  int barX = (index * 8) % frame->width;
+  int barWidth = frame->width / 16;
+  for (int y = 0; y < frame->height; y++)
+  {
+    uint8_t *line = frame->data[0] + y * frame->linesize[0];
+    for (int x = barX; x < barX + barWidth && x < frame->width; x++)
+    {
+      line[x] = 235;
+    }
+  }
+
+  for (int y = 0; y < frame->height / 2; y++)
+  {
+    uint8_t *lineU = frame->data[1] + y * frame->linesize[1];
+    uint8_t *lineV = frame->data[2] + y * frame->linesize[2];
+    for (int x = 0; x < frame->width / 2; x++)
+    {
+      lineU[x] = (uint8_t)(128 + y + index * 2);
+      lineV[x] = (uint8_t)(64 + x + index * 5);
+    }
+  }
+}
+
+static int writePackets(AVCodecContext *codecCtx, AVFormatContext *formatCtx, AVStream *stream, AVFrame *frame, AVPacket *packet)
+{
+  int ret = avcodec_send_frame(codecCtx, frame);
+  if (ret < 0)
+  {
+    std::cerr << "Could not send a frame to the encoder" << std::endl;
+    return ret;
+  }
+
+  for (;;)
+  {
+    ret = avcodec_receive_packet(codecCtx, packet);
+    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+    {
+      return 0;
+    }
+    if (ret < 0)
+    {
+      std::cerr << "Could not encode a frame" << std::endl;
+      return ret;
+    }
+
+    av_packet_rescale_ts(packet, codecCtx->time_base, stream->time_base);
+    packet->stream_index = stream->index;
+    ret = av_interleaved_write_frame(formatCtx, packet);
+    if (ret < 0)
+    {
+      std::cerr << "Could not write a packet" << std::endl;
+      return ret;
+    }
+  }
+}
+
+int generateCorpus(const CorpusOptions& opt)
+{
+  const AVCodec *codec = avcodec_find_encoder_by_name(opt.codec.c_str());
+  if (!codec)
+  {
+    std::cerr << "Unsupported encoder " << opt.codec << std::endl;
+    return -1;
+  }
+
+  AVFormatContext *formatCtx = nullptr;
+  if (avformat_alloc_output_context2(&formatCtx, nullptr, nullptr, opt.path.c_str()) < 0 || !formatCtx)
+  {
+    std::cerr << "Could not create the output " << opt.path << std::endl;
+    return -1;
+  }
+
+  AVStream *stream = avformat_new_stream(formatCtx, nullptr);
+  AVCodecContext *codecCtx = avcodec_alloc_context3(codec);
+  AVFrame *frame = av_frame_alloc();
+  AVPacket *packet = av_packet_alloc();
+  int ret = -1;
+  if (!stream || !codecCtx || !frame || !packet)
+  {
+    std::cerr << "Could not alloc the encoder" << std::endl;
+    goto end;
+  }
+
+  codecCtx->width = opt.width;
+  codecCtx->height = opt.height;
+  codecCtx->pix_fmt = AV_PIX_FMT_YUV420P;
+  codecCtx->time_base = AVRational{1, opt.fps};
+  codecCtx->framerate = AVRational{opt.fps, 1};
+  codecCtx->bit_rate = (int64_t)opt.bitrateKbps * 1000;
+  codecCtx->gop_size = opt.gop;
+  // no reordering, and one thread so that the output does not depend on the machine
+  codecCtx->max_b_frames = 0;
+  codecCtx->thread_count = 1;
+  if (formatCtx->oformat->flags & AVFMT_GLOBALHEADER)
+  {
+    codecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  if (avcodec_open2(codecCtx, codec, nullptr) < 0)
+  {
+    std::cerr << "Could not open the encoder" << std::endl;
+    goto end;
+  }
+  if (avcodec_parameters_from_context(stream->codecpar, codecCtx) < 0)
+  {
+    goto end;
+  }
+  stream->time_base = codecCtx->time_base;
+
+  if (!(formatCtx->oformat->flags & AVFMT_NOFILE) && avio_open(&formatCtx->pb, opt.path.c_str(), AVIO_FLAG_WRITE) < 0)
+  {
+    std::cerr << "Could not open " << opt.path << std::endl;
+    goto end;
+  }
+  if (avformat_write_header(formatCtx, nullptr) < 0)
+  {
+    std::cerr << "Could not write the header of " << opt.path << std::endl;
+    goto end;
+  }
+
+  frame->format = codecCtx->pix_fmt;
+  frame->width = codecCtx->width;
+  frame->height = codecCtx->height;
+  if (av_frame_get_buffer(frame, 0) < 0)
+  {
+    goto end;
+  }
+
+  for (int i = 0; i < opt.fps * opt.seconds; i++)
+  {
+    if (av_frame_make_writable(frame) < 0)
+    {
+      goto end;
+    }
+    drawFrame(frame, i);
+    frame->pts = i;
+    if (writePackets(codecCtx, formatCtx, stream, frame, packet) < 0)
+    {
+      goto end;
+    }
+  }
+
+  // drain the encoder
+  if (writePackets(codecCtx, formatCtx, stream, nullptr, packet) < 0)
+  {
+    goto end;
+  }
+  av_write_trailer(formatCtx);
+  ret = 0;
+
+end:
+  av_packet_free(&packet);
+  av_frame_free(&frame);
+  avcodec_free_context(&codecCtx);
+  if (formatCtx && !(formatCtx->oformat->flags & AVFMT_NOFILE))
+  {
+    avio_closep(&formatCtx->pb);
+  }
+  avformat_free_context(formatCtx);
+  return ret;
+}
+
+int prepareCorpus(CorpusOptions& opt)
+{
+  if (opt.path.empty())
+  {
+    opt.path = corpusName(opt);
+  }
+  if (std::ifstream(opt.path).good())
+  {
+    return 0;
+  }
+
+  std::cout << "Generating " << opt.path << std::endl;
+  int ret = generateCorpus(opt);
+  if (ret < 0)
+  {
+    // no half written clip for the next run to pick up
+    std::remove(opt.path.c_str());
+  }
+  return ret;
+}
@@ -0,0 +1,35 @@
+
+#ifndef CORPUS_H_
+#define CORPUS_H_
+
+#include <string>
+
+// A synthetic clip, the same options always give the same file.
+struct CorpusOptions
+{
+  std::string path;
+  int width = 1280;
+  int height = 720;
+  int fps = 25;
+  int bitrateKbps = 2000;
+  int seconds = 10;
+  // frames between two keyframes
+  int gop = 50;
+  // encoder name, mpeg4 is built into every libavcodec
+  std::string codec = "mpeg4";
+};
+
+// "--corpus-*" options: 1 when taken, 0 when not one of them, -1 when invalid.
+int parseCorpusOption(const std::string& name, const std::string& value, CorpusOptions& opt);
+
+// File name of the clip made of these options, without directory.
+std::string corpusName(const CorpusOptions& opt);
+
+// Encode a moving test pattern without b-frames (pts == dts, as cameras send it) to opt.path.
+int generateCorpus(const CorpusOptions& opt);
+
+// Clip of the benchmark runs: named after its options when opt.path is empty, and only
+// generated when the file is not there yet.
+int prepareCorpus(CorpusOptions& opt);
+
+#endif // CORPUS_H_
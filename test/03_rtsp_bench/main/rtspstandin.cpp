@@ -0,0 +1,741 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include "rtspstandin.h"
+
+#ifdef MSG_NOSIGNAL
+#define STAND_IN_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define STAND_IN_SEND_FLAGS 0
+#endif
+
+// burst the link accepts above its rate
+#define STAND_IN_BURST_MS 100
+
+int parseStandInOption(const std::string& name, const std::string& value, StandInOptions& opt)
+{
+  if (name == "--media")
+  {
+    opt.media = value;
+    return value.empty() ? -1 : 1;
+  }
+
+  if (name == "--port")
+  {
+    opt.port = std::stoi(value);
+    return opt.port > 0 && opt.port < 65536 ? 1 : -1;
+  }
+
+  if (name == "--loop")
+  {
+    opt.loop = std::stoi(value);
+    return 1;
+  }
+
+  if (name == "--loss-percent")
+  {
+    opt.lossPercent = std::stod(value);
+    return opt.lossPercent >= 0 && opt.lossPercent < 100 ? 1 : -1;
+  }
+
+  if (name == "--jitter-ms")
+  {
+    opt.jitterMs = std::stoi(value);
+    return opt.jitterMs >= 0 ? 1 : -1;
+  }
+
+  if (name == "--bitrate-kbps")
+  {
+    opt.bitrateKbps = std::stoi(value);
+    return opt.bitrateKbps >= 0 ? 1 : -1;
+  }
+
+  if (name == "--seed")
+  {
+    opt.seed = (unsigned int)std::stoul(value);
+    return 1;
+  }
+
+  return 0;
+}
+
+RtspStandIn::RtspStandIn()
+  : m_listener(INVALID_SOCKET)
+  , m_quit(0)
+  , m_nextSeed(0)
+{
+}
+
+RtspStandIn::~RtspStandIn()
+{
+  this->stop();
+}
+
+int RtspStandIn::start(const StandInOptions& opt)
+{
+  m_options = opt;
+  m_nextSeed = opt.seed;
+  m_quit = 0;
+
+#ifdef _WIN32
+  WSADATA wsaData;
+  if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+  {
+    std::cerr << "Could not initialize winsock" << std::endl;
+    return -1;
+  }
+#endif
+
+  m_listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (m_listener == INVALID_SOCKET)
+  {
+    std::cerr << "Could not create the listening socket" << std::endl;
+    return -1;
+  }
+
+  // the port is reused right away from one benchmark run to the next
+  int reuse = 1;
+  setsockopt(m_listener, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+
+  // loopback only, this is not meant to be reachable from the network
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((unsigned short)opt.port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(m_listener, (const sockaddr *)&addr, sizeof(addr)) != 0 || listen(m_listener, 64) != 0)
+  {
+    std::cerr << "Could not listen on port " << opt.port << std::endl;
+    closesocket(m_listener);
+    m_listener = INVALID_SOCKET;
+    return -1;
+  }
+
+  m_thread = std::thread([&](RtspStandIn* standIn)
+  {
+    standIn->acceptThread();
+  }, this);
+
+  return 0;
+}
+
+void RtspStandIn::stop()
+{
+  m_quit = 1;
+  if (m_thread.joinable())
+  {
+    m_thread.join();
+  }
+  if (m_listener != INVALID_SOCKET)
+  {
+    closesocket(m_listener);
+    m_listener = INVALID_SOCKET;
+#ifdef _WIN32
+    WSACleanup();
+#endif
+  }
+
+  // every client sees its connection close, i.e. the end of the stream
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_connections.clear();
+}
+
+std::string RtspStandIn::url(const std::string& path) const
+{
+  return "rtsp://127.0.0.1:" + std::to_string(m_options.port) + "/" + path;
+}
+
+int RtspStandIn::connections()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return (int)m_connections.size();
+}
+
+int RtspStandIn::acceptThread()
+{
+  while (!m_quit)
+  {
+    // wake up regularly to check the quit flag
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(m_listener, &readSet);
+    timeval timeout{0, 100000};
+    if (select((int)m_listener + 1, &readSet, nullptr, nullptr, &timeout) <= 0)
+    {
+      this->reapConnections();
+      continue;
+    }
+
+    SOCKET client = accept(m_listener, nullptr, nullptr);
+    if (client == INVALID_SOCKET)
+    {
+      continue;
+    }
+
+    // small interleaved rtp packets must not wait for each other
+    int nodelay = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
+
+    std::unique_ptr<StandInConnection> connection = std::make_unique<StandInConnection>();
+    if (connection->start(client, m_options, m_nextSeed++) < 0)
+    {
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_connections.push_back(std::move(connection));
+  }
+
+  return 0;
+}
+
+void RtspStandIn::reapConnections()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_connections.erase(
+    std::remove_if(m_connections.begin(), m_connections.end(),
+      [](const std::unique_ptr<StandInConnection>& connection) { return connection->finished(); })
+    , m_connections.end());
+}
+
+StandInConnection::StandInConnection()
+  : m_socket(INVALID_SOCKET)
+  , m_quit(0)
+  , m_finished(0)
+  , m_playing(0)
+  , m_input(nullptr)
+  , m_packet(nullptr)
+  , m_havePacket(0)
+  , m_playStart(0)
+  , m_loopOffset(0)
+  , m_loopEnd(0)
+  , m_credit(0)
+  , m_creditTime(0)
+{
+}
+
+StandInConnection::~StandInConnection()
+{
+  this->stop();
+}
+
+int StandInConnection::start(SOCKET socket, const StandInOptions& opt, unsigned int seed)
+{
+  m_socket = socket;
+  m_options = opt;
+  m_random.seed(seed);
+
+  m_thread = std::thread([&](StandInConnection* connection)
+  {
+    connection->connectionThread();
+  }, this);
+
+  return 0;
+}
+
+void StandInConnection::stop()
+{
+  m_quit = 1;
+  if (m_thread.joinable())
+  {
+    m_thread.join();
+  }
+}
+
+int StandInConnection::connectionThread()
+{
+  if (this->openMedia() == 0)
+  {
+    while (!m_quit)
+    {
+      // requests are answered between packets, waiting at most until the next one is due
+      if (this->readRequests(this->nextWait()) < 0)
+      {
+        break;
+      }
+      if (!m_playing)
+      {
+        continue;
+      }
+
+      int ret = 0;
+      while (!m_quit && (ret = this->sendPacket()) > 0)
+      {
+      }
+      if (ret < 0)
+      {
+        break;
+      }
+    }
+  }
+
+  this->closeMedia();
+  closesocket(m_socket);
+  m_socket = INVALID_SOCKET;
+  m_finished = 1;
+  return 0;
+}
+
+int StandInConnection::openMedia()
+{
+  if (avformat_open_input(&m_input, m_options.media.c_str(), nullptr, nullptr) < 0 ||
+      avformat_find_stream_info(m_input, nullptr) < 0)
+  {
+    std::cerr << "Could not open " << m_options.media << std::endl;
+    return -1;
+  }
+
+  m_packet = av_packet_alloc();
+  if (!m_packet)
+  {
+    return -1;
+  }
+
+  // one rtp muxer per stream, the write callback gets their addresses
+  m_outputs.reserve(m_input->nb_streams);
+  for (unsigned int i = 0; i < m_input->nb_streams; i++)
+  {
+    AVStream *in = m_input->streams[i];
+    if (in->codecpar->codec_type != AVMEDIA_TYPE_VIDEO && in->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
+    {
+      continue;
+    }
+
+    m_outputs.emplace_back();
+    RtpOutput& output = m_outputs.back();
+    output.connection = this;
+    output.inputIndex = (int)i;
+    output.channel = 2 * ((int)m_outputs.size() - 1);
+
+    AVStream *out = nullptr;
+    uint8_t *buffer = (uint8_t *)av_malloc(STAND_IN_RTP_PACKET_SIZE);
+    if (avformat_alloc_output_context2(&output.ctx, nullptr, "rtp", "rtp://127.0.0.1") < 0 ||
+        !(out = avformat_new_stream(output.ctx, nullptr)) ||
+        avcodec_parameters_copy(out->codecpar, in->codecpar) < 0 ||
+        !buffer)
+    {
+      av_free(buffer);
+      return -1;
+    }
+    out->time_base = in->time_base;
+
+    // every flush of the muxer is one rtp or rtcp packet
+    output.ctx->pb = avio_alloc_context(buffer, STAND_IN_RTP_PACKET_SIZE, 1, &output, nullptr, writeRtp, nullptr);
+    if (!output.ctx->pb)
+    {
+      av_free(buffer);
+      return -1;
+    }
+    output.ctx->pb->max_packet_size = STAND_IN_RTP_PACKET_SIZE;
+
+    if (avformat_write_header(output.ctx, nullptr) < 0)
+    {
+      std::cerr << "Stream " << i << " of " << m_options.media << " cannot be sent over rtp" << std::endl;
+      return -1;
+    }
+  }
+
+  if (m_outputs.empty())
+  {
+    std::cerr << "Nothing to stream in " << m_options.media << std::endl;
+    return -1;
+  }
+
+  return 0;
+}
+
+void StandInConnection::closeMedia()
+{
+  for (auto& output : m_outputs)
+  {
+    if (output.ctx)
+    {
+      if (output.ctx->pb)
+      {
+        av_freep(&output.ctx->pb->buffer);
+        avio_context_free(&output.ctx->pb);
+      }
+      avformat_free_context(output.ctx);
+      output.ctx = nullptr;
+    }
+  }
+  m_outputs.clear();
+
+  av_packet_free(&m_packet);
+  if (m_input)
+  {
+    avformat_close_input(&m_input);
+  }
+}
+
+int StandInConnection::readRequests(int timeout_ms)
+{
+  fd_set readSet;
+  FD_ZERO(&readSet);
+  FD_SET(m_socket, &readSet);
+  timeval timeout{timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+  int ret = select((int)m_socket + 1, &readSet, nullptr, nullptr, &timeout);
+  if (ret < 0)
+  {
+    return -1;
+  }
+  if (ret == 0)
+  {
+    return 0;
+  }
+
+  char buffer[4096];
+  int received = recv(m_socket, buffer, sizeof(buffer), 0);
+  if (received <= 0)
+  {
+    // the client went away
+    return -1;
+  }
+  m_request.append(buffer, received);
+
+  while (!m_request.empty())
+  {
+    if (m_request[0] == '$')
+    {
+      // interleaved rtcp receiver reports from the client, skipped
+      if (m_request.size() < 4)
+      {
+        break;
+      }
+      size_t size = 4 + (((uint8_t)m_request[2] << 8) | (uint8_t)m_request[3]);
+      if (m_request.size() < size)
+      {
+        break;
+      }
+      m_request.erase(0, size);
+      continue;
+    }
+
+    size_t end = m_request.find("\r\n\r\n");
+    if (end == std::string::npos)
+    {
+      break;
+    }
+    std::string request = m_request.substr(0, end + 4);
+    std::string length = header(request, "Content-Length");
+    size_t size = end + 4 + (length.empty() ? 0 : std::stoul(length));
+    if (m_request.size() < size)
+    {
+      break;
+    }
+    m_request.erase(0, size);
+
+    if (this->handleRequest(request) < 0)
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+int StandInConnection::handleRequest(const std::string& request)
+{
+  std::istringstream line(request.substr(0, request.find("\r\n")));
+  std::string method;
+  std::string url;
+  line >> method >> url;
+  std::string cseqValue = header(request, "CSeq");
+  int cseq = cseqValue.empty() ? 0 : std::stoi(cseqValue);
+
+  if (method == "OPTIONS")
+  {
+    return this->reply(200, "OK", cseq, "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, GET_PARAMETER, SET_PARAMETER\r\n", "");
+  }
+
+  if (method == "DESCRIBE")
+  {
+    std::vector<AVFormatContext*> contexts;
+    for (auto& output : m_outputs)
+    {
+      contexts.push_back(output.ctx);
+    }
+    // without a port in their url the streams are named streamid=<index> in the sdp
+    char sdp[16384];
+    if (av_sdp_create(contexts.data(), (int)contexts.size(), sdp, sizeof(sdp)) < 0)
+    {
+      return this->reply(500, "Internal Server Error", cseq, "", "");
+    }
+    return this->reply(200, "OK", cseq, "Content-Base: " + url + "/\r\nContent-Type: application/sdp\r\n", sdp);
+  }
+
+  if (method == "SETUP")
+  {
+    // everything goes over the RTSP connection
+    std::string transport = header(request, "Transport");
+    if (transport.find("TCP") == std::string::npos)
+    {
+      return this->reply(461, "Unsupported Transport", cseq, "", "");
+    }
+
+    size_t pos = url.rfind("streamid=");
+    size_t index = pos == std::string::npos ? 0 : std::stoul(url.substr(pos + 9));
+    if (index >= m_outputs.size())
+    {
+      return this->reply(404, "Not Found", cseq, "", "");
+    }
+
+    RtpOutput& output = m_outputs[index];
+    pos = transport.find("interleaved=");
+    if (pos != std::string::npos)
+    {
+      output.channel = std::stoi(transport.substr(pos + 12));
+    }
+    output.setup = 1;
+
+    if (m_sessionId.empty())
+    {
+      m_sessionId = std::to_string(m_random() % 100000000 + 1);
+    }
+    return this->reply(200, "OK", cseq,
+      "Transport: RTP/AVP/TCP;unicast;interleaved=" + std::to_string(output.channel) + "-" + std::to_string(output.channel + 1) + "\r\n", "");
+  }
+
+  if (method == "PLAY")
+  {
+    int ret = this->reply(200, "OK", cseq, "Range: npt=0.000-\r\n", "");
+    if (!m_playing)
+    {
+      m_playing = 1;
+      m_playStart = av_gettime_relative();
+      m_creditTime = m_playStart;
+    }
+    return ret;
+  }
+
+  if (method == "TEARDOWN")
+  {
+    this->reply(200, "OK", cseq, "", "");
+    return -1;
+  }
+
+  if (method == "GET_PARAMETER" || method == "SET_PARAMETER")
+  {
+    // keep alive
+    return this->reply(200, "OK", cseq, "", "");
+  }
+
+  return this->reply(501, "Not Implemented", cseq, "", "");
+}
+
+int StandInConnection::reply(int status, const std::string& reason, int cseq, const std::string& headers, const std::string& body)
+{
+  std::string response = "RTSP/1.0 " + std::to_string(status) + " " + reason + "\r\n";
+  response += "CSeq: " + std::to_string(cseq) + "\r\n";
+  if (!m_sessionId.empty())
+  {
+    response += "Session: " + m_sessionId + ";timeout=60\r\n";
+  }
+  response += headers;
+  if (!body.empty())
+  {
+    response += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+  }
+  response += "\r\n" + body;
+  return this->sendAll((const uint8_t *)response.data(), response.size());
+}
+
+int StandInConnection::sendPacket()
+{
+  if (!m_havePacket)
+  {
+    int ret = av_read_frame(m_input, m_packet);
+    if (ret < 0 && m_options.loop)
+    {
+      // start over, later on the timeline
+      av_seek_frame(m_input, -1, m_input->start_time != AV_NOPTS_VALUE ? m_input->start_time : 0, AVSEEK_FLAG_BACKWARD);
+      m_loopOffset = m_loopEnd;
+      ret = av_read_frame(m_input, m_packet);
+    }
+    if (ret < 0)
+    {
+      // the end of the media is the end of the stream
+      return -1;
+    }
+    m_havePacket = 1;
+  }
+
+  // not due yet
+  int64_t time = this->packetTime(m_packet);
+  if (av_gettime_relative() < m_playStart + time)
+  {
+    return 0;
+  }
+  m_havePacket = 0;
+
+  RtpOutput *output = nullptr;
+  for (auto& candidate : m_outputs)
+  {
+    if (candidate.inputIndex == m_packet->stream_index && candidate.setup)
+    {
+      output = &candidate;
+    }
+  }
+  if (!output)
+  {
+    av_packet_unref(m_packet);
+    return 1;
+  }
+
+  // a late network: some packets leave later than they should
+  if (m_options.jitterMs > 0)
+  {
+    std::uniform_int_distribution<int> jitter(0, m_options.jitterMs * 1000);
+    av_usleep(jitter(m_random));
+  }
+
+  // a narrow link: packets wait for the bytes before them to go through
+  if (m_options.bitrateKbps > 0)
+  {
+    double rate = m_options.bitrateKbps * 1000.0 / 8 / 1000000;
+    int64_t now = av_gettime_relative();
+    m_credit = std::min(m_credit + (now - m_creditTime) * rate, rate * STAND_IN_BURST_MS * 1000);
+    m_creditTime = now;
+    if (m_credit < m_packet->size)
+    {
+      int64_t wait = (int64_t)((m_packet->size - m_credit) / rate);
+      av_usleep((unsigned)wait);
+      m_credit += wait * rate;
+      m_creditTime += wait;
+    }
+    m_credit -= m_packet->size;
+  }
+
+  // from the file timeline (looped) to the rtp stream
+  AVStream *in = m_input->streams[m_packet->stream_index];
+  AVStream *out = output->ctx->streams[0];
+  int64_t start = m_input->start_time != AV_NOPTS_VALUE ? m_input->start_time : 0;
+  int64_t duration = av_rescale_q(m_packet->duration, in->time_base, AVRational{1, AV_TIME_BASE});
+  if (m_packet->pts != AV_NOPTS_VALUE)
+  {
+    int64_t pts = av_rescale_q(m_packet->pts, in->time_base, AVRational{1, AV_TIME_BASE}) - start + m_loopOffset;
+    m_loopEnd = std::max(m_loopEnd, pts + duration);
+    m_packet->pts = av_rescale_q(pts, AVRational{1, AV_TIME_BASE}, out->time_base);
+  }
+  if (m_packet->dts != AV_NOPTS_VALUE)
+  {
+    int64_t dts = av_rescale_q(m_packet->dts, in->time_base, AVRational{1, AV_TIME_BASE}) - start + m_loopOffset;
+    m_loopEnd = std::max(m_loopEnd, dts + duration);
+    m_packet->dts = av_rescale_q(dts, AVRational{1, AV_TIME_BASE}, out->time_base);
+  }
+  m_packet->duration = av_rescale_q(m_packet->duration, in->time_base, out->time_base);
+  m_packet->stream_index = 0;
+  m_packet->pos = -1;
+
+  int ret = av_write_frame(output->ctx, m_packet);
+  av_packet_unref(m_packet);
+  if (ret < 0 || output->ctx->pb->error)
+  {
+    return -1;
+  }
+  return 1;
+}
+
+int StandInConnection::nextWait()
+{
+  if (!m_playing)
+  {
+    return 100;
+  }
+  if (!m_havePacket)
+  {
+    return 0;
+  }
+  int64_t wait = m_playStart + this->packetTime(m_packet) - av_gettime_relative();
+  return (int)std::min<int64_t>(std::max<int64_t>((wait + 999) / 1000, 0), 10);
+}
+
+int64_t StandInConnection::packetTime(const AVPacket *packet)
+{
+  // when the packet is due after PLAY, us
+  int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+  if (ts == AV_NOPTS_VALUE)
+  {
+    return 0;
+  }
+  int64_t start = m_input->start_time != AV_NOPTS_VALUE ? m_input->start_time : 0;
+  return av_rescale_q(ts, m_input->streams[packet->stream_index]->time_base, AVRational{1, AV_TIME_BASE}) - start + m_loopOffset;
+}
+
+int StandInConnection::sendAll(const uint8_t *data, size_t size)
+{
+  size_t sent = 0;
+  while (sent < size)
+  {
+    int ret = send(m_socket, (const char *)data + sent, (int)(size - sent), STAND_IN_SEND_FLAGS);
+    if (ret <= 0)
+    {
+      return -1;
+    }
+    sent += ret;
+  }
+  return 0;
+}
+
+int StandInConnection::sendInterleaved(int channel, const uint8_t *data, int size)
+{
+  // RFC 2326 10.12: '$', channel, 16 bit length, then the packet
+  uint8_t frame[4 + STAND_IN_RTP_PACKET_SIZE];
+  if (size > STAND_IN_RTP_PACKET_SIZE)
+  {
+    return -1;
+  }
+  frame[0] = '$';
+  frame[1] = (uint8_t)channel;
+  frame[2] = (uint8_t)(size >> 8);
+  frame[3] = (uint8_t)(size & 0xff);
+  memcpy(frame + 4, data, size);
+  return this->sendAll(frame, 4 + size);
+}
+
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+int StandInConnection::writeRtp(void *opaque, uint8_t *buf, int buf_size)
+#else
+int StandInConnection::writeRtp(void *opaque, const uint8_t *buf, int buf_size)
+#endif
+{
+  RtpOutput *output = (RtpOutput *)opaque;
+  StandInConnection *connection = output->connection;
+
+  // rtcp (payload types 200 to 204) goes on the odd channel and is never lost
+  int rtcp = buf_size >= 2 && buf[1] >= 200 && buf[1] <= 204;
+  if (!rtcp && connection->m_options.lossPercent > 0)
+  {
+    std::uniform_real_distribution<double> draw(0, 100);
+    if (draw(connection->m_random) < connection->m_options.lossPercent)
+    {
+      return buf_size;
+    }
+  }
+
+  if (connection->sendInterleaved(output->channel + rtcp, buf, buf_size) < 0)
+  {
+    return AVERROR(EIO);
+  }
+  return buf_size;
+}
+
+std::string StandInConnection::header(const std::string& request, const std::string& name)
+{
+  // header names are case insensitive
+  std::istringstream lines(request);
+  std::string line;
+  while (std::getline(lines, line))
+  {
+    if (line.size() > name.size() && line[name.size()] == ':' &&
+        std::equal(name.begin(), name.end(), line.begin(),
+          [](char a, char b) { return std::tolower((unsigned char)a) == std::tolower((unsigned char)b); }))
+    {
+      size_t start = line.find_first_not_of(" \t", name.size() + 1);
+      size_t end = line.find_last_not_of(" \t\r");
+      return start == std::string::npos ? "" : line.substr(start, end - start + 1);
+    }
+  }
+  return "";
+}
@@ -0,0 +1,155 @@
+
+#ifndef RTSP_STAND_IN_H_
+#define RTSP_STAND_IN_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#endif
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+}
+
+// largest rtp packet handed to the connection, payload and header
+#define STAND_IN_RTP_PACKET_SIZE 1400
+
+// Network conditions applied to every connection.
+struct StandInOptions
+{
+  std::string media;
+  int port = 8554;
+  // loop the media until stop() instead of ending the stream with the file
+  int loop = 1;
+  // rtp packets dropped at random, percent
+  double lossPercent = 0;
+  // random delay before each media packet, up to this
+  int jitterMs = 0;
+  // link capacity, packets wait for it (0 for unlimited)
+  int bitrateKbps = 0;
+  // seed of the loss and jitter draws, the same run drops the same packets
+  unsigned int seed = 1;
+};
+
+// "--name=value" options of the server: 1 when taken, 0 when not one of them, -1 when invalid.
+int parseStandInOption(const std::string& name, const std::string& value, StandInOptions& opt);
+
+class StandInConnection;
+
+// A local RTSP server standing in for IP cameras in benchmarks.
+// Every connection gets its own demuxer of the media file, paced to real time, packetised
+// by the libavformat rtp muxer (which also sends the rtcp sender reports mapping the
+// timestamps to the wall clock) and interleaved on the RTSP connection (RTP/AVP/TCP).
+// Loss, jitter and a bitrate cap are applied on the way out.
+// One thread accepts connections, each connection runs on its own thread.
+class RtspStandIn
+{
+public:
+  explicit RtspStandIn();
+  ~RtspStandIn();
+
+  int start(const StandInOptions& opt);
+  void stop();
+  std::string url(const std::string& path) const;
+  int connections();
+
+private:
+  StandInOptions m_options;
+  SOCKET m_listener;
+  std::thread m_thread;
+  std::atomic<int> m_quit;
+  std::mutex m_mutex;
+  std::vector<std::unique_ptr<StandInConnection>> m_connections;
+  unsigned int m_nextSeed;
+
+  int acceptThread();
+  void reapConnections();
+};
+
+// One RTSP client of the stand-in server.
+class StandInConnection
+{
+public:
+  explicit StandInConnection();
+  ~StandInConnection();
+
+  int start(SOCKET socket, const StandInOptions& opt, unsigned int seed);
+  void stop();
+  bool finished() const { return m_finished != 0; }
+
+private:
+  struct RtpOutput
+  {
+    StandInConnection *connection = nullptr;
+    AVFormatContext *ctx = nullptr;
+    int inputIndex = -1;
+    int channel = 0;
+    int setup = 0;
+  };
+
+  StandInOptions m_options;
+  SOCKET m_socket;
+  std::thread m_thread;
+  std::atomic<int> m_quit;
+  std::atomic<int> m_finished;
+  std::string m_request;
+  std::string m_sessionId;
+  std::mt19937 m_random;
+  int m_playing;
+
+  // media
+  AVFormatContext *m_input;
+  AVPacket *m_packet;
+  std::vector<RtpOutput> m_outputs;
+  int m_havePacket;
+  int64_t m_playStart;
+  int64_t m_loopOffset;
+  int64_t m_loopEnd;
+
+  // bitrate cap, bytes allowed ahead of the link rate
+  double m_credit;
+  int64_t m_creditTime;
+
+  int connectionThread();
+  int openMedia();
+  void closeMedia();
+  int readRequests(int timeout_ms);
+  int handleRequest(const std::string& request);
+  int reply(int status, const std::string& reason, int cseq, const std::string& headers, const std::string& body);
+  int sendPacket();
+  int nextWait();
+  int sendAll(const uint8_t *data, size_t size);
+  int sendInterleaved(int channel, const uint8_t *data, int size);
+  int64_t packetTime(const AVPacket *packet);
+
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+  static int writeRtp(void *opaque, uint8_t *buf, int buf_size);
+#else
+  static int writeRtp(void *opaque, const uint8_t *buf, int buf_size);
+#endif
+  static std::string header(const std::string& request, const std::string& name);
+};
+
+#endif // RTSP_STAND_IN_H_
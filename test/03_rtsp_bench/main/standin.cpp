@@ -0,0 +1,82 @@
+
+#include <iostream>
+#include <string>
+
+#include "corpus.h"
+#include "rtspstandin.h"
+
+static void usage()
+{
+  std::cout << "usage: rtspStandIn [options]" << std::endl;
+  std::cout << "Serves a media file to RTSP clients on 127.0.0.1, until Enter is pressed." << std::endl;
+  std::cout << "--media=file : File to serve. Default: a generated test clip, see the --corpus-* options." << std::endl;
+  std::cout << "--port=value : RTSP port. Default 8554." << std::endl;
+  std::cout << "--loop=0|1 : Loop the file. Default 1." << std::endl;
+  std::cout << "--loss-percent=value : RTP packets dropped at random. Default 0." << std::endl;
+  std::cout << "--jitter-ms=value : Random delay of up to this before each media packet. Default 0." << std::endl;
+  std::cout << "--bitrate-kbps=value : Capacity of every connection, 0 for unlimited. Default 0." << std::endl;
+  std::cout << "--seed=value : Seed of the loss and jitter draws. Default 1." << std::endl;
+  std::cout << "--corpus-size=WxH, --corpus-fps=value, --corpus-kbps=value, --corpus-seconds=value," << std::endl;
+  std::cout << "--corpus-gop=value, --corpus-codec=name : Test clip. Default 1280x720, 25 fps, 2000 kbps, 10 s, 50, mpeg4." << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  StandInOptions opt;
+  CorpusOptions corpus;
+  for (int i = 1; i < argc; i++)
+  {
+    // Options are given as "--name=value"
+    std::string arg = argv[i];
+    std::string name = arg;
+    std::string value;
+    size_t pos = arg.find('=');
+    if (pos != std::string::npos)
+    {
+      name = arg.substr(0, pos);
+      value = arg.substr(pos + 1);
+    }
+
+    int ret = 0;
+    try
+    {
+      ret = parseStandInOption(name, value, opt);
+      if (ret == 0)
+      {
+        ret = parseCorpusOption(name, value, corpus);
+      }
+    }
+    catch (const std::exception&)
+    {
+      ret = -1;
+    }
+    if (ret <= 0)
+    {
+      std::cerr << "Failed to set option " << arg << std::endl;
+      usage();
+      return -1;
+    }
+  }
+
+  if (opt.media.empty())
+  {
+    if (prepareCorpus(corpus) < 0)
+    {
+      return -1;
+    }
+    opt.media = corpus.path;
+  }
+
+  RtspStandIn standIn;
+  if (standIn.start(opt) < 0)
+  {
+    return -1;
+  }
+  std::cout << "Serving " << opt.media << " at " << standIn.url("stream") << ", any path, press Enter to stop." << std::endl;
+
+  std::string line;
+  std::getline(std::cin, line);
+
+  standIn.stop();
+  return 0;
+}